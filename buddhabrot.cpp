@@ -8,370 +8,5994 @@
 #include <chrono>
 #include <random>
 #include <sstream>
+#include <thread>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <csignal>
+#include <condition_variable>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/stat.h>
+#include "render_host.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BUDDHABROT_X86_SIMD
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BUDDHABROT_NEON_SIMD
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define BUDDHABROT_MMAP
+#endif
 typedef float HeatmapType;
 using namespace std;
 
 vector<float> vertices;
-// settings
+// settings; the image defaults of RenderConfig, see printRenderUsage
 const int IMAGE_HEIGHT = 200;
 const int IMAGE_WIDTH = 200;
 const int RED_ITERS = 200;
 const int BLUE_ITERS = 800;
 const int GREEN_ITERS = 200;
 const long long int SAMPLE_COUNT = IMAGE_WIDTH * IMAGE_HEIGHT * 100;
+const int SAMPLE_BATCH = 64; // Samples handed to the escape kernel at once
+const long long SAMPLE_UNIT = 1 << 16; // Samples a worker claims at a time; fixed so the split never depends on the thread count
+const uint32_t UNIFORM_STREAM = 0;
+// Contribution map draws. Metropolis keys its chains by firstSample + 1 instead, but
+//  never shares a render with a contribution map.
+const uint32_t CELL_STREAM = 1;
+const uint32_t PILOT_STREAM = 2;
+const int MAX_CONTRIBUTION_CELLS = 4096; // Contribution map cells per side
+const long long PROGRESSIVE_BATCH = IMAGE_WIDTH * IMAGE_HEIGHT * 2; // Samples a progressive worker draws between publishes
+const double PROGRESSIVE_REFRESH_SECONDS = 0.25;
+const size_t SPLAT_BINNING_BYTES = (size_t)16 << 20; // Worker tiles from this size on splat through SplatBins
+const size_t SPLAT_BIN_BYTES = (size_t)256 << 10;	  // Span of a tile one bin covers; stays in L2 and the TLB
+const int SPLAT_BIN_HITS = 2048;					  // Hits a bin buffers before they are applied
+const int SPLAT_SHARED_BIN_HITS = 64;				  // Fewest hits a bin of a shared tile buffers
 
-class Complex
+// Complex number over Real, which is double everywhere except the float escape kernels
+template <typename Real>
+class ComplexOf
 {
   public:
-	Complex(double r = 0.0, double i = 0.0)
+	ComplexOf(Real r = 0, Real i = 0)
 		: _r(r), _i(i)
 	{
 	}
 
-	Complex(const Complex &) = default;
+	ComplexOf(const ComplexOf &) = default;
+
+	Real r() const { return _r; }
+	Real i() const { return _i; }
+
+	ComplexOf operator*(const ComplexOf &other)
+	{
+		// (a + bi) (c + di)
+		return ComplexOf(_r * other._r - _i * other._i, _r * other._i + _i * other._r);
+	}
+
+	ComplexOf operator+(const ComplexOf &other)
+	{
+		return ComplexOf(_r + other._r, _i + other._i);
+	}
+
+	Real sqmagnitude() const
+	{
+		return _r * _r + _i * _i;
+	}
+
+  private:
+	Real _r, _i;
+};
+
+typedef ComplexOf<double> Complex;
+
+// Exponents d of the recurrence z = z^d + c with a pre-instantiated kernel; d = 2 is
+//  the Mandelbrot set, higher powers the Multibrots
+const int MIN_POWER = 2;
+const int MAX_POWER = 8;
+
+// z^Power as Power - 1 multiplications by z, unrolled at compile time. For Power = 2
+//  this is exactly z * z.
+template <int Power, typename Real>
+ComplexOf<Real> powerOf(ComplexOf<Real> z)
+{
+	ComplexOf<Real> w = z;
+	for (int k = 1; k < Power; ++k)
+	{
+		w = w * z;
+	}
+	return w;
+}
+
+// Escape-time families the sampler can trace; each is a Recurrence below
+enum FractalKind
+{
+	FRACTAL_MANDELBROT,	  // z = z^d + c; d = 2 is the Mandelbrot set, higher d the Multibrots
+	FRACTAL_BURNING_SHIP, // z = (|Re z| + i |Im z|)^d + c
+};
+
+// One step of an escape-time recurrence, as a type. Everything from the escape
+//  kernels to the samplers is templated on it, and dispatchFormula picks the instance
+//  once per call, so each family compiles to its own straight-line inner loop with no
+//  per-iteration branch or indirect call. A new family is a new Recurrence (plus its
+//  lines in the vector kernels) and a case in dispatchFormula.
+template <int Power, bool Fold = false>
+struct Recurrence
+{
+	static const int power = Power;
+	// Burning Ship: both parts of z are made non-negative before the power
+	static const bool fold = Fold;
+	// inMainCardioidOrBulb describes this set, so its interior can be skipped
+	static const bool cardioid = Power == 2 && !Fold;
+
+	template <typename Real>
+	static ComplexOf<Real> step(const ComplexOf<Real> &z, const ComplexOf<Real> &c)
+	{
+		return powerOf<Power>(Fold ? ComplexOf<Real>(fabs(z.r()), fabs(z.i())) : z) + c;
+	}
+};
+
+typedef Recurrence<2> Mandelbrot;
+
+//
+// Utility
+//
+
+// How a Heatmap arranges its pixels in memory
+enum HeatmapLayout
+{
+	HEATMAP_LINEAR, // Plain row-major
+	HEATMAP_TILED,	// Row-major HEATMAP_TILE x HEATMAP_TILE blocks, row-major inside each block
+};
+
+const int HEATMAP_TILE = 8;
+const size_t HEATMAP_ALIGNMENT = 64; // One cache line
+
+// Accumulation buffer for one or more channels, stored as a single aligned block.
+//  Channels are interleaved per pixel by default, so a sample feeding several
+//  channels touches one cache line; pass interleaved = false for one plane per channel.
+//  The tiled layout keeps 2D neighbourhoods together, which helps the scattered
+//  writes of the splat loop on large images. Owns its memory; move-only.
+class Heatmap
+{
+  public:
+	Heatmap()
+		: _width(0), _height(0), _channels(0), _layout(HEATMAP_LINEAR), _interleaved(true),
+		  _tilesX(0), _pixelCount(0), _data(nullptr)
+	{
+	}
+
+	Heatmap(int width, int height, int channels = 1, HeatmapLayout layout = HEATMAP_LINEAR, bool interleaved = true)
+		: _channels(channels), _layout(layout), _interleaved(interleaved)
+	{
+		setShape(width, height);
+		size_t bytes = size() * sizeof(HeatmapType);
+		size_t space = bytes + HEATMAP_ALIGNMENT;
+		_storage.reset(new unsigned char[space]);
+		void *aligned = _storage.get();
+		_data = (HeatmapType *)align(HEATMAP_ALIGNMENT, bytes, aligned, space);
+		clear();
+	}
+
+	// Wraps size() elements at data, owned by someone else (a mapped checkpoint, say).
+	//  data must be HEATMAP_ALIGNMENT-aligned and outlive the view; it is not cleared.
+	Heatmap(HeatmapType *data, int width, int height, int channels = 1, HeatmapLayout layout = HEATMAP_LINEAR,
+			bool interleaved = true)
+		: _channels(channels), _layout(layout), _interleaved(interleaved), _data(data)
+	{
+		setShape(width, height);
+	}
+
+	Heatmap(Heatmap &&other)
+		: Heatmap()
+	{
+		*this = move(other);
+	}
+
+	Heatmap &operator=(Heatmap &&other)
+	{
+		if (this != &other)
+		{
+			_width = other._width;
+			_height = other._height;
+			_channels = other._channels;
+			_layout = other._layout;
+			_interleaved = other._interleaved;
+			_tilesX = other._tilesX;
+			_pixelCount = other._pixelCount;
+			_storage = move(other._storage);
+			_data = other._data;
+
+			other._width = other._height = other._channels = 0;
+			other._tilesX = 0;
+			other._pixelCount = 0;
+			other._data = nullptr;
+		}
+		return *this;
+	}
+
+	Heatmap(const Heatmap &) = delete;
+	Heatmap &operator=(const Heatmap &) = delete;
+
+	int width() const { return _width; }
+	int height() const { return _height; }
+	int channels() const { return _channels; }
+	HeatmapLayout layout() const { return _layout; }
+	bool interleaved() const { return _interleaved; }
+
+	// Total element count, including any tile padding
+	size_t size() const { return _pixelCount * _channels; }
+	HeatmapType *data() { return _data; }
+	const HeatmapType *data() const { return _data; }
+
+	// Pixel slots in the buffer, including any tile padding
+	size_t pixelCount() const { return _pixelCount; }
+	// Distance between two channels of the same pixel, and between the same channel of neighbouring pixel slots
+	size_t channelStride() const { return _interleaved ? 1 : _pixelCount; }
+	size_t pixelStride() const { return _interleaved ? _channels : 1; }
+
+	size_t pixelOffset(int row, int col) const
+	{
+		if (_layout == HEATMAP_TILED)
+		{
+			size_t tile = (size_t)(row / HEATMAP_TILE) * _tilesX + col / HEATMAP_TILE;
+			return tile * HEATMAP_TILE * HEATMAP_TILE + (row % HEATMAP_TILE) * HEATMAP_TILE + col % HEATMAP_TILE;
+		}
+		return (size_t)row * _width + col;
+	}
+
+	// Channel 0 of a pixel; the other channels follow at channelStride() apart
+	HeatmapType *pixel(int row, int col)
+	{
+		return _data + pixelOffset(row, col) * pixelStride();
+	}
+
+	HeatmapType &at(int row, int col, int channel = 0)
+	{
+		return pixel(row, col)[channel * channelStride()];
+	}
+
+	HeatmapType at(int row, int col, int channel = 0) const
+	{
+		return const_cast<Heatmap *>(this)->at(row, col, channel);
+	}
+
+	void clear()
+	{
+		fill(_data, _data + size(), (HeatmapType)0);
+	}
+
+	// Same dimensions and memory arrangement, so the buffers can be combined element by element
+	bool sameShape(const Heatmap &other) const
+	{
+		return _width == other._width && _height == other._height && _channels == other._channels &&
+			   _layout == other._layout && _interleaved == other._interleaved;
+	}
+
+  private:
+	void setShape(int width, int height)
+	{
+		_width = width;
+		_height = height;
+		if (_layout == HEATMAP_TILED)
+		{
+			// Pad to whole tiles so the index math never needs an edge case
+			_tilesX = (width + HEATMAP_TILE - 1) / HEATMAP_TILE;
+			int tilesY = (height + HEATMAP_TILE - 1) / HEATMAP_TILE;
+			_pixelCount = (size_t)_tilesX * tilesY * HEATMAP_TILE * HEATMAP_TILE;
+		}
+		else
+		{
+			_tilesX = 0;
+			_pixelCount = (size_t)width * height;
+		}
+	}
+
+	int _width, _height, _channels;
+	HeatmapLayout _layout;
+	bool _interleaved;
+	int _tilesX;
+	size_t _pixelCount;
+	unique_ptr<unsigned char[]> _storage;
+	HeatmapType *_data;
+};
+
+// Number of iterations before the orbit of c under Formula's recurrence leaves the escape
+//  radius, or nIterations if it stays bounded that long. Nothing is stored along the way.
+template <typename Formula = Mandelbrot, typename Real = double>
+int escapeIterations(const ComplexOf<Real> &c, int nIterations)
+{
+	int n = 0;
+	ComplexOf<Real> z;
+
+	while (n < nIterations && z.sqmagnitude() <= (Real)2)
+	{
+		z = Formula::step(z, c);
+		++n;
+	}
+	return n;
+}
+
+// Same result as escapeIterations, but gives up early on orbits that provably never
+//  escape: z is saved at every power-of-two step (Brent's cycle detection), and if the
+//  orbit lands exactly on the saved value again the iteration is periodic and
+//  therefore bounded.
+template <typename Formula = Mandelbrot, typename Real = double>
+int escapeIterationsPeriodic(const ComplexOf<Real> &c, int nIterations)
+{
+	int n = 0;
+	int checkpoint = 1;
+	ComplexOf<Real> z, saved;
+
+	while (n < nIterations && z.sqmagnitude() <= (Real)2)
+	{
+		z = Formula::step(z, c);
+		++n;
+
+		if (z.r() == saved.r() && z.i() == saved.i())
+		{
+			return nIterations;
+		}
+		if (n == checkpoint)
+		{
+			saved = z;
+			checkpoint *= 2;
+		}
+	}
+	return n;
+}
+
+// Closed-form membership test for the main cardioid and the period-2 bulb, which
+//  together hold most of the Mandelbrot set's area. Only valid for Mandelbrot itself
+//  (Recurrence::cardioid). Orbits started there stay well inside the escape radius
+//  (|z|^2 stays below ~1.61), so they can be skipped outright.
+bool inMainCardioidOrBulb(const Complex &c)
+{
+	double x = c.r() - 0.25;
+	double y2 = c.i() * c.i();
+	double q = x * x + y2;
+	if (q * (q + x) <= 0.25 * y2)
+	{
+		return true;
+	}
+	double xb = c.r() + 1.0;
+	return xb * xb + y2 <= 1.0 / 16.0;
+}
+
+//
+// Batched escape-time kernels
+//
+// Each kernel fills o_nPoints[k] with escapeIterations<Formula>(Complex(cr[k], ci[k]),
+//  nIterations) for k in [0, count), or with escapeIterationsPeriodic<Formula> when
+//  DetectPeriod is set. Formula is a template parameter so its z^power step unrolls
+//  into straight-line arithmetic; escapeKernel<Formula>() picks among the instances. The
+//  vector versions keep one candidate c per lane in structure-of-arrays form and iterate
+//  all lanes in lockstep. A lane that escapes or runs out of iterations is masked out,
+//  its count written back, and the next pending candidate loaded in its place, so a long
+//  bounded orbit does not leave the rest of the register idle. The arithmetic is the
+//  same sequence of multiplies and adds as Complex, so the results match the scalar
+//  path exactly.
+typedef void (*EscapeKernelFn)(const double *cr, const double *ci, int count, int nIterations, int *o_nPoints);
+
+struct EscapeKernel
+{
+	const char *name;
+	int width; // Lanes iterated together
+	EscapeKernelFn run;
+	EscapeKernelFn runPeriodic;
+
+	// The same in single precision, for wide views where float resolves every pixel;
+	//  twice the lanes per register
+	int floatWidth;
+	EscapeKernelFn runFloat;
+	EscapeKernelFn runFloatPeriodic;
+};
+
+template <typename Formula, bool DetectPeriod, typename Real = double>
+void escapeIterationsScalar(const double *cr, const double *ci, int count, int nIterations, int *o_nPoints)
+{
+	for (int k = 0; k < count; ++k)
+	{
+		ComplexOf<Real> c((Real)cr[k], (Real)ci[k]);
+		o_nPoints[k] =
+			DetectPeriod ? escapeIterationsPeriodic<Formula>(c, nIterations)
+						 : escapeIterations<Formula>(c, nIterations);
+	}
+}
+
+const int MAX_ESCAPE_LANES = 16;
+
+// Float lanes count iterations in a float, which holds whole numbers exactly up to
+//  2^24; caps past that run in double
+const int FLOAT_MAX_ITERATIONS = 1 << 24;
+
+// Spilled register state of a vector kernel, used while swapping candidates in and out
+template <typename Real>
+struct EscapeLanes
+{
+	Real cr[MAX_ESCAPE_LANES], ci[MAX_ESCAPE_LANES];
+	Real zr[MAX_ESCAPE_LANES], zi[MAX_ESCAPE_LANES];
+	Real n[MAX_ESCAPE_LANES];
+	Real savedR[MAX_ESCAPE_LANES], savedI[MAX_ESCAPE_LANES]; // Cycle detection checkpoint
+	Real checkpoint[MAX_ESCAPE_LANES];
+	int idx[MAX_ESCAPE_LANES]; // Candidate held by each lane, -1 once the input is exhausted
+};
+
+// Loads the next pending candidate into lane l, or parks the lane on c = 0 (which
+//  never escapes) with a count that can never reach the cap and a checkpoint it
+//  can never match
+template <typename Real>
+void loadEscapeLane(EscapeLanes<Real> &lanes, int l, const double *cr, const double *ci, int count, int &next)
+{
+	lanes.zr[l] = lanes.zi[l] = 0;
+	lanes.checkpoint[l] = 1;
+	if (next < count)
+	{
+		lanes.idx[l] = next;
+		lanes.cr[l] = (Real)cr[next];
+		lanes.ci[l] = (Real)ci[next];
+		lanes.n[l] = 0;
+		lanes.savedR[l] = lanes.savedI[l] = 0;
+		++next;
+	}
+	else
+	{
+		lanes.idx[l] = -1;
+		lanes.cr[l] = lanes.ci[l] = 0;
+		lanes.n[l] = -HUGE_VAL;
+		lanes.savedR[l] = lanes.savedI[l] = NAN;
+	}
+}
+
+// Writes back every lane set in doneMask and refills it. Returns how many lanes went idle.
+template <typename Real>
+int retireEscapeLanes(EscapeLanes<Real> &lanes, unsigned int doneMask, int width,
+					  const double *cr, const double *ci, int count, int &next, int *o_nPoints)
+{
+	int retired = 0;
+	for (int l = 0; l < width; ++l)
+	{
+		if ((doneMask & (1u << l)) && lanes.idx[l] >= 0)
+		{
+			o_nPoints[lanes.idx[l]] = (int)lanes.n[l];
+			loadEscapeLane(lanes, l, cr, ci, count, next);
+			retired += lanes.idx[l] < 0 ? 1 : 0;
+		}
+	}
+	return retired;
+}
+
+// Sets up all lanes for a kernel of the given width. Returns how many lanes hold a candidate.
+template <typename Real>
+int initEscapeLanes(EscapeLanes<Real> &lanes, int width, const double *cr, const double *ci, int count, int &next)
+{
+	for (int l = 0; l < width; ++l)
+	{
+		loadEscapeLane(lanes, l, cr, ci, count, next);
+	}
+	return min(width, count);
+}
+
+#ifdef BUDDHABROT_X86_SIMD
+template <typename Formula, bool DetectPeriod>
+__attribute__((target("avx2"))) void escapeIterationsAVX2(const double *cr, const double *ci, int count,
+																  int nIterations, int *o_nPoints)
+{
+	if (nIterations <= 0)
+	{
+		escapeIterationsScalar<Formula, DetectPeriod>(cr, ci, count, nIterations, o_nPoints);
+		return;
+	}
+
+	const __m256d two = _mm256_set1_pd(2.0);
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d cap = _mm256_set1_pd(nIterations);
+	EscapeLanes<double> lanes;
+	int next = 0;
+	int active = initEscapeLanes(lanes, 4, cr, ci, count, next);
+
+	__m256d vcr = _mm256_loadu_pd(lanes.cr), vci = _mm256_loadu_pd(lanes.ci);
+	__m256d zr = _mm256_loadu_pd(lanes.zr), zi = _mm256_loadu_pd(lanes.zi);
+	__m256d n = _mm256_loadu_pd(lanes.n);
+	__m256d sr = _mm256_loadu_pd(lanes.savedR), si = _mm256_loadu_pd(lanes.savedI);
+	__m256d checkpoint = _mm256_loadu_pd(lanes.checkpoint);
+	while (active > 0)
+	{
+		__m256d zr2 = _mm256_mul_pd(zr, zr);
+		__m256d zi2 = _mm256_mul_pd(zi, zi);
+		__m256d done = _mm256_or_pd(_mm256_cmp_pd(_mm256_add_pd(zr2, zi2), two, _CMP_GT_OQ),
+									_mm256_cmp_pd(n, cap, _CMP_GE_OQ));
+		unsigned int doneMask = _mm256_movemask_pd(done);
+		if (doneMask != 0)
+		{
+			_mm256_storeu_pd(lanes.n, n);
+			_mm256_storeu_pd(lanes.zr, zr);
+			_mm256_storeu_pd(lanes.zi, zi);
+			_mm256_storeu_pd(lanes.savedR, sr);
+			_mm256_storeu_pd(lanes.savedI, si);
+			_mm256_storeu_pd(lanes.checkpoint, checkpoint);
+			active -= retireEscapeLanes(lanes, doneMask, 4, cr, ci, count, next, o_nPoints);
+			vcr = _mm256_loadu_pd(lanes.cr), vci = _mm256_loadu_pd(lanes.ci);
+			zr = _mm256_loadu_pd(lanes.zr), zi = _mm256_loadu_pd(lanes.zi);
+			n = _mm256_loadu_pd(lanes.n);
+			sr = _mm256_loadu_pd(lanes.savedR), si = _mm256_loadu_pd(lanes.savedI);
+			checkpoint = _mm256_loadu_pd(lanes.checkpoint);
+			zr2 = _mm256_mul_pd(zr, zr);
+			zi2 = _mm256_mul_pd(zi, zi);
+		}
+		n = _mm256_add_pd(n, one);
+		if (Formula::fold)
+		{
+			zr = _mm256_andnot_pd(sign, zr);
+			zi = _mm256_andnot_pd(sign, zi);
+		}
+		if (Formula::power == 2)
+		{
+			__m256d zri = _mm256_mul_pd(zr, zi);
+			zi = _mm256_add_pd(_mm256_add_pd(zri, zri), vci);
+			zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), vcr);
+		}
+		else
+		{
+			// Same products as powerOf, w = w * z
+			__m256d wr = zr, wi = zi;
+			for (int k = 1; k < Formula::power; ++k)
+			{
+				__m256d pr = _mm256_sub_pd(_mm256_mul_pd(wr, zr), _mm256_mul_pd(wi, zi));
+				wi = _mm256_add_pd(_mm256_mul_pd(wr, zi), _mm256_mul_pd(wi, zr));
+				wr = pr;
+			}
+			zr = _mm256_add_pd(wr, vcr);
+			zi = _mm256_add_pd(wi, vci);
+		}
+
+		if (DetectPeriod)
+		{
+			// A lane back on its checkpoint is periodic: push its count to the cap so it retires as bounded
+			__m256d cycle = _mm256_and_pd(_mm256_cmp_pd(zr, sr, _CMP_EQ_OQ), _mm256_cmp_pd(zi, si, _CMP_EQ_OQ));
+			__m256d atCheckpoint = _mm256_cmp_pd(n, checkpoint, _CMP_EQ_OQ);
+			sr = _mm256_blendv_pd(sr, zr, atCheckpoint);
+			si = _mm256_blendv_pd(si, zi, atCheckpoint);
+			checkpoint = _mm256_blendv_pd(checkpoint, _mm256_add_pd(checkpoint, checkpoint), atCheckpoint);
+			n = _mm256_blendv_pd(n, cap, cycle);
+		}
+	}
+}
+
+// Single-precision AVX2 kernel: the same loop on eight float lanes
+template <typename Formula, bool DetectPeriod>
+__attribute__((target("avx2"))) void escapeIterationsAVX2Float(const double *cr, const double *ci, int count,
+																	   int nIterations, int *o_nPoints)
+{
+	if (nIterations <= 0)
+	{
+		escapeIterationsScalar<Formula, DetectPeriod, float>(cr, ci, count, nIterations, o_nPoints);
+		return;
+	}
+
+	const __m256 two = _mm256_set1_ps(2.0f);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 cap = _mm256_set1_ps((float)nIterations);
+	EscapeLanes<float> lanes;
+	int next = 0;
+	int active = initEscapeLanes(lanes, 8, cr, ci, count, next);
+
+	__m256 vcr = _mm256_loadu_ps(lanes.cr), vci = _mm256_loadu_ps(lanes.ci);
+	__m256 zr = _mm256_loadu_ps(lanes.zr), zi = _mm256_loadu_ps(lanes.zi);
+	__m256 n = _mm256_loadu_ps(lanes.n);
+	__m256 sr = _mm256_loadu_ps(lanes.savedR), si = _mm256_loadu_ps(lanes.savedI);
+	__m256 checkpoint = _mm256_loadu_ps(lanes.checkpoint);
+	while (active > 0)
+	{
+		__m256 zr2 = _mm256_mul_ps(zr, zr);
+		__m256 zi2 = _mm256_mul_ps(zi, zi);
+		__m256 done =
+			_mm256_or_ps(_mm256_cmp_ps(_mm256_add_ps(zr2, zi2), two, _CMP_GT_OQ), _mm256_cmp_ps(n, cap, _CMP_GE_OQ));
+		unsigned int doneMask = _mm256_movemask_ps(done);
+		if (doneMask != 0)
+		{
+			_mm256_storeu_ps(lanes.n, n);
+			_mm256_storeu_ps(lanes.zr, zr);
+			_mm256_storeu_ps(lanes.zi, zi);
+			_mm256_storeu_ps(lanes.savedR, sr);
+			_mm256_storeu_ps(lanes.savedI, si);
+			_mm256_storeu_ps(lanes.checkpoint, checkpoint);
+			active -= retireEscapeLanes(lanes, doneMask, 8, cr, ci, count, next, o_nPoints);
+			vcr = _mm256_loadu_ps(lanes.cr), vci = _mm256_loadu_ps(lanes.ci);
+			zr = _mm256_loadu_ps(lanes.zr), zi = _mm256_loadu_ps(lanes.zi);
+			n = _mm256_loadu_ps(lanes.n);
+			sr = _mm256_loadu_ps(lanes.savedR), si = _mm256_loadu_ps(lanes.savedI);
+			checkpoint = _mm256_loadu_ps(lanes.checkpoint);
+			zr2 = _mm256_mul_ps(zr, zr);
+			zi2 = _mm256_mul_ps(zi, zi);
+		}
+		n = _mm256_add_ps(n, one);
+		if (Formula::fold)
+		{
+			zr = _mm256_andnot_ps(sign, zr);
+			zi = _mm256_andnot_ps(sign, zi);
+		}
+		if (Formula::power == 2)
+		{
+			__m256 zri = _mm256_mul_ps(zr, zi);
+			zi = _mm256_add_ps(_mm256_add_ps(zri, zri), vci);
+			zr = _mm256_add_ps(_mm256_sub_ps(zr2, zi2), vcr);
+		}
+		else
+		{
+			__m256 wr = zr, wi = zi;
+			for (int k = 1; k < Formula::power; ++k)
+			{
+				__m256 pr = _mm256_sub_ps(_mm256_mul_ps(wr, zr), _mm256_mul_ps(wi, zi));
+				wi = _mm256_add_ps(_mm256_mul_ps(wr, zi), _mm256_mul_ps(wi, zr));
+				wr = pr;
+			}
+			zr = _mm256_add_ps(wr, vcr);
+			zi = _mm256_add_ps(wi, vci);
+		}
+
+		if (DetectPeriod)
+		{
+			__m256 cycle = _mm256_and_ps(_mm256_cmp_ps(zr, sr, _CMP_EQ_OQ), _mm256_cmp_ps(zi, si, _CMP_EQ_OQ));
+			__m256 atCheckpoint = _mm256_cmp_ps(n, checkpoint, _CMP_EQ_OQ);
+			sr = _mm256_blendv_ps(sr, zr, atCheckpoint);
+			si = _mm256_blendv_ps(si, zi, atCheckpoint);
+			checkpoint = _mm256_blendv_ps(checkpoint, _mm256_add_ps(checkpoint, checkpoint), atCheckpoint);
+			n = _mm256_blendv_ps(n, cap, cycle);
+		}
+	}
+}
+
+// AVX-512 brings FMA along, and fusing the z^power products would round differently
+//  from Complex, so contraction is turned off for this kernel
+template <typename Formula, bool DetectPeriod>
+__attribute__((target("avx512f"), optimize("fp-contract=off"))) void
+escapeIterationsAVX512(const double *cr, const double *ci, int count, int nIterations, int *o_nPoints)
+{
+	if (nIterations <= 0)
+	{
+		escapeIterationsScalar<Formula, DetectPeriod>(cr, ci, count, nIterations, o_nPoints);
+		return;
+	}
+
+	const __m512d two = _mm512_set1_pd(2.0);
+	const __m512d one = _mm512_set1_pd(1.0);
+	const __m512d cap = _mm512_set1_pd(nIterations);
+	EscapeLanes<double> lanes;
+	int next = 0;
+	int active = initEscapeLanes(lanes, 8, cr, ci, count, next);
+
+	__m512d vcr = _mm512_loadu_pd(lanes.cr), vci = _mm512_loadu_pd(lanes.ci);
+	__m512d zr = _mm512_loadu_pd(lanes.zr), zi = _mm512_loadu_pd(lanes.zi);
+	__m512d n = _mm512_loadu_pd(lanes.n);
+	__m512d sr = _mm512_loadu_pd(lanes.savedR), si = _mm512_loadu_pd(lanes.savedI);
+	__m512d checkpoint = _mm512_loadu_pd(lanes.checkpoint);
+	while (active > 0)
+	{
+		__m512d zr2 = _mm512_mul_pd(zr, zr);
+		__m512d zi2 = _mm512_mul_pd(zi, zi);
+		__mmask8 done = _mm512_cmp_pd_mask(_mm512_add_pd(zr2, zi2), two, _CMP_GT_OQ) |
+						_mm512_cmp_pd_mask(n, cap, _CMP_GE_OQ);
+		if (done != 0)
+		{
+			_mm512_storeu_pd(lanes.n, n);
+			_mm512_storeu_pd(lanes.zr, zr);
+			_mm512_storeu_pd(lanes.zi, zi);
+			_mm512_storeu_pd(lanes.savedR, sr);
+			_mm512_storeu_pd(lanes.savedI, si);
+			_mm512_storeu_pd(lanes.checkpoint, checkpoint);
+			active -= retireEscapeLanes(lanes, done, 8, cr, ci, count, next, o_nPoints);
+			vcr = _mm512_loadu_pd(lanes.cr), vci = _mm512_loadu_pd(lanes.ci);
+			zr = _mm512_loadu_pd(lanes.zr), zi = _mm512_loadu_pd(lanes.zi);
+			n = _mm512_loadu_pd(lanes.n);
+			sr = _mm512_loadu_pd(lanes.savedR), si = _mm512_loadu_pd(lanes.savedI);
+			checkpoint = _mm512_loadu_pd(lanes.checkpoint);
+			zr2 = _mm512_mul_pd(zr, zr);
+			zi2 = _mm512_mul_pd(zi, zi);
+		}
+		n = _mm512_add_pd(n, one);
+		if (Formula::fold)
+		{
+			zr = _mm512_abs_pd(zr);
+			zi = _mm512_abs_pd(zi);
+		}
+		if (Formula::power == 2)
+		{
+			__m512d zri = _mm512_mul_pd(zr, zi);
+			zi = _mm512_add_pd(_mm512_add_pd(zri, zri), vci);
+			zr = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), vcr);
+		}
+		else
+		{
+			__m512d wr = zr, wi = zi;
+			for (int k = 1; k < Formula::power; ++k)
+			{
+				__m512d pr = _mm512_sub_pd(_mm512_mul_pd(wr, zr), _mm512_mul_pd(wi, zi));
+				wi = _mm512_add_pd(_mm512_mul_pd(wr, zi), _mm512_mul_pd(wi, zr));
+				wr = pr;
+			}
+			zr = _mm512_add_pd(wr, vcr);
+			zi = _mm512_add_pd(wi, vci);
+		}
+
+		if (DetectPeriod)
+		{
+			__mmask8 cycle = _mm512_cmp_pd_mask(zr, sr, _CMP_EQ_OQ) & _mm512_cmp_pd_mask(zi, si, _CMP_EQ_OQ);
+			__mmask8 atCheckpoint = _mm512_cmp_pd_mask(n, checkpoint, _CMP_EQ_OQ);
+			sr = _mm512_mask_mov_pd(sr, atCheckpoint, zr);
+			si = _mm512_mask_mov_pd(si, atCheckpoint, zi);
+			checkpoint = _mm512_mask_add_pd(checkpoint, atCheckpoint, checkpoint, checkpoint);
+			n = _mm512_mask_mov_pd(n, cycle, cap);
+		}
+	}
+}
+// Single-precision AVX-512 kernel: sixteen float lanes
+template <typename Formula, bool DetectPeriod>
+__attribute__((target("avx512f"), optimize("fp-contract=off"))) void
+escapeIterationsAVX512Float(const double *cr, const double *ci, int count, int nIterations, int *o_nPoints)
+{
+	if (nIterations <= 0)
+	{
+		escapeIterationsScalar<Formula, DetectPeriod, float>(cr, ci, count, nIterations, o_nPoints);
+		return;
+	}
+
+	const __m512 two = _mm512_set1_ps(2.0f);
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 cap = _mm512_set1_ps((float)nIterations);
+	EscapeLanes<float> lanes;
+	int next = 0;
+	int active = initEscapeLanes(lanes, 16, cr, ci, count, next);
+
+	__m512 vcr = _mm512_loadu_ps(lanes.cr), vci = _mm512_loadu_ps(lanes.ci);
+	__m512 zr = _mm512_loadu_ps(lanes.zr), zi = _mm512_loadu_ps(lanes.zi);
+	__m512 n = _mm512_loadu_ps(lanes.n);
+	__m512 sr = _mm512_loadu_ps(lanes.savedR), si = _mm512_loadu_ps(lanes.savedI);
+	__m512 checkpoint = _mm512_loadu_ps(lanes.checkpoint);
+	while (active > 0)
+	{
+		__m512 zr2 = _mm512_mul_ps(zr, zr);
+		__m512 zi2 = _mm512_mul_ps(zi, zi);
+		__mmask16 done = _mm512_cmp_ps_mask(_mm512_add_ps(zr2, zi2), two, _CMP_GT_OQ) |
+						 _mm512_cmp_ps_mask(n, cap, _CMP_GE_OQ);
+		if (done != 0)
+		{
+			_mm512_storeu_ps(lanes.n, n);
+			_mm512_storeu_ps(lanes.zr, zr);
+			_mm512_storeu_ps(lanes.zi, zi);
+			_mm512_storeu_ps(lanes.savedR, sr);
+			_mm512_storeu_ps(lanes.savedI, si);
+			_mm512_storeu_ps(lanes.checkpoint, checkpoint);
+			active -= retireEscapeLanes(lanes, done, 16, cr, ci, count, next, o_nPoints);
+			vcr = _mm512_loadu_ps(lanes.cr), vci = _mm512_loadu_ps(lanes.ci);
+			zr = _mm512_loadu_ps(lanes.zr), zi = _mm512_loadu_ps(lanes.zi);
+			n = _mm512_loadu_ps(lanes.n);
+			sr = _mm512_loadu_ps(lanes.savedR), si = _mm512_loadu_ps(lanes.savedI);
+			checkpoint = _mm512_loadu_ps(lanes.checkpoint);
+			zr2 = _mm512_mul_ps(zr, zr);
+			zi2 = _mm512_mul_ps(zi, zi);
+		}
+		n = _mm512_add_ps(n, one);
+		if (Formula::fold)
+		{
+			zr = _mm512_abs_ps(zr);
+			zi = _mm512_abs_ps(zi);
+		}
+		if (Formula::power == 2)
+		{
+			__m512 zri = _mm512_mul_ps(zr, zi);
+			zi = _mm512_add_ps(_mm512_add_ps(zri, zri), vci);
+			zr = _mm512_add_ps(_mm512_sub_ps(zr2, zi2), vcr);
+		}
+		else
+		{
+			__m512 wr = zr, wi = zi;
+			for (int k = 1; k < Formula::power; ++k)
+			{
+				__m512 pr = _mm512_sub_ps(_mm512_mul_ps(wr, zr), _mm512_mul_ps(wi, zi));
+				wi = _mm512_add_ps(_mm512_mul_ps(wr, zi), _mm512_mul_ps(wi, zr));
+				wr = pr;
+			}
+			zr = _mm512_add_ps(wr, vcr);
+			zi = _mm512_add_ps(wi, vci);
+		}
+
+		if (DetectPeriod)
+		{
+			__mmask16 cycle = _mm512_cmp_ps_mask(zr, sr, _CMP_EQ_OQ) & _mm512_cmp_ps_mask(zi, si, _CMP_EQ_OQ);
+			__mmask16 atCheckpoint = _mm512_cmp_ps_mask(n, checkpoint, _CMP_EQ_OQ);
+			sr = _mm512_mask_mov_ps(sr, atCheckpoint, zr);
+			si = _mm512_mask_mov_ps(si, atCheckpoint, zi);
+			checkpoint = _mm512_mask_add_ps(checkpoint, atCheckpoint, checkpoint, checkpoint);
+			n = _mm512_mask_mov_ps(n, cycle, cap);
+		}
+	}
+}
+#endif
+
+#ifdef BUDDHABROT_NEON_SIMD
+template <typename Formula, bool DetectPeriod>
+void escapeIterationsNEON(const double *cr, const double *ci, int count, int nIterations, int *o_nPoints)
+{
+	if (nIterations <= 0)
+	{
+		escapeIterationsScalar<Formula, DetectPeriod>(cr, ci, count, nIterations, o_nPoints);
+		return;
+	}
+
+	const float64x2_t two = vdupq_n_f64(2.0);
+	const float64x2_t one = vdupq_n_f64(1.0);
+	const float64x2_t cap = vdupq_n_f64(nIterations);
+	EscapeLanes<double> lanes;
+	int next = 0;
+	int active = initEscapeLanes(lanes, 2, cr, ci, count, next);
+
+	float64x2_t vcr = vld1q_f64(lanes.cr), vci = vld1q_f64(lanes.ci);
+	float64x2_t zr = vld1q_f64(lanes.zr), zi = vld1q_f64(lanes.zi);
+	float64x2_t n = vld1q_f64(lanes.n);
+	float64x2_t sr = vld1q_f64(lanes.savedR), si = vld1q_f64(lanes.savedI);
+	float64x2_t checkpoint = vld1q_f64(lanes.checkpoint);
+	while (active > 0)
+	{
+		float64x2_t zr2 = vmulq_f64(zr, zr);
+		float64x2_t zi2 = vmulq_f64(zi, zi);
+		uint64x2_t done = vorrq_u64(vcgtq_f64(vaddq_f64(zr2, zi2), two), vcgeq_f64(n, cap));
+		unsigned int doneMask = (vgetq_lane_u64(done, 0) ? 1u : 0u) | (vgetq_lane_u64(done, 1) ? 2u : 0u);
+		if (doneMask != 0)
+		{
+			vst1q_f64(lanes.n, n);
+			vst1q_f64(lanes.zr, zr);
+			vst1q_f64(lanes.zi, zi);
+			vst1q_f64(lanes.savedR, sr);
+			vst1q_f64(lanes.savedI, si);
+			vst1q_f64(lanes.checkpoint, checkpoint);
+			active -= retireEscapeLanes(lanes, doneMask, 2, cr, ci, count, next, o_nPoints);
+			vcr = vld1q_f64(lanes.cr), vci = vld1q_f64(lanes.ci);
+			zr = vld1q_f64(lanes.zr), zi = vld1q_f64(lanes.zi);
+			n = vld1q_f64(lanes.n);
+			sr = vld1q_f64(lanes.savedR), si = vld1q_f64(lanes.savedI);
+			checkpoint = vld1q_f64(lanes.checkpoint);
+			zr2 = vmulq_f64(zr, zr);
+			zi2 = vmulq_f64(zi, zi);
+		}
+		n = vaddq_f64(n, one);
+		if (Formula::fold)
+		{
+			zr = vabsq_f64(zr);
+			zi = vabsq_f64(zi);
+		}
+		if (Formula::power == 2)
+		{
+			float64x2_t zri = vmulq_f64(zr, zi);
+			zi = vaddq_f64(vaddq_f64(zri, zri), vci);
+			zr = vaddq_f64(vsubq_f64(zr2, zi2), vcr);
+		}
+		else
+		{
+			float64x2_t wr = zr, wi = zi;
+			for (int k = 1; k < Formula::power; ++k)
+			{
+				float64x2_t pr = vsubq_f64(vmulq_f64(wr, zr), vmulq_f64(wi, zi));
+				wi = vaddq_f64(vmulq_f64(wr, zi), vmulq_f64(wi, zr));
+				wr = pr;
+			}
+			zr = vaddq_f64(wr, vcr);
+			zi = vaddq_f64(wi, vci);
+		}
+
+		if (DetectPeriod)
+		{
+			uint64x2_t cycle = vandq_u64(vceqq_f64(zr, sr), vceqq_f64(zi, si));
+			uint64x2_t atCheckpoint = vceqq_f64(n, checkpoint);
+			sr = vbslq_f64(atCheckpoint, zr, sr);
+			si = vbslq_f64(atCheckpoint, zi, si);
+			checkpoint = vbslq_f64(atCheckpoint, vaddq_f64(checkpoint, checkpoint), checkpoint);
+			n = vbslq_f64(cycle, cap, n);
+		}
+	}
+}
+// Single-precision NEON kernel: four float lanes
+template <typename Formula, bool DetectPeriod>
+void escapeIterationsNEONFloat(const double *cr, const double *ci, int count, int nIterations, int *o_nPoints)
+{
+	if (nIterations <= 0)
+	{
+		escapeIterationsScalar<Formula, DetectPeriod, float>(cr, ci, count, nIterations, o_nPoints);
+		return;
+	}
+
+	const float32x4_t two = vdupq_n_f32(2.0f);
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t cap = vdupq_n_f32((float)nIterations);
+	EscapeLanes<float> lanes;
+	int next = 0;
+	int active = initEscapeLanes(lanes, 4, cr, ci, count, next);
+
+	float32x4_t vcr = vld1q_f32(lanes.cr), vci = vld1q_f32(lanes.ci);
+	float32x4_t zr = vld1q_f32(lanes.zr), zi = vld1q_f32(lanes.zi);
+	float32x4_t n = vld1q_f32(lanes.n);
+	float32x4_t sr = vld1q_f32(lanes.savedR), si = vld1q_f32(lanes.savedI);
+	float32x4_t checkpoint = vld1q_f32(lanes.checkpoint);
+	while (active > 0)
+	{
+		float32x4_t zr2 = vmulq_f32(zr, zr);
+		float32x4_t zi2 = vmulq_f32(zi, zi);
+		uint32x4_t done = vorrq_u32(vcgtq_f32(vaddq_f32(zr2, zi2), two), vcgeq_f32(n, cap));
+		unsigned int doneMask = (vgetq_lane_u32(done, 0) ? 1u : 0u) | (vgetq_lane_u32(done, 1) ? 2u : 0u) |
+								(vgetq_lane_u32(done, 2) ? 4u : 0u) | (vgetq_lane_u32(done, 3) ? 8u : 0u);
+		if (doneMask != 0)
+		{
+			vst1q_f32(lanes.n, n);
+			vst1q_f32(lanes.zr, zr);
+			vst1q_f32(lanes.zi, zi);
+			vst1q_f32(lanes.savedR, sr);
+			vst1q_f32(lanes.savedI, si);
+			vst1q_f32(lanes.checkpoint, checkpoint);
+			active -= retireEscapeLanes(lanes, doneMask, 4, cr, ci, count, next, o_nPoints);
+			vcr = vld1q_f32(lanes.cr), vci = vld1q_f32(lanes.ci);
+			zr = vld1q_f32(lanes.zr), zi = vld1q_f32(lanes.zi);
+			n = vld1q_f32(lanes.n);
+			sr = vld1q_f32(lanes.savedR), si = vld1q_f32(lanes.savedI);
+			checkpoint = vld1q_f32(lanes.checkpoint);
+			zr2 = vmulq_f32(zr, zr);
+			zi2 = vmulq_f32(zi, zi);
+		}
+		n = vaddq_f32(n, one);
+		if (Formula::fold)
+		{
+			zr = vabsq_f32(zr);
+			zi = vabsq_f32(zi);
+		}
+		if (Formula::power == 2)
+		{
+			float32x4_t zri = vmulq_f32(zr, zi);
+			zi = vaddq_f32(vaddq_f32(zri, zri), vci);
+			zr = vaddq_f32(vsubq_f32(zr2, zi2), vcr);
+		}
+		else
+		{
+			float32x4_t wr = zr, wi = zi;
+			for (int k = 1; k < Formula::power; ++k)
+			{
+				float32x4_t pr = vsubq_f32(vmulq_f32(wr, zr), vmulq_f32(wi, zi));
+				wi = vaddq_f32(vmulq_f32(wr, zi), vmulq_f32(wi, zr));
+				wr = pr;
+			}
+			zr = vaddq_f32(wr, vcr);
+			zi = vaddq_f32(wi, vci);
+		}
+
+		if (DetectPeriod)
+		{
+			uint32x4_t cycle = vandq_u32(vceqq_f32(zr, sr), vceqq_f32(zi, si));
+			uint32x4_t atCheckpoint = vceqq_f32(n, checkpoint);
+			sr = vbslq_f32(atCheckpoint, zr, sr);
+			si = vbslq_f32(atCheckpoint, zi, si);
+			checkpoint = vbslq_f32(atCheckpoint, vaddq_f32(checkpoint, checkpoint), checkpoint);
+			n = vbslq_f32(cycle, cap, n);
+		}
+	}
+}
+#endif
+
+// Picks the widest kernel the running CPU supports, so one binary serves every machine
+template <typename Formula>
+EscapeKernel selectEscapeKernel()
+{
+#ifdef BUDDHABROT_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		return EscapeKernel{"avx512", 8, escapeIterationsAVX512<Formula, false>,
+							escapeIterationsAVX512<Formula, true>, 16, escapeIterationsAVX512Float<Formula, false>,
+							escapeIterationsAVX512Float<Formula, true>};
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return EscapeKernel{"avx2", 4, escapeIterationsAVX2<Formula, false>, escapeIterationsAVX2<Formula, true>, 8,
+							escapeIterationsAVX2Float<Formula, false>, escapeIterationsAVX2Float<Formula, true>};
+	}
+#endif
+#ifdef BUDDHABROT_NEON_SIMD
+	return EscapeKernel{"neon", 2, escapeIterationsNEON<Formula, false>, escapeIterationsNEON<Formula, true>, 4,
+						escapeIterationsNEONFloat<Formula, false>, escapeIterationsNEONFloat<Formula, true>};
+#endif
+	return EscapeKernel{"scalar", 1, escapeIterationsScalar<Formula, false>, escapeIterationsScalar<Formula, true>, 1,
+						escapeIterationsScalar<Formula, false, float>, escapeIterationsScalar<Formula, true, float>};
+}
+
+template <typename Formula = Mandelbrot>
+const EscapeKernel &escapeKernel()
+{
+	static const EscapeKernel kernel = selectEscapeKernel<Formula>();
+	return kernel;
+}
+
+// Replays the first nPoints points of the orbit of c into visit(z), iterating in Real
+template <typename Formula = Mandelbrot, typename Real = double, typename Visitor>
+void visitOrbit(const Complex &c, int nPoints, Visitor &&visit)
+{
+	ComplexOf<Real> z, cReal((Real)c.r(), (Real)c.i());
+	for (int n = 0; n < nPoints; ++n)
+	{
+		z = Formula::step(z, cReal);
+		visit(Complex(z.r(), z.i()));
+	}
+}
+
+// Calls visit(z) for every point of the orbit of c as it escapes to infinity.
+//  The escape test runs first without recording anything; only escaping orbits
+//  are iterated a second time, straight into the visitor. Returns whether c escaped.
+template <typename Formula = Mandelbrot, typename Visitor>
+bool buddhabrotPoints(const Complex &c, int nIterations, Visitor &&visit)
+{
+	int nPoints = escapeIterations<Formula>(c, nIterations);
+
+	// If point remains bounded through nIterations iterations, the point
+	//  is bounded, therefore in the Mandelbrot set, therefore of no interest to us
+	if (nPoints == nIterations)
+	{
+		return false;
+	}
+
+	visitOrbit<Formula>(c, nPoints, visit);
+	return true;
+}
+
+//
+// Perturbation
+//
+// Past a zoom of about 1e-13, double can no longer tell neighbouring pixels' c apart.
+//  In perturbation mode the viewport is given as offsets from a center held in
+//  double-double (about 32 significant digits). One reference orbit Z_n of the center
+//  is iterated in double-double, and each sample c = center + dc then only iterates
+//  its difference d_n = z_n - Z_n, in plain double:
+//    d_{n+1} = 2 Z_n d_n + d_n^2 + dc
+//  When the reference runs out (it escaped or hit the cap) or |z_n| drops below |d_n|,
+//  the sample is rebased onto the start of the reference (d = z, n_ref = 0), which
+//  keeps d small against Z without a second reference. Orbit points are placed at
+//  (Z_n - center) + d_n, so both terms keep double's precision relative to the zoom.
+//  Only z^2 + c is supported.
+//
+
+// Unevaluated sum hi + lo of two doubles, with |lo| below half an ulp of hi
+class DoubleDouble
+{
+  public:
+	DoubleDouble(double hi = 0.0, double lo = 0.0)
+		: _hi(hi), _lo(lo)
+	{
+	}
+
+	double hi() const { return _hi; }
+	double lo() const { return _lo; }
+	double value() const { return _hi + _lo; }
+
+	DoubleDouble operator+(const DoubleDouble &other) const
+	{
+		double e, f;
+		double s = twoSum(_hi, other._hi, e);
+		double t = twoSum(_lo, other._lo, f);
+		e += t;
+		s = quickTwoSum(s, e, e);
+		e += f;
+		s = quickTwoSum(s, e, e);
+		return DoubleDouble(s, e);
+	}
+
+	DoubleDouble operator-() const
+	{
+		return DoubleDouble(-_hi, -_lo);
+	}
+
+	DoubleDouble operator-(const DoubleDouble &other) const
+	{
+		return *this + -other;
+	}
+
+	DoubleDouble operator*(const DoubleDouble &other) const
+	{
+		double p = _hi * other._hi;
+		double e = fma(_hi, other._hi, -p) + (_hi * other._lo + _lo * other._hi);
+		p = quickTwoSum(p, e, e);
+		return DoubleDouble(p, e);
+	}
+
+	DoubleDouble operator/(const DoubleDouble &other) const
+	{
+		// Long division, one double of quotient at a time
+		double q1 = _hi / other._hi;
+		DoubleDouble r = *this - other * DoubleDouble(q1);
+		double q2 = r._hi / other._hi;
+		r = r - other * DoubleDouble(q2);
+		double q3 = r._hi / other._hi;
+		double e;
+		q1 = quickTwoSum(q1, q2, e);
+		return DoubleDouble(q1, e) + DoubleDouble(q3);
+	}
+
+  private:
+	// a + b = result + o_error exactly
+	static double twoSum(double a, double b, double &o_error)
+	{
+		double s = a + b;
+		double bb = s - a;
+		o_error = (a - (s - bb)) + (b - bb);
+		return s;
+	}
+
+	// twoSum for |a| >= |b|
+	static double quickTwoSum(double a, double b, double &o_error)
+	{
+		double s = a + b;
+		o_error = b - (s - a);
+		return s;
+	}
+
+	double _hi, _lo;
+};
+
+// Parses a decimal number such as "-0.7436438870371587048e-1" to full double-double
+//  precision; false unless all of text is one number
+bool parseDoubleDouble(const string &text, DoubleDouble &o_value)
+{
+	size_t k = 0;
+	bool negative = false;
+	if (k < text.size() && (text[k] == '+' || text[k] == '-'))
+	{
+		negative = text[k++] == '-';
+	}
+
+	DoubleDouble value;
+	long exponent = 0;
+	int digits = 0;
+	bool point = false;
+	for (; k < text.size(); ++k)
+	{
+		char ch = text[k];
+		if (isdigit((unsigned char)ch))
+		{
+			value = value * DoubleDouble(10.0) + DoubleDouble(ch - '0');
+			exponent -= point ? 1 : 0;
+			++digits;
+		}
+		else if (ch == '.' && !point)
+		{
+			point = true;
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (digits == 0)
+	{
+		return false;
+	}
+	if (k < text.size() && (text[k] == 'e' || text[k] == 'E'))
+	{
+		const char *start = text.c_str() + k + 1;
+		char *end;
+		exponent += strtol(start, &end, 10);
+		if (end == start)
+		{
+			return false;
+		}
+		k = end - text.c_str();
+	}
+	if (k != text.size() || labs(exponent) > 330)
+	{
+		return false;
+	}
+
+	DoubleDouble scale(1.0);
+	for (long e = 0; e < labs(exponent); ++e)
+	{
+		scale = scale * DoubleDouble(10.0);
+	}
+	value = exponent < 0 ? value / scale : value * scale;
+	o_value = negative ? -value : value;
+	return true;
+}
+
+// Double-double orbit of the center, rounded to double for the per-sample iteration
+struct PerturbationReference
+{
+	int nIterations;	   // Cap it was built for
+	vector<double> zr, zi; // Z_n for n = 0 .. length - 1, up to the cap or the escape
+};
+
+PerturbationReference buildPerturbationReference(const DoubleDouble &centerR, const DoubleDouble &centerI,
+												 int nIterations)
+{
+	PerturbationReference reference;
+	reference.nIterations = nIterations;
+	DoubleDouble zr, zi;
+	for (int n = 0; n <= nIterations; ++n)
+	{
+		reference.zr.push_back(zr.value());
+		reference.zi.push_back(zi.value());
+		if (zr.value() * zr.value() + zi.value() * zi.value() > 2.0)
+		{
+			break;
+		}
+		DoubleDouble zri = zr * zi;
+		DoubleDouble nextR = zr * zr - zi * zi + centerR;
+		zi = zri + zri + centerI;
+		zr = nextR;
+	}
+	return reference;
+}
+
+// Iterates center + dc by perturbation until it escapes or nIterations is reached,
+//  calling visit with every orbit point as an offset from the center. Returns the
+//  escape time, with the same meaning as escapeIterations. The reference needs at
+//  least two points, which any cap of one or more gives it.
+//
+// A point's offset is taken from the step itself, z' - center = z^2 + dc, rather than
+//  as the reference's offset plus the delta, so its accuracy does not rest on the
+//  rebasing rule keeping those two small. A point lands within r of the center only
+//  from a z of about sqrt(r), whose square carries double's relative error, so it is
+//  placed to about r * 1e-16 after any number of rebases.
+template <typename Visitor>
+int perturbedOrbit(const PerturbationReference &reference, const Complex &dc, int nIterations, Visitor &&visit)
+{
+	int last = (int)reference.zr.size() - 1;
+	int n = 0, m = 0;
+	double dr = 0.0, di = 0.0, zr = 0.0, zi = 0.0;
+	while (n < nIterations && zr * zr + zi * zi <= 2.0)
+	{
+		Complex offset(zr * zr - zi * zi + dc.r(), 2.0 * zr * zi + dc.i());
+		// (2 Z + d) d + dc
+		double tr = 2.0 * reference.zr[m] + dr, ti = 2.0 * reference.zi[m] + di;
+		double nextR = tr * dr - ti * di + dc.r();
+		di = tr * di + ti * dr + dc.i();
+		dr = nextR;
+		++m;
+		++n;
+		zr = reference.zr[m] + dr;
+		zi = reference.zi[m] + di;
+		visit(offset);
+		if (m == last || zr * zr + zi * zi < dr * dr + di * di)
+		{
+			dr = zr;
+			di = zi;
+			m = 0;
+		}
+	}
+	return n;
+}
+
+int rowFromReal(double real, double minR, double maxR, int imageHeight)
+{
+	// [minR, maxR]
+	// [0, maxR - minR] // subtract minR from n
+	// [0, imageHeight] // multiply by (imageHeight / (maxR - minR))
+	return (int)((real - minR) * (imageHeight / (maxR - minR)));
+}
+
+int colFromImaginary(double imag, double minI, double maxI, int imageWidth)
+{
+	return (int)((imag - minI) * (imageWidth / (maxI - minI)));
+}
+
+//
+// Random numbers
+//
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3") maps a
+//  128-bit counter and a 64-bit key to 128 random bits with ten cheap rounds and no
+//  state. Sample i of a render takes its numbers from counter i under the render's
+//  seed, so any worker can produce any sample directly: splitting work over threads,
+//  shards or SIMD lanes needs no coordination and cannot change which samples are drawn.
+//
+
+const uint32_t PHILOX_M0 = 0xD2511F53u, PHILOX_M1 = 0xCD9E8D57u;
+const uint32_t PHILOX_W0 = 0x9E3779B9u, PHILOX_W1 = 0xBB67AE85u;
+
+// Replaces ctr with the Philox4x32-10 block for (ctr, key)
+inline void philox4x32(uint32_t ctr[4], uint32_t key0, uint32_t key1)
+{
+	for (int round = 0; round < 10; ++round)
+	{
+		uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+		uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+		uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ key0;
+		uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ key1;
+		ctr[0] = c0;
+		ctr[1] = (uint32_t)p1;
+		ctr[2] = c2;
+		ctr[3] = (uint32_t)p0;
+		key0 += PHILOX_W0;
+		key1 += PHILOX_W1;
+	}
+}
+
+// Whether philox4x32 reproduces the Philox4x32-10 known-answer vectors shipped with
+//  Random123 (kat_vectors); every image drawn depends on it
+bool philoxKnownAnswers()
+{
+	struct Vector
+	{
+		uint32_t ctr[4], key[2], expected[4];
+	};
+	const Vector vectors[] = {
+		{{0, 0, 0, 0}, {0, 0}, {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+		{{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+		 {0xffffffff, 0xffffffff},
+		 {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+		{{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+		 {0xa4093822, 0x299f31d0},
+		 {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+	};
+	for (const Vector &v : vectors)
+	{
+		uint32_t block[4] = {v.ctr[0], v.ctr[1], v.ctr[2], v.ctr[3]};
+		philox4x32(block, v.key[0], v.key[1]);
+		if (!equal(block, block + 4, v.expected))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// 53 random bits from two words, as a double in [0, 1)
+inline double unitFromWords(uint32_t hi, uint32_t lo)
+{
+	return (double)((((uint64_t)hi << 32) | lo) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// The uniform point of [minimum, maximum] for counters first .. first + count - 1 of
+//  stream under seed. Each point is one Philox block and independent of the others,
+//  so the loop vectorizes.
+void philoxUniformPoints(unsigned long long seed, uint32_t stream, unsigned long long first, int count,
+						 const Complex &minimum, const Complex &maximum, double *o_r, double *o_i)
+{
+	double rangeR = maximum.r() - minimum.r(), rangeI = maximum.i() - minimum.i();
+	for (int k = 0; k < count; ++k)
+	{
+		unsigned long long counter = first + k;
+		uint32_t block[4] = {(uint32_t)counter, (uint32_t)(counter >> 32), stream, 0};
+		philox4x32(block, (uint32_t)seed, (uint32_t)(seed >> 32));
+		o_r[k] = minimum.r() + rangeR * unitFromWords(block[0], block[1]);
+		o_i[k] = minimum.i() + rangeI * unitFromWords(block[2], block[3]);
+	}
+}
+
+// Philox as a standard random engine, for samplers that consume an unknown number of
+//  values per sample. Stream s of a seed walks counters (0, s), (1, s), ...
+class PhiloxEngine
+{
+  public:
+	typedef uint32_t result_type;
+
+	PhiloxEngine(unsigned long long seed, unsigned long long stream)
+		: _key0((uint32_t)seed), _key1((uint32_t)(seed >> 32)), _stream(stream), _counter(0), _used(4)
+	{
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return 0xFFFFFFFFu; }
+
+	result_type operator()()
+	{
+		if (_used == 4)
+		{
+			_block[0] = (uint32_t)_counter;
+			_block[1] = (uint32_t)(_counter >> 32);
+			_block[2] = (uint32_t)_stream;
+			_block[3] = (uint32_t)(_stream >> 32);
+			philox4x32(_block, _key0, _key1);
+			++_counter;
+			_used = 0;
+		}
+		return _block[_used++];
+	}
+
+	// Cheaper than uniform_real_distribution, which goes through generate_canonical
+	double unit()
+	{
+		uint32_t hi = (*this)();
+		return unitFromWords(hi, (*this)());
+	}
+
+  private:
+	uint32_t _key0, _key1;
+	unsigned long long _stream, _counter;
+	uint32_t _block[4];
+	int _used;
+};
+
+// What the orbits are iterated in
+enum PrecisionKind
+{
+	PRECISION_DOUBLE,		// Plain double, good to zooms of about 1e-13
+	PRECISION_FLOAT,		// float: twice the vector lanes, for wide views whose pixels span well over 1e-7
+	PRECISION_PERTURBATION, // Double deltas from a double-double reference orbit, for deep zooms
+};
+
+// Importance map over the sampling domain, for viewports that only a small part of
+//  the domain's orbits ever reach. A pilot pass (see buildContributionMap) scores a
+//  grid of cells by the viewport hits of a few samples each; the main pass then picks
+//  a cell with probability following the scores and a point uniformly inside it, and
+//  splats its orbit with weight 1 / (probability * cells). That weight makes every
+//  sample count as it would under uniform sampling of the domain, so the heatmap
+//  converges to the same image while useless cells are rarely traced. Part of the
+//  probability (floor) is spread over all cells, so a cell the pilot happened to miss
+//  is still sampled now and then and the estimate stays unbiased.
+struct ContributionMap
+{
+	int rows = 0, cols = 0;	  // Cells along the real and imaginary axes
+	Complex minimum, maximum; // The sampling domain it covers
+	vector<double> cdf;		  // Running sum of the cell probabilities, row-major; ends at 1
+	vector<HeatmapType> weight; // Per cell: 1 / (probability * cells)
+	int usefulCells = 0;		  // Cells whose pilot samples hit the viewport
+};
+
+// Points for counters first .. first + count - 1 of the seed drawn from the map, with
+//  the splat weight of each
+void contributionPoints(const ContributionMap &map, unsigned long long seed, unsigned long long first, int count,
+						double *o_r, double *o_i, HeatmapType *o_weight)
+{
+	// Position inside the cell from the uniform stream, the cell from its own
+	philoxUniformPoints(seed, UNIFORM_STREAM, first, count, Complex(0.0, 0.0), Complex(1.0, 1.0), o_r, o_i);
+	double cellR = (map.maximum.r() - map.minimum.r()) / map.rows;
+	double cellI = (map.maximum.i() - map.minimum.i()) / map.cols;
+	for (int k = 0; k < count; ++k)
+	{
+		unsigned long long counter = first + k;
+		uint32_t block[4] = {(uint32_t)counter, (uint32_t)(counter >> 32), CELL_STREAM, 0};
+		philox4x32(block, (uint32_t)seed, (uint32_t)(seed >> 32));
+		double u = unitFromWords(block[0], block[1]);
+		size_t cell = upper_bound(map.cdf.begin(), map.cdf.end(), u) - map.cdf.begin();
+		cell = min(cell, map.cdf.size() - 1);
+		int row = (int)(cell / map.cols), col = (int)(cell % map.cols);
+		o_r[k] = map.minimum.r() + (row + o_r[k]) * cellR;
+		o_i[k] = map.minimum.i() + (col + o_i[k]) * cellI;
+		o_weight[k] = map.weight[cell];
+	}
+}
+
+// Which orbits GenerateHeatmaps accumulates
+enum OrbitKind
+{
+	ORBITS_ESCAPING, // The Buddhabrot: orbits of c outside the set, up to their escape
+	ORBITS_BOUNDED,	 // The Anti-Buddhabrot: orbits of c inside the set, up to each channel's cap
+};
+
+// How GenerateHeatmaps picks the sample points c
+enum SamplerKind
+{
+	SAMPLER_UNIFORM,	// Independent uniform draws over the sampling domain
+	SAMPLER_METROPOLIS, // Metropolis-Hastings chains biased toward c whose orbits land in view
+};
+
+// Knobs for GenerateHeatmaps beyond the viewport and caps. Most change only how fast
+//  it runs, not the image it converges to.
+struct SamplingOptions
+{
+	FractalKind fractal = FRACTAL_MANDELBROT;
+	int power = 2; // d in z = z^d + c, MIN_POWER .. MAX_POWER; above 2 gives a Multibrot
+	OrbitKind orbits = ORBITS_ESCAPING;
+
+	unsigned int nThreads = 0;	 // 0 = one worker per hardware thread
+	bool rejectInterior = true; // Skip cardioid/bulb samples and stop on periodic orbits
+
+	SamplerKind sampler = SAMPLER_UNIFORM;
+	double mutationScale = 0.01;  // Metropolis: std. deviation of a small step, as a fraction of the domain size
+	double largeStepChance = 0.1; // Metropolis: chance a proposal is a fresh uniform draw instead of a small step
+
+	unsigned long long seed = 0; // 0 = seed from the clock
+
+	// Region c is drawn from. Left equal (the default), samples are drawn over the
+	//  viewport itself; set it to render a sub-window of a larger image.
+	Complex domainMinimum, domainMaximum;
+
+	PrecisionKind precision = PRECISION_DOUBLE;
+	// Perturbation: the viewport, the domain and every c are offsets from this center
+	DoubleDouble centerR, centerI;
+	// Perturbation: the center's reference orbit; prepareSampling fills it in
+	shared_ptr<const PerturbationReference> reference;
+
+	// Uniform sampler: cells per side of a contribution map over the domain; 0 = none
+	int contributionCells = 0;
+	int pilotSamples = 16;		  // Contribution map: pilot samples per cell
+	double contributionFloor = 0.1; // Contribution map: share of probability spread evenly over all cells
+	// The map itself; prepareSampling fills it in
+	shared_ptr<const ContributionMap> contributionMap;
+
+	// Worker tiles of at least this many bytes buffer their orbit hits in SplatBins
+	size_t splatBinningBytes = SPLAT_BINNING_BYTES;
+	// Workers splat through SplatBins into one shared tile rather than a tile each, for
+	//  heatmaps too large to copy per worker
+	bool sharedTile = false;
+
+	double progressSeconds = 0; // Seconds between progress lines on stdout; 0 = none
+	string metricsPath;			 // If set, live counters are rewritten here in Prometheus text format
+};
+
+// Whether options draw c from a domain of their own rather than the viewport
+bool hasSamplingDomain(const SamplingOptions &options)
+{
+	return options.domainMinimum.r() != options.domainMaximum.r() ||
+		   options.domainMinimum.i() != options.domainMaximum.i();
+}
+
+// The region SamplingOptions says to draw c from for this viewport
+void samplingDomain(const SamplingOptions &options, const Complex &minimum, const Complex &maximum,
+					Complex &o_minimum, Complex &o_maximum)
+{
+	bool hasDomain = hasSamplingDomain(options);
+	o_minimum = hasDomain ? options.domainMinimum : minimum;
+	o_maximum = hasDomain ? options.domainMaximum : maximum;
+}
+
+const int ESCAPE_HISTOGRAM_BINS = 16;
+const int STATS_CHANNELS = 8; // Channels past this are not tallied per channel
+
+// What sampling did, per worker or summed over a render: work counters for benchmarks
+//  and progress reports, and the uniform draws Metropolis uses to estimate its
+//  normalizing constant. Every field holds whole numbers, so sums are exact in any order.
+struct SamplerStats
+{
+	long long samples = 0;	  // Candidates run through the escape test, Metropolis proposals included
+	long long interior = 0;	  // Of those, skipped by the cardioid/bulb test without iterating
+	long long escaped = 0;	  // Of those, escaped under the largest cap
+	long long iterations = 0; // Orbit steps of escape tests and replays; periodic orbits count in full
+	long long hits = 0;		  // Orbit points splatted into the viewport
+	// Escaped samples by escape time, bin b covering [b, b + 1) * cap / ESCAPE_HISTOGRAM_BINS
+	long long escapeHistogram[ESCAPE_HISTOGRAM_BINS] = {0};
+	long long channelSamples[STATS_CHANNELS] = {0}; // Samples splatted into each channel
+	long long channelHits[STATS_CHANNELS] = {0};	// Orbit points splatted into each channel
+
+	double contribution = 0; // Metropolis: sum of the uniform draws' contributions
+	long long draws = 0;	 // Metropolis: number of uniform draws
+
+	void add(const SamplerStats &other)
+	{
+		samples += other.samples;
+		interior += other.interior;
+		escaped += other.escaped;
+		iterations += other.iterations;
+		hits += other.hits;
+		for (int b = 0; b < ESCAPE_HISTOGRAM_BINS; ++b)
+		{
+			escapeHistogram[b] += other.escapeHistogram[b];
+		}
+		for (int ch = 0; ch < STATS_CHANNELS; ++ch)
+		{
+			channelSamples[ch] += other.channelSamples[ch];
+			channelHits[ch] += other.channelHits[ch];
+		}
+		contribution += other.contribution;
+		draws += other.draws;
+	}
+};
+
+// Tallies one escapeBatch call: count candidates capped at nIterations, interior of
+//  them skipped
+void recordEscapeBatch(SamplerStats &io_stats, const int *nPoints, int count, int nIterations, int interior)
+{
+	io_stats.samples += count;
+	io_stats.interior += interior;
+	io_stats.iterations -= (long long)interior * nIterations;
+	for (int k = 0; k < count; ++k)
+	{
+		io_stats.iterations += nPoints[k];
+		if (nPoints[k] < nIterations)
+		{
+			++io_stats.escaped;
+			++io_stats.escapeHistogram[(long long)nPoints[k] * ESCAPE_HISTOGRAM_BINS / nIterations];
+		}
+	}
+}
+
+// Tallies one splatOrbit call that put hits points into each of channels
+void recordSplat(SamplerStats &io_stats, const vector<int> &channels, int hits)
+{
+	io_stats.hits += hits;
+	for (int ch : channels)
+	{
+		if (ch < STATS_CHANNELS)
+		{
+			++io_stats.channelSamples[ch];
+			io_stats.channelHits[ch] += hits;
+		}
+	}
+}
+
+// Runs one batch of at most SAMPLE_BATCH candidates through the escape kernel,
+//  marking cardioid/bulb samples as bounded up front when rejectInterior is set.
+//  Returns how many were marked that way without being iterated. Other powers have
+//  no closed-form interior test and rely on period detection alone. Perturbation
+//  runs one sample at a time with neither, as c there is an offset and the deltas
+//  never repeat exactly.
+template <typename Formula>
+int escapeBatch(const SamplingOptions &options, const double *cr, const double *ci, int count, int nIterations,
+				 int *o_nPoints)
+{
+	if (options.precision == PRECISION_PERTURBATION)
+	{
+		for (int k = 0; k < count; ++k)
+		{
+			o_nPoints[k] = perturbedOrbit(*options.reference, Complex(cr[k], ci[k]), nIterations, [](const Complex &) {});
+		}
+		return 0;
+	}
+
+	const EscapeKernel &kernel = escapeKernel<Formula>();
+	EscapeKernelFn runKernel = options.rejectInterior ? kernel.runPeriodic : kernel.run;
+	if (options.precision == PRECISION_FLOAT && nIterations <= FLOAT_MAX_ITERATIONS)
+	{
+		runKernel = options.rejectInterior ? kernel.runFloatPeriodic : kernel.runFloat;
+	}
+	if (!options.rejectInterior || !Formula::cardioid)
+	{
+		runKernel(cr, ci, count, nIterations, o_nPoints);
+		return 0;
+	}
+
+	double traceR[SAMPLE_BATCH], traceI[SAMPLE_BATCH];
+	int tracePoints[SAMPLE_BATCH], traceIdx[SAMPLE_BATCH];
+	int traceCount = 0;
+	for (int k = 0; k < count; ++k)
+	{
+		if (inMainCardioidOrBulb(Complex(cr[k], ci[k])))
+		{
+			o_nPoints[k] = nIterations;
+			continue;
+		}
+		traceR[traceCount] = cr[k];
+		traceI[traceCount] = ci[k];
+		traceIdx[traceCount] = k;
+		++traceCount;
+	}
+	runKernel(traceR, traceI, traceCount, nIterations, tracePoints);
+	for (int j = 0; j < traceCount; ++j)
+	{
+		o_nPoints[traceIdx[j]] = tracePoints[j];
+	}
+	return count - traceCount;
+}
+
+// Collects the channels whose cap an orbit with this escape time escapes under; a
+//  channel with a higher cap than the escape time would have seen it escape too
+void escapedChannels(int nPoints, const vector<int> &channelIters, vector<int> &o_escaped)
+{
+	o_escaped.clear();
+	for (size_t ch = 0; ch < channelIters.size(); ++ch)
+	{
+		if (nPoints < channelIters[ch])
+		{
+			o_escaped.push_back((int)ch);
+		}
+	}
+}
+
+// Calls splat(channels, nPoints) for each group of channels that accumulates the orbit
+//  of a sample with escape time nPoints, with how many of its points they take. An
+//  escaping orbit goes whole to every channel it escapes under; with ORBITS_BOUNDED
+//  an orbit goes to the channels it stays bounded under, each taking its first cap
+//  points, so channels sharing a cap share one replay. io_group is scratch space.
+template <typename Splat>
+void forEachOrbitSplat(const SamplingOptions &options, int nPoints, const vector<int> &channelIters,
+					   vector<int> &io_group, Splat &&splat)
+{
+	if (options.orbits != ORBITS_BOUNDED)
+	{
+		escapedChannels(nPoints, channelIters, io_group);
+		if (!io_group.empty())
+		{
+			splat(io_group, nPoints);
+		}
+		return;
+	}
+	for (size_t ch = 0; ch < channelIters.size(); ++ch)
+	{
+		int cap = channelIters[ch];
+		// Each cap once, at the first channel that has it
+		if (nPoints < cap || find(channelIters.begin(), channelIters.begin() + ch, cap) != channelIters.begin() + ch)
+		{
+			continue;
+		}
+		io_group.clear();
+		for (size_t other = ch; other < channelIters.size(); ++other)
+		{
+			if (channelIters[other] == cap)
+			{
+				io_group.push_back((int)other);
+			}
+		}
+		splat(io_group, cap);
+	}
+}
+
+// visitOrbit in the precision options asks for; float orbits are replayed in float so
+//  they end where the float escape test said
+template <typename Formula, typename Visitor>
+void visitSampleOrbit(const SamplingOptions &options, const Complex &c, int nPoints, Visitor &&visit)
+{
+	switch (options.precision)
+	{
+	case PRECISION_PERTURBATION:
+		perturbedOrbit(*options.reference, c, nPoints, visit);
+		break;
+	case PRECISION_FLOAT:
+		visitOrbit<Formula, float>(c, nPoints, visit);
+		break;
+	case PRECISION_DOUBLE:
+	default:
+		visitOrbit<Formula>(c, nPoints, visit);
+		break;
+	}
+}
+
+bool inViewport(const Complex &point, const Complex &minimum, const Complex &maximum)
+{
+	return point.r() <= maximum.r() && point.r() >= minimum.r() && point.i() <= maximum.i() && point.i() >= minimum.i();
+}
+
+// Channel 0 of the tile's pixel under point, which must lie in the viewport [minimum, maximum]
+inline HeatmapType *pixelUnder(Heatmap &o_tile, const Complex &point, const Complex &minimum, const Complex &maximum)
+{
+	int imageWidth = o_tile.width(), imageHeight = o_tile.height();
+	// A point exactly on the maximum edge belongs to the last row/column
+	int row = min(rowFromReal(point.r(), minimum.r(), maximum.r(), imageHeight), imageHeight - 1);
+	int col = min(colFromImaginary(point.i(), minimum.i(), maximum.i(), imageWidth), imageWidth - 1);
+	return o_tile.pixel(row, col);
+}
+
+// Adds weight to the given channels of the tile's pixel under point, which must lie in
+//  the viewport [minimum, maximum]
+inline void splatPoint(Heatmap &o_tile, const Complex &point, const vector<int> &channels, HeatmapType weight,
+					   const Complex &minimum, const Complex &maximum)
+{
+	HeatmapType *pixel = pixelUnder(o_tile, point, minimum, maximum);
+	size_t channelStride = o_tile.channelStride();
+	for (int ch : channels)
+	{
+		pixel[ch * channelStride] += weight;
+	}
+}
+
+//
+// Binned splatting
+//
+// Splatting straight into a tile far larger than the caches makes every orbit point a
+//  write to a random line of a random page. From options.splatBinningBytes on, a
+//  worker's hits are instead appended to bins that each cover SPLAT_BIN_BYTES of the
+//  tile, and a full bin is applied in one go: its writes stay inside a span that fits
+//  L2 and the TLB, and the appends only touch the tail line of each bin. All hits on a
+//  pixel land in the same bin and are applied in the order they were made, so the tile
+//  ends up bit-identical to splatting it directly. The bins take about a tenth of the
+//  tile's size on top of it.
+//
+// Bins can also feed one tile shared by all workers (SamplingOptions::sharedTile), each
+//  bin applied under its own lock. Shared bins hold fewer hits, so all workers' bins
+//  together still take about a tenth of the tile, and whole-number counts come out the
+//  same whatever order the workers' flushes land in.
+//
+
+struct SplatHit
+{
+	uint32_t offset;   // Of the pixel's channel 0 in the tile
+	uint32_t channels; // Bit ch set for every channel ch the hit adds to
+	HeatmapType weight;
+};
+
+// A worker's bins; kept across calls so the buffers are allocated once per worker
+class SplatBins
+{
+  public:
+	// Whether hits on tile fit a SplatHit
+	static bool canBin(const Heatmap &tile)
+	{
+		return tile.size() <= UINT32_MAX && tile.channels() <= 32;
+	}
+
+	// Bins over tile, and so locks a shared tile needs
+	static size_t binCount(const Heatmap &tile)
+	{
+		return (tile.pixelCount() * tile.pixelStride() + binOffsets(tile) - 1) / binOffsets(tile);
+	}
+
+	// Hits each of nWorkers' bins buffers on a shared tile
+	static int sharedBinHits(unsigned int nWorkers)
+	{
+		return max(SPLAT_SHARED_BIN_HITS, SPLAT_BIN_HITS / (int)max(1u, nWorkers));
+	}
+
+	// Has the bins apply bin b under locks[b] from now on, buffering binHits hits each,
+	//  for a tile every worker splats into. locks holds binCount(tile) mutexes.
+	void share(mutex *locks, int binHits)
+	{
+		_locks = locks;
+		_binHits = binHits;
+		_counts.clear();
+	}
+
+	// Points the bins at tile if options ask to bin a tile of its size, or always when
+	//  shared; returns whether they do. Any hits still buffered for another tile must
+	//  have been flushed.
+	bool bind(Heatmap &tile, const SamplingOptions &options)
+	{
+		_tile = nullptr;
+		if ((!_locks && tile.size() * sizeof(HeatmapType) < options.splatBinningBytes) || !canBin(tile))
+		{
+			return false;
+		}
+		_binOffsets = binOffsets(tile);
+		size_t nBins = binCount(tile);
+		if (nBins != _counts.size())
+		{
+			_hits.reset(new SplatHit[nBins * _binHits]);
+		}
+		_counts.assign(nBins, 0);
+		_tile = &tile;
+		return true;
+	}
+
+	// Buffers adding weight to the channels set in the mask of the bound tile's pixel
+	void add(HeatmapType *pixel, uint32_t channels, HeatmapType weight)
+	{
+		size_t offset = pixel - _tile->data();
+		size_t bin = offset / _binOffsets;
+		_hits[bin * _binHits + _counts[bin]] = SplatHit{(uint32_t)offset, channels, weight};
+		if (++_counts[bin] == _binHits)
+		{
+			flushBin(bin);
+		}
+	}
+
+	// Applies every buffered hit to the tile
+	void flush()
+	{
+		for (size_t bin = 0; bin < _counts.size(); ++bin)
+		{
+			flushBin(bin);
+		}
+	}
+
+  private:
+	// Pixel offsets per bin; a planar tile's offset stands for one element in every plane
+	static size_t binOffsets(const Heatmap &tile)
+	{
+		return max<size_t>(1, SPLAT_BIN_BYTES / sizeof(HeatmapType) / (tile.interleaved() ? 1 : tile.channels()));
+	}
+
+	void flushBin(size_t bin)
+	{
+		if (_counts[bin] == 0)
+		{
+			return;
+		}
+		unique_lock<mutex> lock;
+		if (_locks)
+		{
+			lock = unique_lock<mutex>(_locks[bin]);
+		}
+		HeatmapType *data = _tile->data();
+		size_t channelStride = _tile->channelStride();
+		const SplatHit *hits = &_hits[bin * _binHits];
+		for (int k = 0; k < _counts[bin]; ++k)
+		{
+			HeatmapType *pixel = data + hits[k].offset;
+			for (uint32_t mask = hits[k].channels, ch = 0; mask != 0; mask >>= 1, ++ch)
+			{
+				if (mask & 1)
+				{
+					pixel[ch * channelStride] += hits[k].weight;
+				}
+			}
+		}
+		_counts[bin] = 0;
+	}
+
+	Heatmap *_tile = nullptr;
+	size_t _binOffsets = 1; // Pixel offsets per bin
+	int _binHits = SPLAT_BIN_HITS;
+	mutex *_locks = nullptr; // Per bin, when the tile is shared
+	unique_ptr<SplatHit[]> _hits;
+	vector<int> _counts; // Hits buffered per bin
+};
+
+uint32_t channelMask(const vector<int> &channels)
+{
+	uint32_t mask = 0;
+	for (int ch : channels)
+	{
+		mask |= 1u << ch;
+	}
+	return mask;
+}
+
+// Adds weight to the given channels of every pixel of the tile that the first nPoints
+//  points of the orbit of c land on, through io_bins if given (bound to o_tile).
+//  Returns how many points landed.
+template <typename Formula>
+int splatOrbit(const SamplingOptions &options, const Complex &c, int nPoints, Heatmap &o_tile,
+			   const vector<int> &channels, HeatmapType weight, const Complex &minimum, const Complex &maximum,
+			   SplatBins *io_bins = nullptr)
+{
+	int hits = 0;
+	uint32_t mask = io_bins ? channelMask(channels) : 0;
+	visitSampleOrbit<Formula>(options, c, nPoints, [&](const Complex &point) {
+		if (inViewport(point, minimum, maximum))
+		{
+			++hits;
+			if (io_bins)
+			{
+				io_bins->add(pixelUnder(o_tile, point, minimum, maximum), mask, weight);
+			}
+			else
+			{
+				splatPoint(o_tile, point, channels, weight, minimum, maximum);
+			}
+		}
+	});
+	return hits;
+}
+
+// The viewports of the frames of a sequence, with the box around all of them
+struct FrameViewports
+{
+	vector<Complex> minimums, maximums;
+	Complex boundsMinimum, boundsMaximum;
+
+	void add(const Complex &minimum, const Complex &maximum)
+	{
+		boundsMinimum = minimums.empty() ? minimum
+										 : Complex(min(boundsMinimum.r(), minimum.r()), min(boundsMinimum.i(), minimum.i()));
+		boundsMaximum = maximums.empty() ? maximum
+										 : Complex(max(boundsMaximum.r(), maximum.r()), max(boundsMaximum.i(), maximum.i()));
+		minimums.push_back(minimum);
+		maximums.push_back(maximum);
+	}
+
+	size_t size() const { return minimums.size(); }
+};
+
+// splatOrbit into several frames at once: o_tiles[f] covers frames.minimums[f] ..
+//  frames.maximums[f]. The orbit is iterated once however many frames it lands in, and
+//  a point outside the frames' bounds costs one test. Returns the landings over all frames.
+template <typename Formula>
+int splatOrbitFrames(const SamplingOptions &options, const Complex &c, int nPoints, const vector<Heatmap *> &o_tiles,
+					 const vector<int> &channels, HeatmapType weight, const FrameViewports &frames)
+{
+	int hits = 0;
+	visitSampleOrbit<Formula>(options, c, nPoints, [&](const Complex &point) {
+		if (!inViewport(point, frames.boundsMinimum, frames.boundsMaximum))
+		{
+			return;
+		}
+		for (size_t f = 0; f < frames.size(); ++f)
+		{
+			if (inViewport(point, frames.minimums[f], frames.maximums[f]))
+			{
+				++hits;
+				splatPoint(*o_tiles[f], point, channels, weight, frames.minimums[f], frames.maximums[f]);
+			}
+		}
+	});
+	return hits;
+}
+
+// Number of the first nPoints points of the orbit of c that land in the viewport
+template <typename Formula>
+int viewportHits(const SamplingOptions &options, const Complex &c, int nPoints, const Complex &minimum,
+				 const Complex &maximum)
+{
+	int hits = 0;
+	visitSampleOrbit<Formula>(options, c, nPoints, [&](const Complex &point) {
+		hits += inViewport(point, minimum, maximum) ? 1 : 0;
+	});
+	return hits;
+}
+
+// Uniform sampler: samples firstSample .. firstSample + nSamples - 1 of the seed are
+//  each iterated once up to the largest channel cap and then counted in every channel
+//  they escape under. With a contribution map in options the points come from it,
+//  each counted with its weight.
+template <typename Formula>
+void SampleUniformTile(Heatmap &o_tile, const vector<int> &channelIters, const Complex &minimum,
+					   const Complex &maximum, long long firstSample, long long nSamples,
+					   const SamplingOptions &options, unsigned long long seed, SamplerStats &io_stats,
+					   SplatBins *io_bins)
+{
+	Complex domainMin, domainMax;
+	samplingDomain(options, minimum, maximum, domainMin, domainMax);
+	SplatBins *bins = io_bins && io_bins->bind(o_tile, options) ? io_bins : nullptr;
+
+	int maxIters = *max_element(channelIters.begin(), channelIters.end());
+	vector<int> channels;
+	channels.reserve(channelIters.size());
+
+	// Samples are drawn a batch at a time so the escape test can run them through the
+	//  vector kernel together; only the orbit replay is done one sample at a time
+	double batchR[SAMPLE_BATCH], batchI[SAMPLE_BATCH];
+	HeatmapType batchWeight[SAMPLE_BATCH];
+	int batchPoints[SAMPLE_BATCH];
+	fill(batchWeight, batchWeight + SAMPLE_BATCH, (HeatmapType)1);
+
+	// Collect nSamples samples... (sample is just a random number c)
+	for (long long batchStart = 0; batchStart < nSamples; batchStart += SAMPLE_BATCH)
+	{
+		int batchSize = (int)min<long long>(SAMPLE_BATCH, nSamples - batchStart);
+		if (options.contributionMap)
+		{
+			contributionPoints(*options.contributionMap, seed, firstSample + batchStart, batchSize, batchR, batchI,
+							   batchWeight);
+		}
+		else
+		{
+			philoxUniformPoints(seed, UNIFORM_STREAM, firstSample + batchStart, batchSize, domainMin, domainMax,
+								batchR, batchI);
+		}
+		int interior = escapeBatch<Formula>(options, batchR, batchI, batchSize, maxIters, batchPoints);
+		recordEscapeBatch(io_stats, batchPoints, batchSize, maxIters, interior);
+
+		for (int k = 0; k < batchSize; ++k)
+		{
+			//  Each sample, get the list of points as the function
+			//    escapes to infinity (if it does at all)
+			Complex c(batchR[k], batchI[k]);
+			forEachOrbitSplat(options, batchPoints[k], channelIters, channels, [&](const vector<int> &group, int nPoints) {
+				recordSplat(io_stats, group,
+							splatOrbit<Formula>(options, c, nPoints, o_tile, group, batchWeight[k], minimum, maximum, bins));
+				io_stats.iterations += nPoints;
+			});
+		}
+	}
+	if (bins)
+	{
+		bins->flush();
+	}
+}
+
+// SampleUniformTile for a sequence of frames: the same samples, drawn over the
+//  sampling domain in options, are traced once and splatted into every frame's tile,
+//  so o_tiles[f] ends up as SampleUniformTile would leave it for frame f alone with
+//  that domain
+template <typename Formula>
+void SampleSequenceTile(const vector<Heatmap *> &o_tiles, const vector<int> &channelIters,
+						const FrameViewports &frames, long long firstSample, long long nSamples,
+						const SamplingOptions &options, unsigned long long seed, SamplerStats &io_stats)
+{
+	Complex domainMin, domainMax;
+	samplingDomain(options, frames.boundsMinimum, frames.boundsMaximum, domainMin, domainMax);
+
+	int maxIters = *max_element(channelIters.begin(), channelIters.end());
+	vector<int> channels;
+	channels.reserve(channelIters.size());
+
+	double batchR[SAMPLE_BATCH], batchI[SAMPLE_BATCH];
+	HeatmapType batchWeight[SAMPLE_BATCH];
+	int batchPoints[SAMPLE_BATCH];
+	fill(batchWeight, batchWeight + SAMPLE_BATCH, (HeatmapType)1);
+
+	for (long long batchStart = 0; batchStart < nSamples; batchStart += SAMPLE_BATCH)
+	{
+		int batchSize = (int)min<long long>(SAMPLE_BATCH, nSamples - batchStart);
+		if (options.contributionMap)
+		{
+			contributionPoints(*options.contributionMap, seed, firstSample + batchStart, batchSize, batchR, batchI,
+							   batchWeight);
+		}
+		else
+		{
+			philoxUniformPoints(seed, UNIFORM_STREAM, firstSample + batchStart, batchSize, domainMin, domainMax,
+								batchR, batchI);
+		}
+		int interior = escapeBatch<Formula>(options, batchR, batchI, batchSize, maxIters, batchPoints);
+		recordEscapeBatch(io_stats, batchPoints, batchSize, maxIters, interior);
+
+		for (int k = 0; k < batchSize; ++k)
+		{
+			Complex c(batchR[k], batchI[k]);
+			forEachOrbitSplat(options, batchPoints[k], channelIters, channels, [&](const vector<int> &group, int nPoints) {
+				recordSplat(io_stats, group,
+							splatOrbitFrames<Formula>(options, c, nPoints, o_tiles, group, batchWeight[k], frames));
+				io_stats.iterations += nPoints;
+			});
+		}
+	}
+}
+
+// State of one Metropolis-Hastings chain
+struct MetropolisChain
+{
+	Complex c;
+	int nPoints;		 // Escape time of c
+	int contribution;	 // In-view orbit points of c, counted if it escapes under any channel
+	long long stay;		 // Steps the chain has spent on c since it was accepted
+};
+
+// Metropolis-Hastings sampler: SAMPLE_BATCH chains step in lockstep so their proposals
+//  share a trip through the escape kernel. The target density is proportional to a
+//  sample's in-view orbit length, so chains linger where orbits cross the viewport.
+//  Proposals are either a small Gaussian step or, with largeStepChance, a fresh
+//  uniform draw; both are symmetric, so a move is accepted with probability
+//  min(1, new contribution / old contribution).
+//
+// Each accepted state's orbit is splatted once with weight (steps spent there) /
+//  contribution, which undoes the bias toward high-contribution samples. The uniform
+//  draws are tallied in io_stats; scaling by their mean contribution (an estimate of
+//  the target's normalizing constant, see samplerScale) puts the tile on the same
+//  scale as nSamples uniform samples, so both samplers converge to the same heatmap.
+//
+// The chains draw from the seed's stream keyed by firstSample, so a given split of a
+//  render into ranges always replays the same chains.
+template <typename Formula>
+void SampleMetropolisTile(Heatmap &o_tile, const vector<int> &channelIters, const Complex &minimum,
+						  const Complex &maximum, long long firstSample, long long nSamples,
+						  const SamplingOptions &options, unsigned long long seed, SamplerStats &io_stats,
+						  SplatBins *io_bins)
+{
+	Complex domainMin, domainMax;
+	samplingDomain(options, minimum, maximum, domainMin, domainMax);
+	SplatBins *bins = io_bins && io_bins->bind(o_tile, options) ? io_bins : nullptr;
+	PhiloxEngine rng(seed, (unsigned long long)firstSample + 1); // Stream 0 is UNIFORM_STREAM
+	auto uniformDraw = [&](double &o_r, double &o_i) {
+		o_r = domainMin.r() + (domainMax.r() - domainMin.r()) * rng.unit();
+		o_i = domainMin.i() + (domainMax.i() - domainMin.i()) * rng.unit();
+	};
+	normal_distribution<double> realStep(0.0, options.mutationScale * (domainMax.r() - domainMin.r()));
+	normal_distribution<double> imagStep(0.0, options.mutationScale * (domainMax.i() - domainMin.i()));
+
+	int maxIters = *max_element(channelIters.begin(), channelIters.end());
+	vector<int> escaped;
+	escaped.reserve(channelIters.size());
+
+	// Escaping under the largest cap is the same as escaping under some channel
+	auto contributionOf = [&](const Complex &c, int nPoints) {
+		if (nPoints >= maxIters)
+		{
+			return 0;
+		}
+		io_stats.iterations += nPoints;
+		return viewportHits<Formula>(options, c, nPoints, minimum, maximum);
+	};
+	auto leaveState = [&](const MetropolisChain &chain) {
+		if (chain.contribution > 0)
+		{
+			escapedChannels(chain.nPoints, channelIters, escaped);
+			recordSplat(io_stats, escaped,
+						splatOrbit<Formula>(options, chain.c, chain.nPoints, o_tile, escaped,
+											(HeatmapType)chain.stay / chain.contribution, minimum, maximum, bins));
+			io_stats.iterations += chain.nPoints;
+		}
+	};
+
+	double batchR[SAMPLE_BATCH], batchI[SAMPLE_BATCH];
+	int batchPoints[SAMPLE_BATCH];
+	bool largeStep[SAMPLE_BATCH];
+	int nChains = (int)min<long long>(SAMPLE_BATCH, max(1LL, nSamples));
+	MetropolisChain chains[SAMPLE_BATCH];
+
+	// Seed every chain with uniform draws until it has a state that contributes. These
+	//  draws also feed the normalizing estimate, but not the sample budget.
+	const int MAX_SEED_ROUNDS = 1000;
+	for (int k = 0; k < nChains; ++k)
+	{
+		chains[k] = MetropolisChain{Complex(), maxIters, 0, 0};
+	}
+	for (int round = 0; round < MAX_SEED_ROUNDS; ++round)
+	{
+		bool seeded = true;
+		for (int k = 0; k < nChains; ++k)
+		{
+			uniformDraw(batchR[k], batchI[k]);
+		}
+		int interior = escapeBatch<Formula>(options, batchR, batchI, nChains, maxIters, batchPoints);
+		recordEscapeBatch(io_stats, batchPoints, nChains, maxIters, interior);
+		for (int k = 0; k < nChains; ++k)
+		{
+			Complex c(batchR[k], batchI[k]);
+			int contribution = contributionOf(c, batchPoints[k]);
+			io_stats.contribution += contribution;
+			++io_stats.draws;
+			if (chains[k].contribution == 0 && contribution > 0)
+			{
+				chains[k] = MetropolisChain{c, batchPoints[k], contribution, 0};
+			}
+			seeded = seeded && chains[k].contribution > 0;
+		}
+		if (seeded)
+		{
+			break;
+		}
+	}
+
+	for (long long stepStart = 0; stepStart < nSamples; stepStart += nChains)
+	{
+		int stepSize = (int)min<long long>(nChains, nSamples - stepStart);
+		for (int k = 0; k < stepSize; ++k)
+		{
+			largeStep[k] = chains[k].contribution == 0 || rng.unit() < options.largeStepChance;
+			if (largeStep[k])
+			{
+				uniformDraw(batchR[k], batchI[k]);
+			}
+			else
+			{
+				batchR[k] = chains[k].c.r() + realStep(rng);
+				batchI[k] = chains[k].c.i() + imagStep(rng);
+			}
+		}
+		int interior = escapeBatch<Formula>(options, batchR, batchI, stepSize, maxIters, batchPoints);
+		recordEscapeBatch(io_stats, batchPoints, stepSize, maxIters, interior);
+
+		for (int k = 0; k < stepSize; ++k)
+		{
+			MetropolisChain &chain = chains[k];
+			Complex proposal(batchR[k], batchI[k]);
+
+			// Small steps can leave the sampling domain; the target density is zero there
+			bool inDomain = inViewport(proposal, domainMin, domainMax);
+			int contribution = inDomain ? contributionOf(proposal, batchPoints[k]) : 0;
+			if (largeStep[k])
+			{
+				io_stats.contribution += contribution;
+				++io_stats.draws;
+			}
+
+			bool accept = contribution > 0 &&
+						  (chain.contribution == 0 || contribution >= chain.contribution ||
+						   rng.unit() * chain.contribution < contribution);
+			if (accept)
+			{
+				leaveState(chain);
+				chain = MetropolisChain{proposal, batchPoints[k], contribution, 1};
+			}
+			else
+			{
+				++chain.stay;
+			}
+		}
+	}
+	for (int k = 0; k < nChains; ++k)
+	{
+		leaveState(chains[k]);
+	}
+	if (bins)
+	{
+		bins->flush();
+	}
+}
+
+// Factor that brings tiles traced with these options to the scale of uniform counts
+HeatmapType samplerScale(const SamplingOptions &options, const SamplerStats &stats)
+{
+	if (options.sampler != SAMPLER_METROPOLIS || stats.draws == 0)
+	{
+		return 1;
+	}
+	return (HeatmapType)(stats.contribution / stats.draws);
+}
+
+// Traces samples firstSample .. firstSample + nSamples - 1 of the seed into a heatmap
+//  owned by the calling thread, one channel per entry of channelIters, with the
+//  sampler picked in options. Nothing here is shared with other workers, so the
+//  scatter needs no atomics. What was done is added to io_stats, and the result still
+//  needs scaling by samplerScale(options, io_stats). io_bins, the worker's SplatBins
+//  if it has any, are used on tiles large enough to gain from them.
+template <typename Formula>
+void SampleHeatmapTileFormula(Heatmap &o_tile, const vector<int> &channelIters, const Complex &minimum,
+							  const Complex &maximum, long long firstSample, long long nSamples,
+							  const SamplingOptions &options, unsigned long long seed, SamplerStats &io_stats,
+							  SplatBins *io_bins)
+{
+	switch (options.sampler)
+	{
+	case SAMPLER_METROPOLIS:
+		SampleMetropolisTile<Formula>(o_tile, channelIters, minimum, maximum, firstSample, nSamples, options, seed,
+									  io_stats, io_bins);
+		break;
+	case SAMPLER_UNIFORM:
+	default:
+		SampleUniformTile<Formula>(o_tile, channelIters, minimum, maximum, firstSample, nSamples, options, seed,
+								   io_stats, io_bins);
+		break;
+	}
+}
+
+// Calls Task<Recurrence<power, Fold>>::run(args...), resolving the power once so that
+//  every loop inside the task runs a specialization with no per-iteration branch on it
+template <template <typename> class Task, bool Fold, typename... Args>
+void dispatchPower(int power, Args &&...args)
+{
+	static_assert(MAX_POWER == 8, "Add a case for every power up to MAX_POWER");
+	switch (power)
+	{
+	case 3:
+		Task<Recurrence<3, Fold>>::run(forward<Args>(args)...);
+		break;
+	case 4:
+		Task<Recurrence<4, Fold>>::run(forward<Args>(args)...);
+		break;
+	case 5:
+		Task<Recurrence<5, Fold>>::run(forward<Args>(args)...);
+		break;
+	case 6:
+		Task<Recurrence<6, Fold>>::run(forward<Args>(args)...);
+		break;
+	case 7:
+		Task<Recurrence<7, Fold>>::run(forward<Args>(args)...);
+		break;
+	case 8:
+		Task<Recurrence<8, Fold>>::run(forward<Args>(args)...);
+		break;
+	default:
+		Task<Recurrence<2, Fold>>::run(forward<Args>(args)...);
+		break;
+	}
+}
+
+// dispatchPower for the family and power in options
+template <template <typename> class Task, typename... Args>
+void dispatchFormula(const SamplingOptions &options, Args &&...args)
+{
+	switch (options.fractal)
+	{
+	case FRACTAL_BURNING_SHIP:
+		dispatchPower<Task, true>(options.power, forward<Args>(args)...);
+		break;
+	case FRACTAL_MANDELBROT:
+	default:
+		dispatchPower<Task, false>(options.power, forward<Args>(args)...);
+		break;
+	}
+}
+
+template <typename Formula>
+struct SampleTileTask
+{
+	static void run(Heatmap &o_tile, const vector<int> &channelIters, const Complex &minimum, const Complex &maximum,
+					long long firstSample, long long nSamples, const SamplingOptions &options, unsigned long long seed,
+					SamplerStats &io_stats, SplatBins *io_bins)
+	{
+		SampleHeatmapTileFormula<Formula>(o_tile, channelIters, minimum, maximum, firstSample, nSamples, options, seed,
+										  io_stats, io_bins);
+	}
+};
+
+template <typename Formula>
+struct SequenceTileTask
+{
+	static void run(const vector<Heatmap *> &o_tiles, const vector<int> &channelIters, const FrameViewports &frames,
+					long long firstSample, long long nSamples, const SamplingOptions &options, unsigned long long seed,
+					SamplerStats &io_stats)
+	{
+		SampleSequenceTile<Formula>(o_tiles, channelIters, frames, firstSample, nSamples, options, seed, io_stats);
+	}
+};
+
+// SampleHeatmapTileFormula for the recurrence in options
+void SampleHeatmapTile(Heatmap &o_tile, const vector<int> &channelIters, const Complex &minimum,
+					   const Complex &maximum, long long firstSample, long long nSamples,
+					   const SamplingOptions &options, unsigned long long seed, SamplerStats &io_stats,
+					   SplatBins *io_bins = nullptr)
+{
+	dispatchFormula<SampleTileTask>(options, o_tile, channelIters, minimum, maximum, firstSample, nSamples, options,
+									seed, io_stats, io_bins);
+}
+
+// Pilot pass of a contribution map: scores cells [cellBegin, cellEnd) of io_map by the
+//  viewport hits of what options.pilotSamples points drawn in each would splat
+template <typename Formula>
+struct PilotTask
+{
+	static void run(ContributionMap &io_map, vector<double> &o_scores, size_t cellBegin, size_t cellEnd,
+					const vector<int> &channelIters, const Complex &minimum, const Complex &maximum,
+					const SamplingOptions &options, unsigned long long seed)
+	{
+		int maxIters = *max_element(channelIters.begin(), channelIters.end());
+		double cellR = (io_map.maximum.r() - io_map.minimum.r()) / io_map.rows;
+		double cellI = (io_map.maximum.i() - io_map.minimum.i()) / io_map.cols;
+		double batchR[SAMPLE_BATCH], batchI[SAMPLE_BATCH];
+		int batchPoints[SAMPLE_BATCH];
+		vector<int> group;
+		for (size_t cell = cellBegin; cell < cellEnd; ++cell)
+		{
+			Complex cellMin(io_map.minimum.r() + (cell / io_map.cols) * cellR,
+							io_map.minimum.i() + (cell % io_map.cols) * cellI);
+			Complex cellMax(cellMin.r() + cellR, cellMin.i() + cellI);
+			double score = 0;
+			for (int drawn = 0; drawn < options.pilotSamples; drawn += SAMPLE_BATCH)
+			{
+				int batchSize = min(SAMPLE_BATCH, options.pilotSamples - drawn);
+				philoxUniformPoints(seed, PILOT_STREAM, (unsigned long long)cell * options.pilotSamples + drawn,
+									batchSize, cellMin, cellMax, batchR, batchI);
+				escapeBatch<Formula>(options, batchR, batchI, batchSize, maxIters, batchPoints);
+				for (int k = 0; k < batchSize; ++k)
+				{
+					Complex c(batchR[k], batchI[k]);
+					forEachOrbitSplat(options, batchPoints[k], channelIters, group, [&](const vector<int> &, int nPoints) {
+						score += viewportHits<Formula>(options, c, nPoints, minimum, maximum);
+					});
+				}
+			}
+			o_scores[cell] = score;
+		}
+	}
+};
+// Runs fn(t) for t in [0, nThreads) on separate threads and waits for all of them
+template <typename Fn>
+void runOnThreads(unsigned int nThreads, Fn fn)
+{
+	vector<thread> workers;
+	workers.reserve(nThreads);
+	for (unsigned int t = 0; t < nThreads; ++t)
+	{
+		workers.emplace_back(fn, t);
+	}
+	for (thread &worker : workers)
+	{
+		worker.join();
+	}
+}
+
+unsigned int resolveThreadCount(unsigned int nThreads)
+{
+	return nThreads == 0 ? max(1u, thread::hardware_concurrency()) : nThreads;
+}
+
+// Splits [0, total) into nThreads stripes whose boundaries fall on cache lines of
+//  HeatmapType elements, so no two threads write the same line
+void stripeBounds(size_t total, unsigned int nThreads, unsigned int t, size_t &o_begin, size_t &o_end)
+{
+	size_t lineElements = HEATMAP_ALIGNMENT / sizeof(HeatmapType);
+	size_t perBand = ((total + nThreads - 1) / nThreads + lineElements - 1) / lineElements * lineElements;
+	o_begin = min(total, t * perBand);
+	o_end = min(total, o_begin + perBand);
+}
+
+// Builds a contribution map of options.contributionCells^2 cells over the sampling
+//  domain for the viewport [minimum, maximum], running the pilot on nThreads threads
+ContributionMap buildContributionMap(const vector<int> &channelIters, const Complex &minimum, const Complex &maximum,
+									 const SamplingOptions &options, unsigned long long seed, unsigned int nThreads)
+{
+	ContributionMap map;
+	map.rows = map.cols = options.contributionCells;
+	samplingDomain(options, minimum, maximum, map.minimum, map.maximum);
+	size_t nCells = (size_t)map.rows * map.cols;
+	vector<double> scores(nCells, 0.0);
+	runOnThreads(nThreads, [&](unsigned int t) {
+		size_t begin, end;
+		stripeBounds(nCells, nThreads, t, begin, end);
+		dispatchFormula<PilotTask>(options, map, scores, begin, end, channelIters, minimum, maximum, options, seed);
+	});
+
+	double total = 0;
+	for (double score : scores)
+	{
+		total += score;
+		map.usefulCells += score > 0 ? 1 : 0;
+	}
+	// With no hits at all the pilot says nothing, and the map stays uniform
+	double floor = total > 0 ? min(1.0, max(0.0, options.contributionFloor)) : 1.0;
+	map.cdf.resize(nCells);
+	map.weight.resize(nCells);
+	double running = 0;
+	for (size_t cell = 0; cell < nCells; ++cell)
+	{
+		double probability = floor / nCells + (total > 0 ? (1.0 - floor) * scores[cell] / total : 0.0);
+		running += probability;
+		map.cdf[cell] = running;
+		// A cell of probability 0 is never drawn, so its weight is never used
+		map.weight[cell] = probability > 0 ? (HeatmapType)(1.0 / (probability * nCells)) : 0;
+	}
+	map.cdf.back() = 1.0;
+	return map;
+}
+
+// options with what a pass over channelIters needs precomputed and shared by all
+//  workers: the reference orbit in perturbation mode, and the contribution map of a
+//  uniform render that asks for one
+SamplingOptions prepareSampling(const SamplingOptions &options, const vector<int> &channelIters,
+								const Complex &minimum, const Complex &maximum, unsigned long long seed)
+{
+	SamplingOptions prepared = options;
+	int maxIters = *max_element(channelIters.begin(), channelIters.end());
+	if (options.precision == PRECISION_PERTURBATION &&
+		(!options.reference || options.reference->nIterations < maxIters))
+	{
+		prepared.reference = make_shared<PerturbationReference>(
+			buildPerturbationReference(options.centerR, options.centerI, maxIters));
+	}
+	if (options.contributionCells > 0 && options.sampler == SAMPLER_UNIFORM && !options.contributionMap)
+	{
+		prepared.contributionMap = make_shared<ContributionMap>(buildContributionMap(
+			channelIters, minimum, maximum, prepared, seed, resolveThreadCount(options.nThreads)));
+	}
+	return prepared;
+}
+
+// Adds elements [begin, end) of every worker's tile, times scale, into o_heatmap. All
+//  tiles share o_heatmap's shape, so this is a flat element-wise add regardless of layout.
+void ReduceHeatmapRange(Heatmap &o_heatmap, const vector<Heatmap> &tiles, HeatmapType scale, size_t begin,
+						size_t end)
+{
+	HeatmapType *out = o_heatmap.data();
+	for (const Heatmap &tile : tiles)
+	{
+		const HeatmapType *in = tile.data();
+		for (size_t i = begin; i < end; ++i)
+		{
+			out[i] += in[i] * scale;
+		}
+	}
+}
+
+//
+// Telemetry
+//
+// Live counters of a sampling job: one GenerateHeatmaps call, or every band, chunk or
+//  pass of a longer render when its caller passes one SamplerTelemetry to them all.
+//  Each worker keeps its SamplerStats to itself and republishes a copy into its own
+//  slot once per SAMPLE_UNIT, so the sampling loop never touches shared state; a
+//  reporter thread sums the slots and the passes before them every progressSeconds
+//  into a progress line with throughput and ETA, and rewrites the metrics file for
+//  scrapers such as node_exporter's textfile collector.
+//
+
+class SamplerTelemetry
+{
+  public:
+	// For a job of nSamples samples in all, alreadyDone of them drawn by an earlier run
+	//  it resumes, with at most nWorkers workers in a pass
+	SamplerTelemetry(const string &prefix, const vector<int> &channelIters, long long nSamples, unsigned int nWorkers,
+					 const SamplingOptions &options, long long alreadyDone = 0)
+		: _prefix(prefix), _channelIters(channelIters), _nSamples(nSamples), _nWorkers(nWorkers),
+		  _interval(options.progressSeconds), _metricsPath(options.metricsPath), _alreadyDone(alreadyDone),
+		  _passesDone(0), _metricsFailed(false), _stopping(false)
+	{
+		if (!enabled())
+		{
+			return;
+		}
+		_slots.reset(new Slot[nWorkers]);
+		_start = chrono::steady_clock::now();
+		_reporter = thread([this] { run(); });
+	}
+
+	~SamplerTelemetry()
+	{
+		stop();
+	}
+
+	SamplerTelemetry(const SamplerTelemetry &) = delete;
+	SamplerTelemetry &operator=(const SamplerTelemetry &) = delete;
+
+	bool enabled() const
+	{
+		return _interval > 0 || !_metricsPath.empty();
+	}
+
+	// Worker's running totals in the current pass after it has finished samplesDone of
+	//  its samples
+	void publish(unsigned int worker, const SamplerStats &stats, long long samplesDone)
+	{
+		if (!_slots)
+		{
+			return;
+		}
+		lock_guard<mutex> lock(_slots[worker].lock);
+		_slots[worker].stats = stats;
+		_slots[worker].samplesDone = samplesDone;
+	}
+
+	// Moves the finished pass into the job's totals, so the next pass's workers can
+	//  publish from zero again
+	void endPass()
+	{
+		if (!_slots)
+		{
+			return;
+		}
+		lock_guard<mutex> lock(_lock);
+		for (unsigned int t = 0; t < _nWorkers; ++t)
+		{
+			lock_guard<mutex> slotLock(_slots[t].lock);
+			_passes.add(_slots[t].stats);
+			_passesDone += _slots[t].samplesDone;
+			_slots[t].stats = SamplerStats();
+			_slots[t].samplesDone = 0;
+		}
+	}
+
+	// Stops the reporter after one last report
+	void stop()
+	{
+		if (!_reporter.joinable())
+		{
+			return;
+		}
+		{
+			lock_guard<mutex> lock(_lock);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		_reporter.join();
+	}
+
+  private:
+	struct Slot
+	{
+		mutex lock;
+		SamplerStats stats;
+		long long samplesDone = 0;
+	};
+
+	void run()
+	{
+		// Without progress lines the metrics file is still refreshed once a second
+		chrono::duration<double> interval(_interval > 0 ? _interval : 1.0);
+		unique_lock<mutex> lock(_lock);
+		while (!_wake.wait_for(lock, interval, [this] { return _stopping; }))
+		{
+			report(false);
+		}
+		report(true);
+	}
+
+	// Called with _lock held
+	void report(bool final)
+	{
+		SamplerStats total = _passes;
+		long long done = _alreadyDone + _passesDone;
+		for (unsigned int t = 0; t < _nWorkers; ++t)
+		{
+			lock_guard<mutex> lock(_slots[t].lock);
+			total.add(_slots[t].stats);
+			done += _slots[t].samplesDone;
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - _start).count();
+		double rate = (done - _alreadyDone) / max(seconds, 1e-9);
+		double eta = rate > 0 ? (_nSamples - done) / rate : 0;
+
+		if (_interval > 0)
+		{
+			printProgress(total, done, seconds, rate, eta, final);
+		}
+		if (!_metricsPath.empty())
+		{
+			writeMetrics(total, done, seconds, rate, eta);
+		}
+	}
+
+	void printProgress(const SamplerStats &total, long long done, double seconds, double rate, double eta,
+					   bool final) const
+	{
+		double samples = (double)max(1LL, total.samples);
+		double perSecond = 1.0 / max(seconds, 1e-9);
+		stringstream line;
+		line.setf(ios::fixed);
+		line.precision(1);
+		line << _prefix << 100.0 * done / max(1LL, _nSamples) << "% of " << _nSamples << " samples, "
+			 << rate / 1e6 << "M/s, " << (final ? "took " : "ETA ") << (final ? seconds : eta) << "s | escaped "
+			 << 100.0 * total.escaped / samples << "%, interior " << 100.0 * total.interior / samples
+			 << "%, iterations/sample " << total.iterations / samples;
+		for (size_t ch = 0; ch < _channelIters.size() && ch < (size_t)STATS_CHANNELS; ++ch)
+		{
+			line << " | cap " << _channelIters[ch] << ": " << total.channelSamples[ch] * perSecond / 1e6 << "M/s, "
+				 << (double)total.channelHits[ch] / max(1LL, total.channelSamples[ch]) << " hits each";
+		}
+		cout << line.str() << endl;
+	}
+
+	void writeMetrics(const SamplerStats &total, long long done, double seconds, double rate, double eta)
+	{
+		// Written aside and renamed over the old file so a scraper never sees half of it
+		string temporary = _metricsPath + ".tmp";
+		bool written;
+		{
+			ofstream out(temporary);
+			out << "# TYPE buddhabrot_samples_done_total counter\n"
+				<< "buddhabrot_samples_done_total " << done << "\n"
+				<< "# TYPE buddhabrot_samples_target gauge\n"
+				<< "buddhabrot_samples_target " << _nSamples << "\n"
+				<< "# TYPE buddhabrot_candidates_total counter\n"
+				<< "buddhabrot_candidates_total " << total.samples << "\n"
+				<< "# TYPE buddhabrot_escaped_total counter\n"
+				<< "buddhabrot_escaped_total " << total.escaped << "\n"
+				<< "# TYPE buddhabrot_interior_total counter\n"
+				<< "buddhabrot_interior_total " << total.interior << "\n"
+				<< "# TYPE buddhabrot_iterations_total counter\n"
+				<< "buddhabrot_iterations_total " << total.iterations << "\n"
+				<< "# TYPE buddhabrot_hits_total counter\n"
+				<< "buddhabrot_hits_total " << total.hits << "\n"
+				<< "# TYPE buddhabrot_channel_samples_total counter\n";
+			for (size_t ch = 0; ch < _channelIters.size() && ch < (size_t)STATS_CHANNELS; ++ch)
+			{
+				out << "buddhabrot_channel_samples_total{channel=\"" << ch << "\",cap=\"" << _channelIters[ch] << "\"} "
+					<< total.channelSamples[ch] << "\n";
+			}
+			out << "# TYPE buddhabrot_channel_hits_total counter\n";
+			for (size_t ch = 0; ch < _channelIters.size() && ch < (size_t)STATS_CHANNELS; ++ch)
+			{
+				out << "buddhabrot_channel_hits_total{channel=\"" << ch << "\",cap=\"" << _channelIters[ch] << "\"} "
+					<< total.channelHits[ch] << "\n";
+			}
+			out << "# TYPE buddhabrot_elapsed_seconds gauge\n"
+				<< "buddhabrot_elapsed_seconds " << seconds << "\n"
+				<< "# TYPE buddhabrot_samples_per_second gauge\n"
+				<< "buddhabrot_samples_per_second " << rate << "\n"
+				<< "# TYPE buddhabrot_eta_seconds gauge\n"
+				<< "buddhabrot_eta_seconds " << eta << "\n";
+			out.close();
+			written = (bool)out;
+		}
+		if (written && rename(temporary.c_str(), _metricsPath.c_str()) == 0)
+		{
+			_metricsFailed = false;
+			return;
+		}
+		remove(temporary.c_str());
+		// Once per failure, not on every refresh
+		if (!_metricsFailed)
+		{
+			cout << "Warning: failed writing metrics to " << _metricsPath << endl;
+		}
+		_metricsFailed = true;
+	}
+
+	string _prefix;
+	vector<int> _channelIters;
+	long long _nSamples;
+	unsigned int _nWorkers;
+	double _interval;
+	string _metricsPath;
+	long long _alreadyDone;
+
+	SamplerStats _passes; // Of the passes before the current one
+	long long _passesDone;
+	bool _metricsFailed;
+
+	unique_ptr<Slot[]> _slots;
+	chrono::steady_clock::time_point _start;
+	thread _reporter;
+	mutex _lock;
+	condition_variable _wake;
+	bool _stopping;
+};
+
+// Adds one channel per entry of channelIters to o_heatmap from samples firstSample ..
+//  firstSample + nSamples - 1 of options.seed. Workers (nThreads, 0 = one per hardware thread) claim SAMPLE_UNIT
+//  samples at a time and accumulate into private tiles shaped like o_heatmap (or, with
+//  options.sharedTile, into one tile they share), then the tiles are summed into it in
+//  contiguous stripes, one stripe per thread. The samples
+//  drawn never depend on the thread count, and uniform counts are whole numbers, so
+//  for a fixed seed the uniform sampler gives a bit-identical heatmap on any number of
+//  threads (with a contribution map the weighted sums are only equal up to rounding).
+//  Normalization is left to NormalizationLevels. o_stats, if given, receives
+//  the work counters of this call; options can also have them reported while it runs,
+//  each progress line starting with consoleMessagePrefix, by io_telemetry as one pass
+//  of a longer job if given. Since every sample is addressed by its index, splitting
+//  the samples over several calls gives the same uniform heatmap as one call.
+void GenerateHeatmaps(Heatmap &o_heatmap, const vector<int> &channelIters, const Complex &minimum,
+					  const Complex &maximum, long long firstSample, long long nSamples, string consoleMessagePrefix,
+					  const SamplingOptions &requested = SamplingOptions(), SamplerStats *o_stats = nullptr,
+					  SamplerTelemetry *io_telemetry = nullptr)
+{
+	unsigned long long seed = requested.seed;
+	if (seed == 0)
+	{
+		seed = chrono::high_resolution_clock::now().time_since_epoch().count();
+	}
+	SamplingOptions options = prepareSampling(requested, channelIters, minimum, maximum, seed);
+	unsigned int nThreads = resolveThreadCount(options.nThreads);
+
+	long long nUnits = (nSamples + SAMPLE_UNIT - 1) / SAMPLE_UNIT;
+	nThreads = (unsigned int)max(1LL, min<long long>(nThreads, nUnits));
+	bool shared = options.sharedTile && nThreads > 1 && SplatBins::canBin(o_heatmap);
+	vector<Heatmap> tiles;
+	tiles.reserve(nThreads);
+	for (unsigned int t = 0; t < (shared ? 1 : nThreads); ++t)
+	{
+		tiles.emplace_back(o_heatmap.width(), o_heatmap.height(), o_heatmap.channels(), o_heatmap.layout(),
+						   o_heatmap.interleaved());
+	}
+	unique_ptr<mutex[]> binLocks(shared ? new mutex[SplatBins::binCount(tiles[0])] : nullptr);
+
+	vector<SamplerStats> stats(nThreads);
+	unique_ptr<SamplerTelemetry> ownTelemetry;
+	if (!io_telemetry)
+	{
+		ownTelemetry.reset(new SamplerTelemetry(consoleMessagePrefix, channelIters, nSamples, nThreads, options));
+		io_telemetry = ownTelemetry.get();
+	}
+	atomic<long long> nextUnit(0);
+	runOnThreads(nThreads, [&](unsigned int t) {
+		SplatBins bins;
+		if (shared)
+		{
+			bins.share(binLocks.get(), SplatBins::sharedBinHits(nThreads));
+		}
+		Heatmap &tile = tiles[shared ? 0 : t];
+		long long done = 0;
+		for (long long unit = nextUnit++; unit < nUnits; unit = nextUnit++)
+		{
+			long long count = min(SAMPLE_UNIT, nSamples - unit * SAMPLE_UNIT);
+			SampleHeatmapTile(tile, channelIters, minimum, maximum, firstSample + unit * SAMPLE_UNIT, count, options,
+							  seed, stats[t], &bins);
+			done += count;
+			io_telemetry->publish(t, stats[t], done);
+		}
+	});
+	io_telemetry->endPass();
+	if (ownTelemetry)
+	{
+		ownTelemetry->stop();
+	}
+
+	SamplerStats total;
+	for (const SamplerStats &workerStats : stats)
+	{
+		total.add(workerStats);
+	}
+	if (o_stats)
+	{
+		*o_stats = total;
+	}
+	HeatmapType scale = samplerScale(options, total);
+
+	runOnThreads(nThreads, [&](unsigned int t) {
+		size_t begin, end;
+		stripeBounds(o_heatmap.size(), nThreads, t, begin, end);
+		ReduceHeatmapRange(o_heatmap, tiles, scale, begin, end);
+	});
+}
+
+// Single-channel form of GenerateHeatmaps
+void GenerateHeatmap(Heatmap &o_heatmap, const Complex &minimum, const Complex &maximum, int nIterations,
+					 long long nSamples, string consoleMessagePrefix, const SamplingOptions &options = SamplingOptions())
+{
+	GenerateHeatmaps(o_heatmap, vector<int>{nIterations}, minimum, maximum, 0, nSamples, consoleMessagePrefix,
+					 options);
+}
+
+// Renders image rows [rowBegin, rowBegin + o_band.height()) of an imageHeight-row
+//  image of [minimum, maximum] into o_band from samples firstSample .. firstSample +
+//  nSamples - 1. Samples are still drawn over the whole viewport (or options' domain),
+//  so with a fixed seed the uniform sampler's bands of one image add up to the full
+//  render while only a band's worth of heatmap is ever allocated. That holds with a
+//  contribution map too, which is piloted over the full viewport; a job of many bands
+//  or chunks should pass options already prepared by prepareSampling so it is built
+//  once. The Metropolis sampler targets the band itself, so its chains and scale
+//  differ per band and the bands only match the full render statistically. The
+//  workers share one tile, so a band costs twice its size rather than a copy per
+//  worker.
+void GenerateHeatmapBand(Heatmap &o_band, const vector<int> &channelIters, const Complex &minimum,
+						 const Complex &maximum, int imageHeight, int rowBegin, long long firstSample,
+						 long long nSamples, string consoleMessagePrefix, const SamplingOptions &options,
+						 SamplerTelemetry *io_telemetry = nullptr)
+{
+	SamplingOptions bandOptions = prepareSampling(options, channelIters, minimum, maximum, options.seed);
+	samplingDomain(options, minimum, maximum, bandOptions.domainMinimum, bandOptions.domainMaximum);
+	bandOptions.sharedTile = true;
+
+	// Rows follow the real axis
+	double rowSize = (maximum.r() - minimum.r()) / imageHeight;
+	Complex bandMin(minimum.r() + rowBegin * rowSize, minimum.i());
+	Complex bandMax(minimum.r() + (rowBegin + o_band.height()) * rowSize, maximum.i());
+	GenerateHeatmaps(o_band, channelIters, bandMin, bandMax, firstSample, nSamples, consoleMessagePrefix, bandOptions,
+					 nullptr, io_telemetry);
+}
+
+// GenerateHeatmaps for several viewports from one pass over the samples: o_frames[f]
+//  receives frame f of frames. Samples are drawn over the domain in options (by default
+//  the frames' bounds) with the uniform sampler, and each orbit is iterated once and
+//  splatted into every frame it crosses instead of once per frame. Workers keep one
+//  private tile per frame, so memory grows with the frame count; a sequence longer
+//  than fits is rendered in several calls with the same seed. Each frame is then the
+//  same image it would be rendered alone with that domain and seed (with a contribution
+//  map, one piloted over the frames' bounds). io_telemetry, if given, reports the call
+//  as one pass of a longer job.
+void GenerateHeatmapSequence(vector<Heatmap> &o_frames, const vector<int> &channelIters, const FrameViewports &frames,
+							 long long nSamples, string consoleMessagePrefix, const SamplingOptions &requested,
+							 SamplerTelemetry *io_telemetry = nullptr)
+{
+	unsigned long long seed = requested.seed;
+	if (seed == 0)
+	{
+		seed = chrono::high_resolution_clock::now().time_since_epoch().count();
+	}
+	SamplingOptions options = requested;
+	options.sampler = SAMPLER_UNIFORM;
+	samplingDomain(requested, frames.boundsMinimum, frames.boundsMaximum, options.domainMinimum,
+				   options.domainMaximum);
+	options = prepareSampling(options, channelIters, frames.boundsMinimum, frames.boundsMaximum, seed);
+	unsigned int nThreads = resolveThreadCount(options.nThreads);
+
+	long long nUnits = (nSamples + SAMPLE_UNIT - 1) / SAMPLE_UNIT;
+	nThreads = (unsigned int)max(1LL, min<long long>(nThreads, nUnits));
+	// tiles[f][t] is worker t's part of frame f, the shape ReduceHeatmapRange wants
+	vector<vector<Heatmap>> tiles(o_frames.size());
+	for (size_t f = 0; f < o_frames.size(); ++f)
+	{
+		tiles[f].reserve(nThreads);
+		for (unsigned int t = 0; t < nThreads; ++t)
+		{
+			tiles[f].emplace_back(o_frames[f].width(), o_frames[f].height(), o_frames[f].channels(),
+								  o_frames[f].layout(), o_frames[f].interleaved());
+		}
+	}
+
+	vector<SamplerStats> stats(nThreads);
+	unique_ptr<SamplerTelemetry> ownTelemetry;
+	if (!io_telemetry)
+	{
+		ownTelemetry.reset(new SamplerTelemetry(consoleMessagePrefix, channelIters, nSamples, nThreads, options));
+		io_telemetry = ownTelemetry.get();
+	}
+	atomic<long long> nextUnit(0);
+	runOnThreads(nThreads, [&](unsigned int t) {
+		vector<Heatmap *> workerTiles(o_frames.size());
+		for (size_t f = 0; f < o_frames.size(); ++f)
+		{
+			workerTiles[f] = &tiles[f][t];
+		}
+		long long done = 0;
+		for (long long unit = nextUnit++; unit < nUnits; unit = nextUnit++)
+		{
+			long long first = unit * SAMPLE_UNIT;
+			long long count = min(SAMPLE_UNIT, nSamples - first);
+			dispatchFormula<SequenceTileTask>(options, workerTiles, channelIters, frames, first, count, options,
+											  seed, stats[t]);
+			done += count;
+			io_telemetry->publish(t, stats[t], done);
+		}
+	});
+	io_telemetry->endPass();
+	if (ownTelemetry)
+	{
+		ownTelemetry->stop();
+	}
+
+	runOnThreads(nThreads, [&](unsigned int t) {
+		for (size_t f = 0; f < o_frames.size(); ++f)
+		{
+			size_t begin, end;
+			stripeBounds(o_frames[f].size(), nThreads, t, begin, end);
+			ReduceHeatmapRange(o_frames[f], tiles[f], 1, begin, end);
+		}
+	});
+}
+
+//
+// Progressive rendering
+//
+
+// Keeps sampling on background threads while the caller displays what has been drawn
+//  so far. Workers claim PROGRESSIVE_BATCH samples at a time, trace them into a private
+//  tile and add the tile into the shared running heatmap, so a snapshot is never more
+//  than one batch per worker behind. Batch k holds the seed's samples from
+//  k * PROGRESSIVE_BATCH on, whichever worker takes it.
+class ProgressiveRender
+{
+  public:
+	// nSamples = 0 keeps sampling until stop() is called
+	ProgressiveRender(int width, int height, const vector<int> &channelIters, const Complex &minimum,
+					  const Complex &maximum, long long nSamples, const SamplingOptions &options = SamplingOptions())
+		: _accumulated(width, height, (int)channelIters.size()), _channelIters(channelIters), _minimum(minimum),
+		  _maximum(maximum), _nSamples(nSamples), _options(options), _stop(false), _claimed(0),
+		  _merged(0), _activeWorkers(0), _generation(0)
+	{
+		_seed = options.seed != 0 ? options.seed : chrono::high_resolution_clock::now().time_since_epoch().count();
+		_options = prepareSampling(options, channelIters, minimum, maximum, _seed);
+	}
+
+	~ProgressiveRender()
+	{
+		stop();
+	}
+
+	ProgressiveRender(const ProgressiveRender &) = delete;
+	ProgressiveRender &operator=(const ProgressiveRender &) = delete;
+
+	void start()
+	{
+		unsigned int nThreads = resolveThreadCount(_options.nThreads);
+		_activeWorkers = nThreads;
+		for (unsigned int t = 0; t < nThreads; ++t)
+		{
+			_workers.emplace_back(&ProgressiveRender::work, this);
+		}
+	}
+
+	// Asks the workers to finish their current batch and waits for them
+	void stop()
+	{
+		_stop = true;
+		for (thread &worker : _workers)
+		{
+			worker.join();
+		}
+		_workers.clear();
+	}
+
+	// True once every worker has exited, either because nSamples were drawn or stop() was called
+	bool finished() const
+	{
+		return _activeWorkers == 0;
+	}
+
+	// Samples already folded into the running heatmap
+	long long samplesDone() const
+	{
+		return _merged;
+	}
+
+	// Copies the running heatmap into o_snapshot if it changed since the last call.
+	//  o_snapshot must have the render's shape.
+	bool snapshot(Heatmap &o_snapshot, long long &o_samples)
+	{
+		lock_guard<mutex> guard(_lock);
+		if (_generation == _lastSnapshot)
+		{
+			return false;
+		}
+		copy(_accumulated.data(), _accumulated.data() + _accumulated.size(), o_snapshot.data());
+		o_samples = _merged;
+		_lastSnapshot = _generation;
+		return true;
+	}
+
+  private:
+	void work()
+	{
+		Heatmap tile(_accumulated.width(), _accumulated.height(), _accumulated.channels());
+		SplatBins bins;
+		while (!_stop)
+		{
+			long long first = _claimed.fetch_add(PROGRESSIVE_BATCH);
+			if (_nSamples > 0 && first >= _nSamples)
+			{
+				break;
+			}
+			long long count = _nSamples > 0 ? min(PROGRESSIVE_BATCH, _nSamples - first) : PROGRESSIVE_BATCH;
+
+			tile.clear();
+			SamplerStats stats;
+			SampleHeatmapTile(tile, _channelIters, _minimum, _maximum, first, count, _options, _seed, stats, &bins);
+			HeatmapType scale = samplerScale(_options, stats);
+
+			lock_guard<mutex> guard(_lock);
+			HeatmapType *out = _accumulated.data();
+			const HeatmapType *in = tile.data();
+			for (size_t i = 0; i < tile.size(); ++i)
+			{
+				out[i] += in[i] * scale;
+			}
+			_merged += count;
+			++_generation;
+		}
+		--_activeWorkers;
+	}
+
+	Heatmap _accumulated; // Guarded by _lock
+	vector<int> _channelIters;
+	Complex _minimum, _maximum;
+	long long _nSamples;
+	SamplingOptions _options;
+	unsigned long long _seed;
+
+	mutex _lock;
+	atomic<bool> _stop;
+	atomic<long long> _claimed; // Next sample index to hand out
+	atomic<long long> _merged;
+	atomic<unsigned int> _activeWorkers;
+	unsigned long long _generation, _lastSnapshot = 0; // Guarded by _lock
+	vector<thread> _workers;
+};
+
+//
+// Normalization
+//
+
+// How accumulated counts are mapped to display brightness
+enum NormalizationMode
+{
+	NORMALIZE_SHARED_MAX,  // Every channel divided by the largest count of any channel
+	NORMALIZE_CHANNEL_MAX, // Each channel divided by its own largest count
+	NORMALIZE_PERCENTILE,  // Each channel divided by its own percentile value, brighter pixels clip
+};
+
+// Largest of count values spaced stride apart. The contiguous case keeps several
+//  independent running maxima so the compiler can keep them in vector registers.
+HeatmapType maxOfStrided(const HeatmapType *values, size_t count, size_t stride)
+{
+	const int LANES = 8;
+	HeatmapType lanes[LANES] = {0};
+	size_t i = 0;
+	if (stride == 1)
+	{
+		for (; i + LANES <= count; i += LANES)
+		{
+			for (int l = 0; l < LANES; ++l)
+			{
+				lanes[l] = values[i + l] > lanes[l] ? values[i + l] : lanes[l];
+			}
+		}
+	}
+	for (; i < count; ++i)
+	{
+		lanes[0] = values[i * stride] > lanes[0] ? values[i * stride] : lanes[0];
+	}
+	return *max_element(lanes, lanes + LANES);
+}
+
+// Largest count in each channel, found in one parallel pass over the flat buffer
+vector<HeatmapType> HeatmapChannelMax(const Heatmap &heatmap, unsigned int nThreads = 0)
+{
+	nThreads = resolveThreadCount(nThreads);
+	int channels = heatmap.channels();
+	vector<vector<HeatmapType>> stripeMax(nThreads, vector<HeatmapType>(channels, 0));
+	runOnThreads(nThreads, [&](unsigned int t) {
+		size_t begin, end;
+		stripeBounds(heatmap.pixelCount(), nThreads, t, begin, end);
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			const HeatmapType *first = heatmap.data() + ch * heatmap.channelStride() + begin * heatmap.pixelStride();
+			stripeMax[t][ch] = maxOfStrided(first, end - begin, heatmap.pixelStride());
+		}
+	});
+
+	vector<HeatmapType> channelMax(channels, 0);
+	for (const vector<HeatmapType> &stripe : stripeMax)
+	{
+		for (int ch = 0; ch < channels; ++ch)
+		{
+			channelMax[ch] = max(channelMax[ch], stripe[ch]);
+		}
+	}
+	return channelMax;
+}
+
+// Value below which the given percentage of a channel's pixels fall
+HeatmapType HeatmapPercentile(const Heatmap &heatmap, int channel, double percentile)
+{
+	vector<HeatmapType> values;
+	values.reserve((size_t)heatmap.width() * heatmap.height());
+	for (int row = 0; row < heatmap.height(); ++row)
+	{
+		for (int col = 0; col < heatmap.width(); ++col)
+		{
+			values.push_back(heatmap.at(row, col, channel));
+		}
+	}
+	if (values.empty())
+	{
+		return 0;
+	}
+	size_t rank = (size_t)(min(1.0, max(0.0, percentile / 100.0)) * (values.size() - 1));
+	nth_element(values.begin(), values.begin() + rank, values.end());
+	return values[rank];
+}
+
+// Per-channel count that maps to full brightness under the given mode
+vector<HeatmapType> NormalizationLevels(const Heatmap &heatmap, NormalizationMode mode, double percentile = 99.5,
+										unsigned int nThreads = 0)
+{
+	if (mode == NORMALIZE_PERCENTILE)
+	{
+		vector<HeatmapType> levels(heatmap.channels(), 0);
+		runOnThreads(heatmap.channels(), [&](unsigned int ch) {
+			levels[ch] = HeatmapPercentile(heatmap, ch, percentile);
+		});
+		return levels;
+	}
+
+	vector<HeatmapType> levels = HeatmapChannelMax(heatmap, nThreads);
+	if (mode == NORMALIZE_SHARED_MAX && !levels.empty())
+	{
+		HeatmapType shared = *max_element(levels.begin(), levels.end());
+		fill(levels.begin(), levels.end(), shared);
+	}
+	return levels;
+}
+
+float colorFromHeatmap(HeatmapType inputValue, HeatmapType maxHeatmapValue, float maxColor)
+{
+	if (maxHeatmapValue <= 0)
+	{
+		return 0;
+	}
+	double scale = (1.0f * (maxColor)) / (1.0f * maxHeatmapValue);
+	return min((double)maxColor, inputValue * scale);
+}
+
+//
+// Image output
+//
+// Writers take a float RGB image one row at a time, top row first, so a render can be
+//  written band by band without the whole image in memory. RAW and EXR keep the
+//  accumulated counts as they are. PNG needs the per-channel maxima before it can
+//  write its first byte, so its rows are spooled to a raw file beside the output, then
+//  tonemapped into the PNG when the writer is closed.
+//
+
+enum ImageFormat
+{
+	IMAGE_RAW, // Headerless little-endian float32 RGB, rows top to bottom
+	IMAGE_EXR, // OpenEXR, uncompressed FLOAT scanlines
+	IMAGE_PNG, // 8-bit RGB, each channel scaled by its own maximum
+};
+
+bool imageFormatFromPath(const string &path, ImageFormat &o_format)
+{
+	size_t dot = path.find_last_of('.');
+	string extension = dot == string::npos ? "" : path.substr(dot + 1);
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	if (extension == "raw")
+	{
+		o_format = IMAGE_RAW;
+	}
+	else if (extension == "exr")
+	{
+		o_format = IMAGE_EXR;
+	}
+	else if (extension == "png")
+	{
+		o_format = IMAGE_PNG;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+void writeLE32(ostream &out, uint32_t value)
+{
+	char bytes[4] = {(char)value, (char)(value >> 8), (char)(value >> 16), (char)(value >> 24)};
+	out.write(bytes, 4);
+}
+
+void writeLE64(ostream &out, uint64_t value)
+{
+	writeLE32(out, (uint32_t)value);
+	writeLE32(out, (uint32_t)(value >> 32));
+}
+
+void writeLEFloat(ostream &out, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	writeLE32(out, bits);
+}
+
+void writeBE32(ostream &out, uint32_t value)
+{
+	char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+	out.write(bytes, 4);
+}
+
+// CRC-32 as used by PNG chunks
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t length)
+{
+	static uint32_t table[256];
+	static bool tableReady = false;
+	if (!tableReady)
+	{
+		for (uint32_t n = 0; n < 256; ++n)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; ++k)
+			{
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[n] = c;
+		}
+		tableReady = true;
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < length; ++i)
+	{
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+void writePngChunk(ostream &out, const char type[4], const vector<unsigned char> &data)
+{
+	writeBE32(out, (uint32_t)data.size());
+	vector<unsigned char> crcInput(type, type + 4);
+	crcInput.insert(crcInput.end(), data.begin(), data.end());
+	out.write((const char *)crcInput.data(), crcInput.size());
+	writeBE32(out, crc32Update(0, crcInput.data(), crcInput.size()));
+}
+
+void appendBE32(vector<unsigned char> &o_data, uint32_t value)
+{
+	o_data.push_back((unsigned char)(value >> 24));
+	o_data.push_back((unsigned char)(value >> 16));
+	o_data.push_back((unsigned char)(value >> 8));
+	o_data.push_back((unsigned char)value);
+}
+
+// EXR header attribute: name, type name, byte size, value
+void writeExrAttribute(ostream &out, const string &name, const string &type, const string &value)
+{
+	out.write(name.c_str(), name.size() + 1);
+	out.write(type.c_str(), type.size() + 1);
+	writeLE32(out, (uint32_t)value.size());
+	out.write(value.data(), value.size());
+}
+
+string exrBytes(const vector<uint32_t> &words)
+{
+	ostringstream bytes;
+	for (uint32_t word : words)
+	{
+		writeLE32(bytes, word);
+	}
+	return bytes.str();
+}
+
+class ImageRowWriter
+{
+  public:
+	ImageRowWriter() : _format(IMAGE_RAW), _width(0), _height(0), _rowsWritten(0), _maxima(3, 0) {}
+
+	ImageRowWriter(const ImageRowWriter &) = delete;
+	ImageRowWriter &operator=(const ImageRowWriter &) = delete;
+
+	bool open(const string &path, ImageFormat format, int width, int height)
+	{
+		_path = path;
+		_format = format;
+		_width = width;
+		_height = height;
+		_rowsWritten = 0;
+		fill(_maxima.begin(), _maxima.end(), (HeatmapType)0);
+
+		_out.open(format == IMAGE_PNG ? spoolPath() : path, ios::binary | ios::trunc);
+		if (!_out)
+		{
+			return false;
+		}
+		if (format == IMAGE_EXR)
+		{
+			writeExrHeader();
+		}
+		return (bool)_out;
+	}
+
+	// Takes 3 * width floats, the pixels of the next row left to right
+	bool writeRow(const float *rgb)
+	{
+		for (int x = 0; x < _width; ++x)
+		{
+			for (int ch = 0; ch < 3; ++ch)
+			{
+				_maxima[ch] = max(_maxima[ch], (HeatmapType)rgb[x * 3 + ch]);
+			}
+		}
+
+		if (_format == IMAGE_EXR)
+		{
+			// Scanline block: y, byte count, then each channel's row in B, G, R order
+			writeLE32(_out, (uint32_t)_rowsWritten);
+			writeLE32(_out, (uint32_t)(_width * 3 * sizeof(float)));
+			for (int ch = 2; ch >= 0; --ch)
+			{
+				for (int x = 0; x < _width; ++x)
+				{
+					writeLEFloat(_out, rgb[x * 3 + ch]);
+				}
+			}
+		}
+		else
+		{
+			for (int i = 0; i < _width * 3; ++i)
+			{
+				writeLEFloat(_out, rgb[i]);
+			}
+		}
+		++_rowsWritten;
+		return (bool)_out;
+	}
+
+	// Finishes the file; for PNG this is where the spool is tonemapped and removed
+	bool close()
+	{
+		_out.close();
+		if (_out.fail() || _rowsWritten != _height)
+		{
+			return false;
+		}
+		if (_format != IMAGE_PNG)
+		{
+			return true;
+		}
+		bool written = writePngFromSpool();
+		remove(spoolPath().c_str());
+		return written;
+	}
+
+  private:
+	string spoolPath() const
+	{
+		return _path + ".spool";
+	}
+
+	void writeExrHeader()
+	{
+		writeLE32(_out, 20000630); // Magic number
+		writeLE32(_out, 2);		   // Version 2, single-part scanline file
+
+		ostringstream channels;
+		for (const char *name : {"B", "G", "R"}) // Channels are listed in alphabetical order
+		{
+			channels.write(name, 2);
+			writeLE32(channels, 2); // FLOAT
+			writeLE32(channels, 0); // pLinear and reserved bytes
+			writeLE32(channels, 1); // x sampling
+			writeLE32(channels, 1); // y sampling
+		}
+		channels.put(0);
+		writeExrAttribute(_out, "channels", "chlist", channels.str());
+		writeExrAttribute(_out, "compression", "compression", string(1, '\0'));
+		string window = exrBytes({0, 0, (uint32_t)(_width - 1), (uint32_t)(_height - 1)});
+		writeExrAttribute(_out, "dataWindow", "box2i", window);
+		writeExrAttribute(_out, "displayWindow", "box2i", window);
+		writeExrAttribute(_out, "lineOrder", "lineOrder", string(1, '\0'));
+		float one = 1.0f;
+		uint32_t oneBits;
+		memcpy(&oneBits, &one, sizeof(oneBits));
+		writeExrAttribute(_out, "pixelAspectRatio", "float", exrBytes({oneBits}));
+		writeExrAttribute(_out, "screenWindowCenter", "v2f", exrBytes({0, 0}));
+		writeExrAttribute(_out, "screenWindowWidth", "float", exrBytes({oneBits}));
+		_out.put(0);
+
+		// Uncompressed scanlines all have the same size, so the offset table is known up front
+		uint64_t blockBytes = 8 + (uint64_t)_width * 3 * sizeof(float);
+		uint64_t firstBlock = (uint64_t)_out.tellp() + (uint64_t)_height * 8;
+		for (int y = 0; y < _height; ++y)
+		{
+			writeLE64(_out, firstBlock + y * blockBytes);
+		}
+	}
+
+	// PNG without a zlib dependency: the image data is a zlib stream of stored
+	//  (uncompressed) deflate blocks, one IDAT chunk per row
+	bool writePngFromSpool()
+	{
+		ifstream spool(spoolPath(), ios::binary);
+		ofstream png(_path, ios::binary | ios::trunc);
+		if (!spool || !png)
+		{
+			return false;
+		}
+
+		const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		png.write((const char *)signature, sizeof(signature));
+		vector<unsigned char> header;
+		appendBE32(header, (uint32_t)_width);
+		appendBE32(header, (uint32_t)_height);
+		header.insert(header.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, deflate, no filter method, no interlace
+		writePngChunk(png, "IHDR", header);
+
+		const size_t MAX_STORED_BLOCK = 65535;
+		vector<float> rgb((size_t)_width * 3);
+		vector<unsigned char> scanline((size_t)_width * 3 + 1);
+		vector<unsigned char> idat;
+		uint32_t adlerA = 1, adlerB = 0;
+		for (int y = 0; y < _height; ++y)
+		{
+			spool.read((char *)rgb.data(), rgb.size() * sizeof(float));
+			if (!spool)
+			{
+				return false;
+			}
+			scanline[0] = 0; // Filter type None
+			for (size_t i = 0; i < rgb.size(); ++i)
+			{
+				scanline[i + 1] = (unsigned char)colorFromHeatmap(rgb[i], _maxima[i % 3], 255);
+			}
+			for (unsigned char byte : scanline)
+			{
+				adlerA = (adlerA + byte) % 65521;
+				adlerB = (adlerB + adlerA) % 65521;
+			}
+
+			idat.clear();
+			if (y == 0)
+			{
+				idat.insert(idat.end(), {0x78, 0x01}); // zlib header: deflate, 32K window, no dictionary
+			}
+			for (size_t offset = 0; offset < scanline.size(); offset += MAX_STORED_BLOCK)
+			{
+				size_t length = min(MAX_STORED_BLOCK, scanline.size() - offset);
+				bool last = y == _height - 1 && offset + length == scanline.size();
+				idat.push_back(last ? 1 : 0);
+				idat.push_back((unsigned char)length);
+				idat.push_back((unsigned char)(length >> 8));
+				idat.push_back((unsigned char)~length);
+				idat.push_back((unsigned char)(~length >> 8));
+				idat.insert(idat.end(), scanline.begin() + offset, scanline.begin() + offset + length);
+			}
+			if (y == _height - 1)
+			{
+				appendBE32(idat, (adlerB << 16) | adlerA);
+			}
+			writePngChunk(png, "IDAT", idat);
+		}
+		writePngChunk(png, "IEND", vector<unsigned char>());
+		return (bool)png;
+	}
+
+	string _path;
+	ImageFormat _format;
+	int _width, _height;
+	int _rowsWritten;
+	vector<HeatmapType> _maxima; // Largest value of each channel so far, for PNG tonemapping
+	ofstream _out;
+};
+
+// Row of a 3-channel heatmap as the window shows it: columns run right to left, so
+//  pixel x of the output is column width - 1 - x
+void heatmapRowRGB(const Heatmap &heatmap, int row, vector<float> &o_rgb)
+{
+	o_rgb.resize((size_t)heatmap.width() * 3);
+	for (int x = 0; x < heatmap.width(); ++x)
+	{
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			o_rgb[x * 3 + ch] = ch < heatmap.channels() ? heatmap.at(row, heatmap.width() - 1 - x, ch) : 0;
+		}
+	}
+}
+
+//
+// Checkpoints
+//
+// A checkpoint file is a fixed-size header followed by the raw accumulated counts of
+//  a linear, interleaved heatmap, starting on a page boundary. The whole file is mapped,
+//  and the header and counts are used in place, so resuming after preemption is one
+//  mmap(). On platforms without mmap the file is read in on open and written back on
+//  sync.
+//
+// Adding a chunk to the counts is journaled so a crash can neither lose nor double it:
+//  the band's new sums go to a journal beside the file first, then the header is
+//  marked as committing, then the counts are stored and synced, and only then does the
+//  header move past the chunk. A resume that finds the mark replays the journal.
+//
+
+const char CHECKPOINT_MAGIC[8] = {'B', 'U', 'D', 'D', 'H', 'A', 'C', 'K'};
+// 2: shard fields, 3: power, 4: precision, 5: fractal, orbits, 6: sources, 7: contribution map,
+//  8: chunks are sample ranges of seed rather than seeds of their own, 9: sampling domain
+const uint32_t CHECKPOINT_VERSION = 9;
+const size_t CHECKPOINT_DATA_OFFSET = 4096; // Counts start page-aligned
+const int CHECKPOINT_MAX_CHANNELS = 8;
+const int CHECKPOINT_MAX_SOURCES = 256; // Renders one merged checkpoint can hold
+const char CHECKPOINT_JOURNAL_MAGIC[8] = {'B', 'U', 'D', 'D', 'H', 'A', 'J', 'N'};
+
+// Fixed-width fields only, so the layout is the same for every build
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerBytes; // sizeof(CheckpointHeader) when written
+
+	int32_t width, height, channels;
+	int32_t sampler; // SamplerKind
+	int32_t channelIters[CHECKPOINT_MAX_CHANNELS];
+	double minimum[2], maximum[2]; // Viewport as (real, imaginary)
+
+	int64_t nSamples;	  // Samples per band of the finished render
+	int64_t chunkSamples; // Samples accumulated between two syncs
+	int32_t bandRows;
+	int32_t committing; // Nonzero from when the journal holds chunk nextChunk until it is stored
+
+	// Progress and RNG state: bands before nextBand are complete, and the current band
+	//  holds its first nextChunk chunks. Every band draws samples 0 .. nSamples - 1 of
+	//  seed, chunk k being samples k * chunkSamples on, so the RNG state is just seed and
+	//  the samples done; the counts match an uncheckpointed render of the same seed.
+	uint64_t seed;
+	int32_t nextBand;
+	int32_t reserved;
+	int64_t nextChunk;
+	int64_t samplesDone; // Across all bands, for reporting
+
+	// Which slice of a sharded render this is; 0 of 1 when unsharded or merged
+	int32_t shardIndex;
+	int32_t shardCount;
+
+	int32_t power;	   // SamplingOptions::power
+	int32_t precision; // PrecisionKind
+	double center[4];  // Perturbation: center as (real hi, real lo, imaginary hi, imaginary lo)
+
+	int32_t fractal; // FractalKind
+	int32_t orbits;	 // OrbitKind
+
+	// Region c is drawn from, resolved by samplingDomain; the viewport unless --domain
+	double domainMinimum[2], domainMaximum[2];
+
+	// SamplingOptions' contribution map, rebuilt from these and seed on every resume
+	int32_t contributionCells; // 0 = none
+	int32_t pilotSamples;
+	double contributionFloor;
+
+	// Seeds of the renders whose samples the counts hold: the checkpoint's own, or those
+	//  of every checkpoint merged into it. Two checkpoints sharing one repeat samples.
+	int32_t nSources;
+	int32_t reserved2;
+	uint64_t sources[CHECKPOINT_MAX_SOURCES];
+};
+static_assert(sizeof(CheckpointHeader) <= CHECKPOINT_DATA_OFFSET, "Checkpoint header must fit before the counts");
+
+// Leads a checkpoint's journal, followed by the counts of the rows being committed
+struct CheckpointJournal
+{
+	char magic[8];
+	uint64_t seed; // The checkpoint's, so a journal of another render is never replayed
+	int32_t band;
+	int32_t rowBegin;
+	int64_t chunk;
+	int64_t samples; // In the chunk
+	uint64_t bytes;	 // Of the counts that follow
+};
+
+class HeatmapCheckpoint
+{
+  public:
+	HeatmapCheckpoint() : _fd(-1), _mapped(nullptr), _bytes(0) {}
+	~HeatmapCheckpoint() { close(); }
+
+	HeatmapCheckpoint(const HeatmapCheckpoint &) = delete;
+	HeatmapCheckpoint &operator=(const HeatmapCheckpoint &) = delete;
+
+	// Whether anything exists at path, a checkpoint or not
+	static bool exists(const string &path)
+	{
+		struct stat info;
+		return stat(path.c_str(), &info) == 0 || errno != ENOENT;
+	}
+
+	// Creates path, which must not exist yet, sized for header's image with zeroed counts
+	bool create(const string &path, const CheckpointHeader &header)
+	{
+		close();
+		if (exists(path))
+		{
+			return false;
+		}
+		size_t bytes = CHECKPOINT_DATA_OFFSET + dataBytes(header);
+		if (!mapFile(path, bytes, true))
+		{
+			return false;
+		}
+		memset(_mapped, 0, bytes);
+		*headerPtr() = header;
+		memcpy(headerPtr()->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+		headerPtr()->version = CHECKPOINT_VERSION;
+		headerPtr()->headerBytes = sizeof(CheckpointHeader);
+		return sync();
+	}
+
+	// Maps an existing checkpoint; false if it is missing, of another version or truncated
+	bool open(const string &path)
+	{
+		close();
+		ifstream probe(path, ios::binary | ios::ate);
+		if (!probe || (size_t)probe.tellg() < CHECKPOINT_DATA_OFFSET)
+		{
+			return false;
+		}
+		size_t bytes = (size_t)probe.tellg();
+		probe.close();
+		if (!mapFile(path, bytes, false))
+		{
+			return false;
+		}
+		const CheckpointHeader &h = header();
+		if (memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || h.version != CHECKPOINT_VERSION ||
+			h.headerBytes != sizeof(CheckpointHeader) || CHECKPOINT_DATA_OFFSET + dataBytes(h) != bytes)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	bool isOpen() const { return _mapped != nullptr; }
+
+	CheckpointHeader &header() { return *headerPtr(); }
+
+	// The stored counts, rows [rowBegin, rowBegin + rows)
+	Heatmap rows(int rowBegin, int rowCount)
+	{
+		const CheckpointHeader &h = header();
+		HeatmapType *counts = (HeatmapType *)(_mapped + CHECKPOINT_DATA_OFFSET);
+		return Heatmap(counts + (size_t)rowBegin * h.width * h.channels, h.width, rowCount, h.channels);
+	}
+
+	// Makes everything written so far durable
+	bool sync()
+	{
+#ifdef BUDDHABROT_MMAP
+		return msync(_mapped, _bytes, MS_SYNC) == 0;
+#else
+		ofstream out(_path, ios::binary | ios::trunc);
+		out.write((const char *)_mapped, _bytes);
+		return (bool)out;
+#endif
+	}
+
+	// Makes the header durable; with a mapping, without writing back the counts
+	bool syncHeader()
+	{
+#ifdef BUDDHABROT_MMAP
+		return msync(_mapped, CHECKPOINT_DATA_OFFSET, MS_SYNC) == 0;
+#else
+		return sync();
+#endif
+	}
+
+	string journalPath() const { return _path + ".journal"; }
+
+	// Adds io_chunk, rows [rowBegin, rowBegin + io_chunk.height()) of the current band, to
+	//  the counts as chunk nextChunk of count samples and moves the header past it, by
+	//  way of the journal. io_chunk is left holding the sums. False if a write failed, in
+	//  which case the chunk is either not added or the header still says committing.
+	bool commitChunk(int rowBegin, Heatmap &io_chunk, long long count)
+	{
+		CheckpointHeader &h = header();
+		Heatmap stored = rows(rowBegin, io_chunk.height());
+		HeatmapType *sums = io_chunk.data();
+		const HeatmapType *in = stored.data();
+		for (size_t i = 0; i < io_chunk.size(); ++i)
+		{
+			sums[i] += in[i];
+		}
+		CheckpointJournal journal;
+		memcpy(journal.magic, CHECKPOINT_JOURNAL_MAGIC, sizeof(CHECKPOINT_JOURNAL_MAGIC));
+		journal.seed = h.seed;
+		journal.band = h.nextBand;
+		journal.rowBegin = rowBegin;
+		journal.chunk = h.nextChunk;
+		journal.samples = count;
+		journal.bytes = io_chunk.size() * sizeof(HeatmapType);
+		if (!writeJournal(journal, sums))
+		{
+			return false;
+		}
+		h.committing = 1;
+		if (!syncHeader())
+		{
+			return false;
+		}
+		return storeJournaled(journal, sums);
+	}
+
+	// Finishes the commit a crash interrupted, if the header says there was one, from its
+	//  journal. False if that journal is missing, unreadable or of another chunk.
+	bool finishCommit()
+	{
+		CheckpointHeader &h = header();
+		if (!h.committing)
+		{
+			return true;
+		}
+		ifstream in(journalPath(), ios::binary);
+		CheckpointJournal journal;
+		if (!in.read((char *)&journal, sizeof(journal)) ||
+			memcmp(journal.magic, CHECKPOINT_JOURNAL_MAGIC, sizeof(CHECKPOINT_JOURNAL_MAGIC)) != 0 ||
+			journal.seed != h.seed || journal.band != h.nextBand || journal.chunk != h.nextChunk ||
+			journal.rowBegin != h.nextBand * h.bandRows || journal.rowBegin >= h.height)
+		{
+			return false;
+		}
+		Heatmap sums(h.width, min((int)h.bandRows, h.height - journal.rowBegin), h.channels);
+		if (journal.bytes != sums.size() * sizeof(HeatmapType) || !in.read((char *)sums.data(), journal.bytes))
+		{
+			return false;
+		}
+		return storeJournaled(journal, sums.data());
+	}
+
+	// Deletes the journal once nothing is left to commit
+	void removeJournal()
+	{
+		remove(journalPath().c_str());
+	}
+
+	void close()
+	{
+		if (!_mapped)
+		{
+			return;
+		}
+#ifdef BUDDHABROT_MMAP
+		munmap(_mapped, _bytes);
+		::close(_fd);
+#else
+		sync();
+		_buffer.reset();
+#endif
+		_fd = -1;
+		_mapped = nullptr;
+		_bytes = 0;
+	}
+
+  private:
+	static size_t dataBytes(const CheckpointHeader &header)
+	{
+		return (size_t)header.width * header.height * header.channels * sizeof(HeatmapType);
+	}
+
+	CheckpointHeader *headerPtr() { return (CheckpointHeader *)_mapped; }
+
+	bool writeJournal(const CheckpointJournal &journal, const HeatmapType *sums)
+	{
+#ifdef BUDDHABROT_MMAP
+		int fd = ::open(journalPath().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			return false;
+		}
+		bool written = writeAll(fd, &journal, sizeof(journal)) && writeAll(fd, sums, journal.bytes) && fsync(fd) == 0;
+		return ::close(fd) == 0 && written;
+#else
+		ofstream out(journalPath(), ios::binary | ios::trunc);
+		out.write((const char *)&journal, sizeof(journal));
+		out.write((const char *)sums, journal.bytes);
+		out.close();
+		return (bool)out;
+#endif
+	}
+
+	// Second half of a commit: stores the journaled sums, syncs them, then moves the
+	//  header past their chunk. Copying sums is idempotent, so replaying it is safe.
+	bool storeJournaled(const CheckpointJournal &journal, const HeatmapType *sums)
+	{
+		CheckpointHeader &h = header();
+		Heatmap stored = rows(journal.rowBegin, (int)(journal.bytes / sizeof(HeatmapType) / h.width / h.channels));
+		copy(sums, sums + stored.size(), stored.data());
+		if (!sync())
+		{
+			return false;
+		}
+		h.samplesDone += journal.samples;
+		++h.nextChunk;
+		h.committing = 0;
+		return syncHeader();
+	}
+
+#ifdef BUDDHABROT_MMAP
+	static bool writeAll(int fd, const void *data, size_t bytes)
+	{
+		const char *next = (const char *)data;
+		while (bytes > 0)
+		{
+			ssize_t written = ::write(fd, next, bytes);
+			if (written < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (written <= 0)
+			{
+				return false;
+			}
+			next += written;
+			bytes -= (size_t)written;
+		}
+		return true;
+	}
+#endif
+
+	bool mapFile(const string &path, size_t bytes, bool create)
+	{
+		_path = path;
+		_bytes = bytes;
+#ifdef BUDDHABROT_MMAP
+		_fd = ::open(path.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0644);
+		if (_fd < 0 || (create && ftruncate(_fd, (off_t)bytes) != 0))
+		{
+			return failMap();
+		}
+		void *mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+		if (mapped == MAP_FAILED)
+		{
+			return failMap();
+		}
+		_mapped = (unsigned char *)mapped;
+#else
+		// Page-aligned like a mapping, so the counts meet HEATMAP_ALIGNMENT
+		_buffer.reset(new unsigned char[bytes + CHECKPOINT_DATA_OFFSET]);
+		void *aligned = _buffer.get();
+		size_t space = bytes + CHECKPOINT_DATA_OFFSET;
+		_mapped = (unsigned char *)align(CHECKPOINT_DATA_OFFSET, bytes, aligned, space);
+		if (!create)
+		{
+			ifstream in(path, ios::binary);
+			in.read((char *)_mapped, bytes);
+			if (!in)
+			{
+				_mapped = nullptr;
+				_buffer.reset();
+				return false;
+			}
+		}
+#endif
+		return true;
+	}
+
+#ifdef BUDDHABROT_MMAP
+	bool failMap()
+	{
+		if (_fd >= 0)
+		{
+			::close(_fd);
+		}
+		_fd = -1;
+		return false;
+	}
+#endif
+
+	string _path;
+	int _fd;
+	unsigned char *_mapped; // Header at offset 0, counts at CHECKPOINT_DATA_OFFSET
+	size_t _bytes;
+#ifndef BUDDHABROT_MMAP
+	unique_ptr<unsigned char[]> _buffer;
+#endif
+};
+
+// Seed number index of a family derived from seed, e.g. for shard i of a distributed
+//  render
+unsigned long long deriveSeed(unsigned long long seed, long long index)
+{
+	// splitmix64 finalizer, so neighbouring indices get unrelated seeds
+	unsigned long long z = seed + (unsigned long long)(index + 1) * 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	z = z ^ (z >> 31);
+	return z == 0 ? 1 : z;
+}
+
+//
+// Render configuration
+//
+// What to render, from the command line or a config file; the constants at the top
+//  of the file are only the defaults. Shared by the window, --headless and --merge.
+//
+
+struct RenderConfig
+{
+	int width = IMAGE_WIDTH, height = IMAGE_HEIGHT;
+	Complex minimum = Complex(-2.0, -2.0), maximum = Complex(2.0, 2.0);
+	vector<int> channelIters{RED_ITERS, GREEN_ITERS, BLUE_ITERS};
+	long long nSamples = SAMPLE_COUNT;
+	string outputPath;
+	size_t memoryBudget = (size_t)1 << 30; // Bytes of heatmap, across all worker tiles, per band
+	SamplingOptions options;
+
+	string checkpointPath;		 // Accumulate into this checkpoint, resuming it if it exists
+	long long checkpointSamples = 0; // Samples between syncs; 0 = a twentieth of nSamples
+
+	// Render only shard shardIndex of shardCount disjoint slices of nSamples
+	int shardIndex = 0, shardCount = 1;
+
+	// --center/--radius, which override the viewport once all flags are read
+	bool hasCenter = false;
+	DoubleDouble centerR, centerI;
+	double radius = 2.0;
+
+	// --sequence: nFrames frames along the path from the view to the end view
+	int nFrames = 30;
+	bool hasEndView = false;
+	Complex endMinimum, endMaximum;
+
+	RenderLoopOptions display; // Window only: --vsync, --continuous
+
+	RenderConfig()
+	{
+		options.progressSeconds = 5;
+	}
+};
+
+// Config files hold one setting per line, named like the flag without its dashes:
+//  "size 800x800" or "iters = 500,500,5000". Blank lines and lines starting with #
+//  are skipped, and --config may appear in a config file too, up to this depth.
+const int CONFIG_MAX_DEPTH = 4;
+
+// Base seed for sharded renders given no --seed. It must not come from the clock,
+//  since every node has to agree on it.
+const unsigned long long SHARD_DEFAULT_SEED = 0x42554444ull;
+
+void printRenderUsage()
+{
+	cout << "usage: buddhabrot [--gpu | --progressive] [--compact-display] [--continuous] [options]\n"
+			"       buddhabrot --headless [--output FILE.{png,exr,raw}] [--checkpoint FILE] [options]\n"
+			"       buddhabrot --sequence --output FILE.{png,exr,raw} --end-view MINR,MINI,MAXR,MAXI [options]\n"
+			"  --config FILE            read settings from FILE; later flags override them\n"
+			"  --size WxH               image size in pixels (default 200x200)\n"
+			"  --view MINR,MINI,MAXR,MAXI  viewport in the complex plane (default -2,-2,2,2)\n"
+			"  --iters R,G,B            per-channel iteration caps (default 200,200,800)\n"
+			"  --center R,I             center the view here; digits past double's are kept\n"
+			"  --radius X               half the view's height around --center (default 2)\n"
+			"  --domain MINR,MINI,MAXR,MAXI  region samples are drawn from (default: the view);\n"
+			"                           orbits from outside a zoomed view still cross it\n"
+			"  --precision double|float|perturbation\n"
+			"                           float doubles the vector width for wide views;\n"
+			"                           perturbation renders deep zooms, Mandelbrot power 2 only\n"
+			"  --fractal mandelbrot|burning-ship\n"
+			"                           z = z^D + c, or z = (|Re z| + i |Im z|)^D + c\n"
+			"  --power D                exponent D, " << MIN_POWER << " to " << MAX_POWER
+		 << " (default 2; above 2 the Multibrots)\n"
+			"  --orbits escaping|bounded\n"
+			"                           accumulate orbits that escape (the Buddhabrot) or that\n"
+			"                           stay bounded (the Anti-Buddhabrot, uniform sampler only)\n"
+			"  --samples N              number of samples (default " << SAMPLE_COUNT << ")\n"
+			"  --seed N                 fixed RNG seed (default: from the clock)\n"
+			"  --threads N              worker threads (default: one per hardware thread)\n"
+			"  --sampler uniform|metropolis\n"
+			"  --contribution-map N     uniform sampler: pilot an NxN grid of the sampling domain\n"
+			"                           and draw more samples where orbits reach the view\n"
+			"  --pilot-samples N        pilot samples per contribution map cell (default 16)\n"
+			"  --map-floor F            share of samples spread evenly over all cells (default 0.1)\n"
+			"  --memory-mb N            heatmap memory per band (default 1024)\n"
+			"  --progress SECONDS       seconds between progress lines, 0 for none (default 5)\n"
+			"  --metrics FILE           keep live counters in FILE in Prometheus text format\n"
+			"  --vsync N                window: vertical blanks per frame, 0 for none (default 1)\n"
+			"  --continuous             window: redraw every frame, even with nothing new to show\n"
+			"  --end-view MINR,MINI,MAXR,MAXI  sequence: last frame's viewport; frames zoom and pan\n"
+			"                           to it from --view at a steady pace\n"
+			"  --frames N               sequence: frames, written as FILE_0000.png ... (default 30)\n"
+			"  --checkpoint FILE        keep progress in FILE and resume from it if it exists\n"
+			"  --checkpoint-every N     samples between checkpoint syncs (default samples / 20)\n"
+			"  --shard I/N              render only slice I (0-based) of N of the samples; the\n"
+			"                           seed is derived from --seed and I, never the clock\n"
+			"       buddhabrot --merge [--output FILE.{png,exr,raw}] [--checkpoint FILE] PARTIAL...\n"
+			"  sums finished checkpoints of the same image, e.g. the shards of one render\n";
+}
+
+// Splits "a<sep>b<sep>..." into numbers; false unless exactly count parse cleanly
+template <typename T>
+bool parseList(const string &text, char separator, size_t count, vector<T> &o_values)
+{
+	o_values.clear();
+	stringstream stream(text);
+	string item;
+	while (getline(stream, item, separator))
+	{
+		stringstream itemStream(item);
+		T value;
+		if (!(itemStream >> value) || !itemStream.eof())
+		{
+			return false;
+		}
+		o_values.push_back(value);
+	}
+	return o_values.size() == count;
+}
+
+bool parseRenderArgs(const vector<string> &args, RenderConfig &o_config, int depth);
+bool resolveRenderView(RenderConfig &io_config);
+
+// Appends the settings of a config file to o_args as flag, value pairs
+bool readConfigFile(const string &path, vector<string> &o_args)
+{
+	ifstream in(path);
+	if (!in)
+	{
+		cout << "Failed opening config " << path << endl;
+		return false;
+	}
+	string line;
+	for (int lineNumber = 1; getline(in, line); ++lineNumber)
+	{
+		size_t begin = line.find_first_not_of(" \t\r");
+		if (begin == string::npos || line[begin] == '#')
+		{
+			continue;
+		}
+		size_t nameEnd = line.find_first_of(" \t=", begin);
+		size_t valueBegin = nameEnd == string::npos ? string::npos : line.find_first_not_of(" \t=", nameEnd);
+		size_t valueEnd = line.find_last_not_of(" \t\r");
+		if (valueBegin == string::npos)
+		{
+			cout << path << ":" << lineNumber << ": expected a name and a value" << endl;
+			return false;
+		}
+		o_args.push_back("--" + line.substr(begin, nameEnd - begin));
+		o_args.push_back(line.substr(valueBegin, valueEnd + 1 - valueBegin));
+	}
+	return true;
+}
+
+// Fills o_config from argv; prints what was wrong and returns false on bad input.
+//  Arguments it does not know are an error, except the mode flags main() handles.
+bool ParseRenderArgs(int argc, char **argv, RenderConfig &o_config)
+{
+	return parseRenderArgs(vector<string>(argv + 1, argv + argc), o_config, 0) && resolveRenderView(o_config);
+}
+
+// Applies --center/--radius to the viewport. Perturbation mode then keeps the center
+//  (the view's midpoint if none was given) in the options and turns the viewport, and
+//  a --domain, into offsets from it.
+bool resolveRenderView(RenderConfig &io_config)
+{
+	SamplingOptions &options = io_config.options;
+	if (options.precision == PRECISION_PERTURBATION && (options.power != 2 || options.fractal != FRACTAL_MANDELBROT))
+	{
+		cout << "--precision perturbation only supports --fractal mandelbrot at --power 2" << endl;
+		return false;
+	}
+	// Metropolis chains are drawn toward orbits that escape through the view
+	if (options.orbits == ORBITS_BOUNDED && options.sampler != SAMPLER_UNIFORM)
+	{
+		cout << "--orbits bounded needs --sampler uniform" << endl;
+		return false;
+	}
+
+	DoubleDouble centerR = io_config.centerR, centerI = io_config.centerI;
+	double halfR = io_config.radius, halfI = io_config.radius * io_config.width / io_config.height;
+	if (!io_config.hasCenter)
+	{
+		// Rows follow the real axis
+		centerR = (DoubleDouble(io_config.minimum.r()) + DoubleDouble(io_config.maximum.r())) * DoubleDouble(0.5);
+		centerI = (DoubleDouble(io_config.minimum.i()) + DoubleDouble(io_config.maximum.i())) * DoubleDouble(0.5);
+		halfR = (io_config.maximum.r() - io_config.minimum.r()) / 2;
+		halfI = (io_config.maximum.i() - io_config.minimum.i()) / 2;
+	}
+
+	if (options.precision == PRECISION_PERTURBATION)
+	{
+		options.centerR = centerR;
+		options.centerI = centerI;
+		io_config.minimum = Complex(-halfR, -halfI);
+		io_config.maximum = Complex(halfR, halfI);
+		if (hasSamplingDomain(options))
+		{
+			options.domainMinimum = Complex((DoubleDouble(options.domainMinimum.r()) - centerR).value(),
+											(DoubleDouble(options.domainMinimum.i()) - centerI).value());
+			options.domainMaximum = Complex((DoubleDouble(options.domainMaximum.r()) - centerR).value(),
+											(DoubleDouble(options.domainMaximum.i()) - centerI).value());
+		}
+	}
+	else if (io_config.hasCenter)
+	{
+		io_config.minimum = Complex(centerR.value() - halfR, centerI.value() - halfI);
+		io_config.maximum = Complex(centerR.value() + halfR, centerI.value() + halfI);
+	}
+	return true;
+}
+
+bool parseRenderArgs(const vector<string> &args, RenderConfig &o_config, int depth)
+{
+	for (size_t i = 0; i < args.size(); ++i)
+	{
+		const string &arg = args[i];
+		if (arg == "--headless" || arg == "--sequence" || arg == "--gpu" || arg == "--progressive" ||
+			arg == "--compact-display" || arg == "--continuous")
+		{
+			continue;
+		}
+		if (i + 1 >= args.size())
+		{
+			cout << "Missing value for " << arg << endl;
+			return false;
+		}
+		string value = args[++i];
+		bool ok = true;
+		if (arg == "--config")
+		{
+			vector<string> fileArgs;
+			if (depth >= CONFIG_MAX_DEPTH)
+			{
+				cout << "Config files nested too deeply at " << value << endl;
+				return false;
+			}
+			if (!readConfigFile(value, fileArgs) || !parseRenderArgs(fileArgs, o_config, depth + 1))
+			{
+				return false;
+			}
+		}
+		else if (arg == "--output")
+		{
+			o_config.outputPath = value;
+		}
+		else if (arg == "--size")
+		{
+			vector<int> size;
+			ok = parseList(value, 'x', 2, size) && size[0] > 0 && size[1] > 0;
+			if (ok)
+			{
+				o_config.width = size[0];
+				o_config.height = size[1];
+			}
+		}
+		else if (arg == "--view")
+		{
+			vector<double> view;
+			ok = parseList(value, ',', 4, view) && view[0] < view[2] && view[1] < view[3];
+			if (ok)
+			{
+				o_config.minimum = Complex(view[0], view[1]);
+				o_config.maximum = Complex(view[2], view[3]);
+			}
+		}
+		else if (arg == "--domain")
+		{
+			vector<double> domain;
+			ok = parseList(value, ',', 4, domain) && domain[0] < domain[2] && domain[1] < domain[3];
+			if (ok)
+			{
+				o_config.options.domainMinimum = Complex(domain[0], domain[1]);
+				o_config.options.domainMaximum = Complex(domain[2], domain[3]);
+			}
+		}
+		else if (arg == "--end-view")
+		{
+			vector<double> view;
+			ok = parseList(value, ',', 4, view) && view[0] < view[2] && view[1] < view[3];
+			if (ok)
+			{
+				o_config.endMinimum = Complex(view[0], view[1]);
+				o_config.endMaximum = Complex(view[2], view[3]);
+				o_config.hasEndView = true;
+			}
+		}
+		else if (arg == "--frames")
+		{
+			vector<int> frames;
+			ok = parseList(value, ',', 1, frames) && frames[0] > 0;
+			if (ok)
+			{
+				o_config.nFrames = frames[0];
+			}
+		}
+		else if (arg == "--iters")
+		{
+			ok = parseList(value, ',', 3, o_config.channelIters) &&
+				 *min_element(o_config.channelIters.begin(), o_config.channelIters.end()) > 0;
+		}
+		else if (arg == "--center")
+		{
+			size_t comma = value.find(',');
+			ok = comma != string::npos && parseDoubleDouble(value.substr(0, comma), o_config.centerR) &&
+				 parseDoubleDouble(value.substr(comma + 1), o_config.centerI);
+			o_config.hasCenter = true;
+		}
+		else if (arg == "--radius")
+		{
+			vector<double> radius;
+			ok = parseList(value, ',', 1, radius) && radius[0] > 0;
+			if (ok)
+			{
+				o_config.radius = radius[0];
+			}
+		}
+		else if (arg == "--precision")
+		{
+			ok = value == "double" || value == "float" || value == "perturbation";
+			o_config.options.precision = value == "float"			 ? PRECISION_FLOAT
+										 : value == "perturbation" ? PRECISION_PERTURBATION
+																   : PRECISION_DOUBLE;
+		}
+		else if (arg == "--vsync")
+		{
+			vector<int> interval;
+			ok = parseList(value, ',', 1, interval) && interval[0] >= 0;
+			if (ok)
+			{
+				o_config.display.swapInterval = interval[0];
+			}
+		}
+		else if (arg == "--power")
+		{
+			vector<int> power;
+			ok = parseList(value, ',', 1, power) && power[0] >= MIN_POWER && power[0] <= MAX_POWER;
+			if (ok)
+			{
+				o_config.options.power = power[0];
+			}
+		}
+		else if (arg == "--samples")
+		{
+			vector<long long> samples;
+			ok = parseList(value, ',', 1, samples) && samples[0] > 0;
+			if (ok)
+			{
+				o_config.nSamples = samples[0];
+			}
+		}
+		else if (arg == "--seed")
+		{
+			vector<unsigned long long> seed;
+			ok = parseList(value, ',', 1, seed);
+			if (ok)
+			{
+				o_config.options.seed = seed[0];
+			}
+		}
+		else if (arg == "--threads")
+		{
+			vector<unsigned int> threads;
+			ok = parseList(value, ',', 1, threads);
+			if (ok)
+			{
+				o_config.options.nThreads = threads[0];
+			}
+		}
+		else if (arg == "--fractal")
+		{
+			ok = value == "mandelbrot" || value == "burning-ship";
+			o_config.options.fractal = value == "burning-ship" ? FRACTAL_BURNING_SHIP : FRACTAL_MANDELBROT;
+		}
+		else if (arg == "--orbits")
+		{
+			ok = value == "escaping" || value == "bounded";
+			o_config.options.orbits = value == "bounded" ? ORBITS_BOUNDED : ORBITS_ESCAPING;
+		}
+		else if (arg == "--sampler")
+		{
+			ok = value == "uniform" || value == "metropolis";
+			o_config.options.sampler = value == "metropolis" ? SAMPLER_METROPOLIS : SAMPLER_UNIFORM;
+		}
+		else if (arg == "--contribution-map")
+		{
+			vector<int> cells;
+			ok = parseList(value, ',', 1, cells) && cells[0] >= 0 && cells[0] <= MAX_CONTRIBUTION_CELLS;
+			if (ok)
+			{
+				o_config.options.contributionCells = cells[0];
+			}
+		}
+		else if (arg == "--pilot-samples")
+		{
+			vector<int> samples;
+			ok = parseList(value, ',', 1, samples) && samples[0] > 0;
+			if (ok)
+			{
+				o_config.options.pilotSamples = samples[0];
+			}
+		}
+		else if (arg == "--map-floor")
+		{
+			vector<double> share;
+			ok = parseList(value, ',', 1, share) && share[0] > 0 && share[0] <= 1;
+			if (ok)
+			{
+				o_config.options.contributionFloor = share[0];
+			}
+		}
+		else if (arg == "--progress")
+		{
+			vector<double> seconds;
+			ok = parseList(value, ',', 1, seconds) && seconds[0] >= 0;
+			if (ok)
+			{
+				o_config.options.progressSeconds = seconds[0];
+			}
+		}
+		else if (arg == "--metrics")
+		{
+			o_config.options.metricsPath = value;
+		}
+		else if (arg == "--memory-mb")
+		{
+			vector<size_t> megabytes;
+			ok = parseList(value, ',', 1, megabytes) && megabytes[0] > 0;
+			if (ok)
+			{
+				o_config.memoryBudget = megabytes[0] << 20;
+			}
+		}
+		else if (arg == "--checkpoint")
+		{
+			o_config.checkpointPath = value;
+		}
+		else if (arg == "--shard")
+		{
+			vector<int> shard;
+			ok = parseList(value, '/', 2, shard) && shard[1] > 0 && shard[0] >= 0 && shard[0] < shard[1];
+			if (ok)
+			{
+				o_config.shardIndex = shard[0];
+				o_config.shardCount = shard[1];
+			}
+		}
+		else if (arg == "--checkpoint-every")
+		{
+			vector<long long> samples;
+			ok = parseList(value, ',', 1, samples) && samples[0] > 0;
+			if (ok)
+			{
+				o_config.checkpointSamples = samples[0];
+			}
+		}
+		else
+		{
+			cout << "Unknown argument " << arg << endl;
+			return false;
+		}
+		if (!ok)
+		{
+			cout << "Bad value for " << arg << ": " << value << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+//
+// Headless rendering
+//
+// Renders straight to a file with no window or GL context, for batch nodes. The
+//  image is produced in bands of rows sized to fit memoryBudget; each band re-draws
+//  the same seeded samples and keeps only the orbit points landing in it, then goes
+//  straight to the writer. Peak memory follows the band size, not the image size or
+//  the sample budget, at the cost of one sampling pass per band.
+//
+
+// Rows per band so that the band, the tile its workers share and their SplatBins fit
+//  the budget
+int headlessBandRows(const RenderConfig &config)
+{
+	unsigned int nThreads = resolveThreadCount(config.options.nThreads);
+	size_t rowElements = (size_t)config.width * config.channelIters.size();
+	double binShare = (double)nThreads * SplatBins::sharedBinHits(nThreads) * sizeof(SplatHit) / SPLAT_BIN_BYTES;
+	size_t rows = (size_t)(config.memoryBudget / (rowElements * sizeof(HeatmapType) * (2 + binShare)));
+	// Past SplatHit's offsets the workers fall back to a tile each
+	rows = min<size_t>(rows, UINT32_MAX / rowElements);
+	return (int)max<size_t>(1, min<size_t>(rows, config.height));
+}
+
+// Says so when every band of a render is about to re-trace all of its samples
+void warnBandPasses(int nBands, long long nSamples)
+{
+	if (nBands > 1)
+	{
+		cout << "Warning: " << nBands << " bands each trace all " << nSamples
+			 << " samples; a larger --memory-mb renders in fewer passes" << endl;
+	}
+}
+
+// Set by SIGINT/SIGTERM during a checkpointed render; the current chunk still finishes
+volatile sig_atomic_t headlessInterrupted = 0;
+
+void onHeadlessSignal(int)
+{
+	headlessInterrupted = 1;
+}
+
+bool writeHeatmapRows(ImageRowWriter &writer, const Heatmap &heatmap)
+{
+	vector<float> rgb;
+	for (int row = 0; row < heatmap.height(); ++row)
+	{
+		heatmapRowRGB(heatmap, row, rgb);
+		if (!writer.writeRow(rgb.data()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Header of a fresh checkpoint for config's render
+CheckpointHeader checkpointHeaderFor(const RenderConfig &config, int bandRows)
+{
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	header.width = config.width;
+	header.height = config.height;
+	header.channels = (int32_t)config.channelIters.size();
+	header.sampler = config.options.sampler;
+	header.power = config.options.power;
+	header.fractal = config.options.fractal;
+	header.orbits = config.options.orbits;
+	// Only the uniform sampler draws from a map
+	if (config.options.sampler == SAMPLER_UNIFORM && config.options.contributionCells > 0)
+	{
+		header.contributionCells = config.options.contributionCells;
+		header.pilotSamples = config.options.pilotSamples;
+		header.contributionFloor = config.options.contributionFloor;
+	}
+	header.precision = config.options.precision;
+	header.center[0] = config.options.centerR.hi();
+	header.center[1] = config.options.centerR.lo();
+	header.center[2] = config.options.centerI.hi();
+	header.center[3] = config.options.centerI.lo();
+	copy(config.channelIters.begin(), config.channelIters.end(), header.channelIters);
+	header.minimum[0] = config.minimum.r();
+	header.minimum[1] = config.minimum.i();
+	header.maximum[0] = config.maximum.r();
+	header.maximum[1] = config.maximum.i();
+	Complex domainMin, domainMax;
+	samplingDomain(config.options, config.minimum, config.maximum, domainMin, domainMax);
+	header.domainMinimum[0] = domainMin.r();
+	header.domainMinimum[1] = domainMin.i();
+	header.domainMaximum[0] = domainMax.r();
+	header.domainMaximum[1] = domainMax.i();
+	header.nSamples = config.nSamples;
+	header.chunkSamples = config.checkpointSamples > 0 ? config.checkpointSamples : max(1LL, (config.nSamples + 19) / 20);
+	header.bandRows = bandRows;
+	header.seed = config.options.seed;
+	header.nSources = 1;
+	header.sources[0] = header.seed;
+	header.shardIndex = config.shardIndex;
+	header.shardCount = config.shardCount;
+	return header;
+}
+
+// Whether two checkpoints hold counts of the same image, so they can be summed
+bool checkpointSameImage(const CheckpointHeader &a, const CheckpointHeader &b)
+{
+	return a.width == b.width && a.height == b.height && a.channels == b.channels && a.sampler == b.sampler &&
+		   a.power == b.power && a.fractal == b.fractal && a.orbits == b.orbits && a.precision == b.precision &&
+		   equal(a.center, a.center + 4, b.center) &&
+		   equal(a.channelIters, a.channelIters + a.channels, b.channelIters) && a.minimum[0] == b.minimum[0] &&
+		   a.minimum[1] == b.minimum[1] && a.maximum[0] == b.maximum[0] && a.maximum[1] == b.maximum[1] &&
+		   equal(a.domainMinimum, a.domainMinimum + 2, b.domainMinimum) &&
+		   equal(a.domainMaximum, a.domainMaximum + 2, b.domainMaximum);
+}
+
+bool checkpointFinished(const CheckpointHeader &header)
+{
+	return header.nextBand * header.bandRows >= header.height;
+}
+
+// Whether a stored checkpoint is of the image config asks for, drawn the same way.
+//  Seed, band size and chunk size are taken from the checkpoint, so they may differ.
+bool checkpointMatches(const CheckpointHeader &stored, const CheckpointHeader &wanted)
+{
+	return checkpointSameImage(stored, wanted) && stored.nSamples == wanted.nSamples &&
+		   stored.shardIndex == wanted.shardIndex && stored.shardCount == wanted.shardCount &&
+		   stored.contributionCells == wanted.contributionCells && stored.pilotSamples == wanted.pilotSamples &&
+		   stored.contributionFloor == wanted.contributionFloor;
+}
+
+// Accumulates config's render into the checkpoint a chunk at a time, starting where
+//  the checkpoint left off. Each chunk is traced into a private band and only then
+//  committed to the mapped counts through the journal. Returns false if a signal or a
+//  failed write stopped it; either way the checkpoint can be resumed.
+bool RenderToCheckpoint(const RenderConfig &config, HeatmapCheckpoint &checkpoint)
+{
+	CheckpointHeader &header = checkpoint.header();
+	int nBands = (header.height + header.bandRows - 1) / header.bandRows;
+	signal(SIGINT, onHeadlessSignal);
+	signal(SIGTERM, onHeadlessSignal);
+
+	// One contribution map for every band and chunk, from the checkpoint's seed so a
+	//  resume draws from the same one
+	SamplingOptions chunkOptions =
+		prepareSampling(config.options, config.channelIters, config.minimum, config.maximum, header.seed);
+	warnBandPasses(nBands - header.nextBand, header.nSamples);
+	// Progress covers the whole render, including what an earlier run finished
+	SamplerTelemetry telemetry("Total: ", config.channelIters, header.nSamples * nBands,
+							   resolveThreadCount(config.options.nThreads), config.options, header.samplesDone);
+	while (header.nextBand < nBands)
+	{
+		int rowBegin = header.nextBand * header.bandRows;
+		int rowCount = min((int)header.bandRows, header.height - rowBegin);
+		Heatmap chunk(header.width, rowCount, header.channels);
+		stringstream prefix;
+		prefix << "Band " << header.nextBand + 1 << "/" << nBands << ": ";
+
+		while (header.nextChunk * header.chunkSamples < header.nSamples)
+		{
+			if (headlessInterrupted)
+			{
+				checkpoint.sync();
+				return false;
+			}
+			long long first = header.nextChunk * header.chunkSamples;
+			long long count = min<long long>(header.chunkSamples, header.nSamples - first);
+			cout << prefix.str() << "rows " << rowBegin << "-" << rowBegin + rowCount - 1 << ", samples " << first
+				 << "-" << first + count - 1 << endl;
+
+			chunk.clear();
+			GenerateHeatmapBand(chunk, config.channelIters, config.minimum, config.maximum, header.height, rowBegin,
+								first, count, prefix.str(), chunkOptions, &telemetry);
+
+			if (!checkpoint.commitChunk(rowBegin, chunk, count))
+			{
+				cout << "Failed to save the chunk to " << checkpoint.journalPath() << " and " << config.checkpointPath
+					 << endl;
+				return false;
+			}
+		}
+		++header.nextBand;
+		header.nextChunk = 0;
+		checkpoint.syncHeader();
+	}
+	telemetry.stop();
+	checkpoint.removeJournal();
+	return true;
+}
+
+int RunHeadless(int argc, char **argv)
+{
+	RenderConfig config;
+	ImageFormat format = IMAGE_RAW;
+	if (!ParseRenderArgs(argc, argv, config))
+	{
+		printRenderUsage();
+		return 1;
+	}
+	if (config.outputPath.empty() && config.checkpointPath.empty())
+	{
+		cout << "--output or --checkpoint is required" << endl;
+		return 1;
+	}
+	if (config.hasEndView)
+	{
+		cout << "--end-view needs --sequence" << endl;
+		return 1;
+	}
+	if (!config.checkpointPath.empty() && config.channelIters.size() > (size_t)CHECKPOINT_MAX_CHANNELS)
+	{
+		cout << "Checkpoints hold at most " << CHECKPOINT_MAX_CHANNELS << " channels" << endl;
+		return 1;
+	}
+	if (!config.outputPath.empty() && !imageFormatFromPath(config.outputPath, format))
+	{
+		cout << "Output must end in .png, .exr or .raw: " << config.outputPath << endl;
+		return 1;
+	}
+
+	if (config.shardCount > 1)
+	{
+		// Shards split the samples like threads do, remainder to the first few, and each
+		//  draws from its own seed so no two shards repeat a sample
+		unsigned long long baseSeed = config.options.seed != 0 ? config.options.seed : SHARD_DEFAULT_SEED;
+		config.nSamples = config.nSamples / config.shardCount +
+						  (config.shardIndex < config.nSamples % config.shardCount ? 1 : 0);
+		config.options.seed = deriveSeed(baseSeed, config.shardIndex);
+		cout << "Shard " << config.shardIndex << "/" << config.shardCount << ": " << config.nSamples << " samples"
+			 << endl;
+	}
+
+	// Every band must draw the same samples
+	if (config.options.seed == 0)
+	{
+		config.options.seed = chrono::high_resolution_clock::now().time_since_epoch().count();
+	}
+
+	int bandRows = headlessBandRows(config);
+	ImageRowWriter writer;
+	if (!config.checkpointPath.empty())
+	{
+		HeatmapCheckpoint checkpoint;
+		CheckpointHeader wanted = checkpointHeaderFor(config, bandRows);
+		if (checkpoint.open(config.checkpointPath))
+		{
+			if (!checkpointMatches(checkpoint.header(), wanted))
+			{
+				cout << config.checkpointPath << " holds a different render; remove it or change --checkpoint" << endl;
+				return 1;
+			}
+			if (checkpoint.header().committing && !checkpoint.finishCommit())
+			{
+				cout << config.checkpointPath << " was interrupted while saving a chunk, and "
+					 << checkpoint.journalPath() << " does not hold it; the counts cannot be trusted" << endl;
+				return 1;
+			}
+			cout << "Resuming " << config.checkpointPath << " at " << checkpoint.header().samplesDone
+				 << " samples, seed " << checkpoint.header().seed << endl;
+		}
+		else if (HeatmapCheckpoint::exists(config.checkpointPath))
+		{
+			cout << config.checkpointPath << " is not a checkpoint of this version, or is corrupt; it was left as "
+				 << "it is, remove it or change --checkpoint" << endl;
+			return 1;
+		}
+		else if (!checkpoint.create(config.checkpointPath, wanted))
+		{
+			cout << "Failed to create " << config.checkpointPath << endl;
+			return 1;
+		}
+
+		if (!RenderToCheckpoint(config, checkpoint))
+		{
+			cout << "Interrupted at " << checkpoint.header().samplesDone << " samples; run the same command to resume"
+				 << endl;
+			return 2;
+		}
+		if (config.outputPath.empty())
+		{
+			cout << "Finished " << config.checkpointPath << endl;
+			return 0;
+		}
+		if (!writer.open(config.outputPath, format, config.width, config.height) ||
+			!writeHeatmapRows(writer, checkpoint.rows(0, config.height)) || !writer.close())
+		{
+			cout << "Failed writing " << config.outputPath << endl;
+			return 1;
+		}
+		cout << "Wrote " << config.outputPath << endl;
+		return 0;
+	}
+
+	if (!writer.open(config.outputPath, format, config.width, config.height))
+	{
+		cout << "Failed to open " << config.outputPath << endl;
+		return 1;
+	}
+
+	int nBands = (config.height + bandRows - 1) / bandRows;
+	cout << "Rendering " << config.width << "x" << config.height << " in " << nBands << " band(s) of " << bandRows
+		 << " rows, seed " << config.options.seed << endl;
+	warnBandPasses(nBands, config.nSamples);
+
+	SamplerTelemetry telemetry("Total: ", config.channelIters, config.nSamples * nBands,
+							   resolveThreadCount(config.options.nThreads), config.options);
+	SamplingOptions options =
+		prepareSampling(config.options, config.channelIters, config.minimum, config.maximum, config.options.seed);
+	for (int band = 0; band < nBands; ++band)
+	{
+		int rowBegin = band * bandRows;
+		Heatmap heatmap(config.width, min(bandRows, config.height - rowBegin), (int)config.channelIters.size());
+		stringstream prefix;
+		prefix << "Band " << band + 1 << "/" << nBands << ": ";
+		cout << prefix.str() << "rows " << rowBegin << "-" << rowBegin + heatmap.height() - 1 << endl;
+		GenerateHeatmapBand(heatmap, config.channelIters, config.minimum, config.maximum, config.height, rowBegin, 0,
+							config.nSamples, prefix.str(), options, &telemetry);
+		if (!writeHeatmapRows(writer, heatmap))
+		{
+			cout << "Failed writing " << config.outputPath << endl;
+			return 1;
+		}
+	}
+	telemetry.stop();
+
+	if (!writer.close())
+	{
+		cout << "Failed to finish " << config.outputPath << endl;
+		return 1;
+	}
+	cout << "Wrote " << config.outputPath << endl;
+	return 0;
+}
+
+//
+// Sequences
+//
+// --sequence renders the frames of a zoom or pan as separate images. One sample
+//  stream, drawn over the bounds of the whole path, feeds every frame: each orbit is
+//  iterated once per pass and splatted into all the frames of that pass, so a frame
+//  costs little more than its splats instead of a full render. As many frames as fit
+//  memoryBudget share a pass; longer sequences take several passes over the same seed,
+//  which leaves every frame as it would be with any other split.
+//
+
+// Viewport of frame `frame` of the sequence: each axis scales by the same factor every
+//  frame about the one point the start and end views leave in place, so a zoom keeps
+//  a steady pace and does not drift. An axis that keeps its size is panned linearly.
+void sequenceViewport(const RenderConfig &config, int frame, Complex &o_minimum, Complex &o_maximum)
+{
+	double t = config.nFrames > 1 ? (double)frame / (config.nFrames - 1) : 0.0;
+	const double start[2][2] = {{config.minimum.r(), config.maximum.r()}, {config.minimum.i(), config.maximum.i()}};
+	const double end[2][2] = {{config.endMinimum.r(), config.endMaximum.r()},
+							  {config.endMinimum.i(), config.endMaximum.i()}};
+	double view[2][2];
+	for (int axis = 0; axis < 2; ++axis)
+	{
+		double ratio = (end[axis][1] - end[axis][0]) / (start[axis][1] - start[axis][0]);
+		double fixed = (end[axis][0] - start[axis][0] * ratio) / (1 - ratio);
+		for (int side = 0; side < 2; ++side)
+		{
+			view[axis][side] = fabs(ratio - 1) < 1e-9
+								   ? start[axis][side] + (end[axis][side] - start[axis][side]) * t
+								   : fixed + (start[axis][side] - fixed) * pow(ratio, t);
+		}
+	}
+	o_minimum = Complex(view[0][0], view[1][0]);
+	o_maximum = Complex(view[0][1], view[1][1]);
+}
+
+// path with the frame number, zero-padded, before its extension: out.png -> out_0007.png
+string sequenceFramePath(const string &path, int frame, int nFrames)
+{
+	int digits = max(4, (int)to_string(nFrames - 1).size());
+	string number = to_string(frame);
+	number.insert(0, digits - number.size(), '0');
+	size_t dot = path.find_last_of('.');
+	return path.substr(0, dot) + "_" + number + path.substr(dot);
+}
+
+// Frames per pass so that every worker's tile of each, plus the frames themselves, fit
+//  the budget. A frame is never split, so a single frame may exceed it.
+int sequenceFramesPerPass(const RenderConfig &config)
+{
+	size_t tiles = resolveThreadCount(config.options.nThreads) + 1;
+	size_t frameBytes = (size_t)config.width * config.height * config.channelIters.size() * sizeof(HeatmapType);
+	size_t frames = config.memoryBudget / (tiles * frameBytes);
+	return (int)max<size_t>(1, min<size_t>(frames, config.nFrames));
+}
+
+int RunSequence(int argc, char **argv)
+{
+	RenderConfig config;
+	ImageFormat format = IMAGE_RAW;
+	if (!ParseRenderArgs(argc, argv, config))
+	{
+		printRenderUsage();
+		return 1;
+	}
+	if (config.outputPath.empty() || !imageFormatFromPath(config.outputPath, format))
+	{
+		cout << "--sequence needs --output ending in .png, .exr or .raw" << endl;
+		return 1;
+	}
+	if (!config.hasEndView)
+	{
+		cout << "--sequence needs --end-view" << endl;
+		return 1;
+	}
+	if (!config.checkpointPath.empty() || config.shardCount > 1)
+	{
+		cout << "--checkpoint and --shard do not apply to --sequence" << endl;
+		return 1;
+	}
+	// Perturbation views are offsets from one center, and Metropolis chains follow the
+	//  contribution to a single viewport
+	if (config.options.precision == PRECISION_PERTURBATION || config.options.sampler == SAMPLER_METROPOLIS)
+	{
+		cout << "--sequence supports the uniform sampler in double or float precision" << endl;
+		return 1;
+	}
+
+	// Every pass must draw the same samples over the same domain
+	if (config.options.seed == 0)
+	{
+		config.options.seed = chrono::high_resolution_clock::now().time_since_epoch().count();
+	}
+	FrameViewports path;
+	for (int frame = 0; frame < config.nFrames; ++frame)
+	{
+		Complex minimum, maximum;
+		sequenceViewport(config, frame, minimum, maximum);
+		path.add(minimum, maximum);
+	}
+	SamplingOptions options = config.options;
+	samplingDomain(config.options, path.boundsMinimum, path.boundsMaximum, options.domainMinimum,
+				   options.domainMaximum);
+	options = prepareSampling(options, config.channelIters, path.boundsMinimum, path.boundsMaximum, options.seed);
+
+	int framesPerPass = sequenceFramesPerPass(config);
+	int nPasses = (config.nFrames + framesPerPass - 1) / framesPerPass;
+	cout << "Rendering " << config.nFrames << " frames of " << config.width << "x" << config.height << " in "
+		 << nPasses << " pass(es), seed " << config.options.seed << endl;
+	SamplerTelemetry telemetry("Total: ", config.channelIters, config.nSamples * nPasses,
+							   resolveThreadCount(options.nThreads), options);
+
+	for (int pass = 0; pass < nPasses; ++pass)
+	{
+		int firstFrame = pass * framesPerPass;
+		int passFrames = min(framesPerPass, config.nFrames - firstFrame);
+		FrameViewports frames;
+		vector<Heatmap> heatmaps;
+		for (int f = 0; f < passFrames; ++f)
+		{
+			frames.add(path.minimums[firstFrame + f], path.maximums[firstFrame + f]);
+			heatmaps.emplace_back(config.width, config.height, (int)config.channelIters.size());
+		}
+		stringstream prefix;
+		prefix << "Frames " << firstFrame << "-" << firstFrame + passFrames - 1 << ": ";
+		cout << prefix.str() << config.nSamples << " samples" << endl;
+		GenerateHeatmapSequence(heatmaps, config.channelIters, frames, config.nSamples, prefix.str(), options,
+								&telemetry);
+
+		for (int f = 0; f < passFrames; ++f)
+		{
+			string framePath = sequenceFramePath(config.outputPath, firstFrame + f, config.nFrames);
+			ImageRowWriter writer;
+			if (!writer.open(framePath, format, config.width, config.height) || !writeHeatmapRows(writer, heatmaps[f]) ||
+				!writer.close())
+			{
+				cout << "Failed writing " << framePath << endl;
+				return 1;
+			}
+		}
+	}
+	telemetry.stop();
+	cout << "Wrote " << sequenceFramePath(config.outputPath, 0, config.nFrames) << " .. "
+		 << sequenceFramePath(config.outputPath, config.nFrames - 1, config.nFrames) << endl;
+	return 0;
+}
+
+// Sums finished checkpoints of one image, e.g. the shards of a distributed render,
+//  into an image and/or a merged checkpoint. Inputs stay mapped and are summed a row
+//  at a time, so memory does not grow with the image or the number of inputs.
+int RunMerge(int argc, char **argv)
+{
+	string outputPath, mergedPath;
+	vector<string> inputPaths;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--merge")
+		{
+			continue;
+		}
+		if ((arg == "--output" || arg == "--checkpoint") && i + 1 < argc)
+		{
+			(arg == "--output" ? outputPath : mergedPath) = argv[++i];
+		}
+		else if (arg.compare(0, 2, "--") == 0)
+		{
+			cout << "Unknown argument " << arg << endl;
+			printRenderUsage();
+			return 1;
+		}
+		else
+		{
+			inputPaths.push_back(arg);
+		}
+	}
+	ImageFormat format = IMAGE_RAW;
+	if (inputPaths.empty() || (outputPath.empty() && mergedPath.empty()) ||
+		(!outputPath.empty() && !imageFormatFromPath(outputPath, format)))
+	{
+		printRenderUsage();
+		return 1;
+	}
+
+	vector<unique_ptr<HeatmapCheckpoint>> inputs;
+	CheckpointHeader merged;
+	for (const string &path : inputPaths)
+	{
+		inputs.emplace_back(new HeatmapCheckpoint());
+		HeatmapCheckpoint &input = *inputs.back();
+		if (!input.open(path))
+		{
+			cout << "Not a checkpoint of this version: " << path << endl;
+			return 1;
+		}
+		const CheckpointHeader &header = input.header();
+		if (!checkpointFinished(header) || header.committing)
+		{
+			cout << path << " is not finished; resume it first" << endl;
+			return 1;
+		}
+		if (inputs.size() == 1)
+		{
+			merged = header;
+			merged.nSamples = 0;
+			merged.nSources = 0;
+		}
+		else if (!checkpointSameImage(merged, header))
+		{
+			cout << path << " is a different image from " << inputPaths[0] << endl;
+			return 1;
+		}
+		for (int k = 0; k < header.nSources; ++k)
+		{
+			for (size_t j = 0; j + 1 < inputs.size(); ++j)
+			{
+				const CheckpointHeader &other = inputs[j]->header();
+				if (find(other.sources, other.sources + other.nSources, header.sources[k]) !=
+					other.sources + other.nSources)
+				{
+					cout << path << " repeats the samples of " << inputPaths[j] << endl;
+					return 1;
+				}
+			}
+		}
+		if (merged.nSources + header.nSources > CHECKPOINT_MAX_SOURCES)
+		{
+			cout << "A merge holds at most " << CHECKPOINT_MAX_SOURCES << " renders" << endl;
+			return 1;
+		}
+		copy(header.sources, header.sources + header.nSources, merged.sources + merged.nSources);
+		merged.nSources += header.nSources;
+		// Every band of a finished checkpoint holds its nSamples
+		merged.nSamples += header.nSamples;
+	}
 
-	double r() const { return _r; }
-	double i() const { return _i; }
+	// The merge is itself a finished, unsharded checkpoint of one band, and its sources
+	//  say which samples it holds, so merges can be merged again
+	merged.samplesDone = merged.nSamples;
+	merged.chunkSamples = max<int64_t>(1, merged.nSamples);
+	merged.bandRows = merged.height;
+	merged.nextBand = 1;
+	merged.nextChunk = 0;
+	merged.seed = 0; // No sample sequence of its own to continue
+	merged.shardIndex = 0;
+	merged.shardCount = 1;
 
-	Complex operator*(const Complex &other)
+	HeatmapCheckpoint output;
+	if (!mergedPath.empty() && !output.create(mergedPath, merged))
 	{
-		// (a + bi) (c + di)
-		return Complex(_r * other._r - _i * other._i, _r * other._i + _i * other._r);
+		cout << "Failed to create " << mergedPath << (HeatmapCheckpoint::exists(mergedPath) ? "; it already exists" : "")
+			 << endl;
+		return 1;
 	}
-
-	Complex operator+(const Complex &other)
+	ImageRowWriter writer;
+	if (!outputPath.empty() && !writer.open(outputPath, format, merged.width, merged.height))
 	{
-		return Complex(_r + other._r, _i + other._i);
+		cout << "Failed to open " << outputPath << endl;
+		return 1;
 	}
 
-	double sqmagnitude() const
+	Heatmap row(merged.width, 1, merged.channels);
+	for (int y = 0; y < merged.height; ++y)
 	{
-		return _r * _r + _i * _i;
+		row.clear();
+		for (unique_ptr<HeatmapCheckpoint> &input : inputs)
+		{
+			Heatmap inputRow = input->rows(y, 1);
+			for (size_t i = 0; i < row.size(); ++i)
+			{
+				row.data()[i] += inputRow.data()[i];
+			}
+		}
+		if (output.isOpen())
+		{
+			Heatmap outputRow = output.rows(y, 1);
+			copy(row.data(), row.data() + row.size(), outputRow.data());
+		}
+		if (!outputPath.empty() && !writeHeatmapRows(writer, row))
+		{
+			cout << "Failed writing " << outputPath << endl;
+			return 1;
+		}
 	}
 
-  private:
-	double _r, _i;
-};
+	if (output.isOpen() && !output.sync())
+	{
+		cout << "Failed to write " << mergedPath << endl;
+		return 1;
+	}
+	if (!outputPath.empty() && !writer.close())
+	{
+		cout << "Failed to finish " << outputPath << endl;
+		return 1;
+	}
+	cout << "Merged " << inputs.size() << " checkpoint(s), " << merged.nSamples << " samples" << endl;
+	return 0;
+}
 
 //
-// Utility
+// Benchmark
+//
+// --benchmark times GenerateHeatmaps over a fixed set of cases with fixed seeds and
+//  prints the results as JSON, so runs on different commits or machines can be
+//  compared directly. With the uniform sampler the heatmap checksum is the same on
+//  every run and thread count, so a changed checksum flags a correctness change too.
+//  It first runs Philox against its known-answer vectors and refuses to go on if they
+//  differ, since a different sample stream changes every checksum. "hires" splats
+//  its 30MB tiles through SplatBins and "hires-direct" the same render straight into
+//  them, so their times compare the two and their checksums must agree.
 //
-void AllocHeatmap(HeatmapType **&o_heatmap, int width, int height)
+
+struct BenchmarkCase
+{
+	string name;
+	int width, height;
+	Complex minimum, maximum;
+	vector<int> channelIters;
+	long long nSamples;
+	unsigned int nThreads; // 0 = one per hardware thread
+	SamplerKind sampler;
+	bool zoomed; // Sample the whole [-2, 2] square, not just the viewport
+	PrecisionKind precision;
+	const char *center; // Perturbation: the viewport is relative to this "real,imaginary"
+	int contributionCells; // Contribution map cells per side; 0 = none
+	FractalKind fractal;
+	OrbitKind orbits;
+	bool directSplat; // Splat straight into worker tiles however large they are
+};
+
+vector<BenchmarkCase> benchmarkCases()
+{
+	vector<int> defaultIters{RED_ITERS, GREEN_ITERS, BLUE_ITERS};
+	Complex fullMin(-2.0, -2.0), fullMax(2.0, 2.0);
+	// A seahorse-valley window, where orbits of the whole set pile up densely
+	Complex zoomMin(-0.85, -0.2), zoomMax(-0.65, 0.0);
+	// 2e-20 across, just outside the cardioid's cusp where orbits take ~3000 steps to
+	//  escape; far past what double resolves
+	Complex deepMin(-1e-20, -1e-20), deepMax(1e-20, 1e-20);
+	const char *deepCenter = "0.2500010000000000000000123,1e-21";
+	return {
+		{"default", IMAGE_WIDTH, IMAGE_HEIGHT, fullMin, fullMax, defaultIters, 2000000, 0, SAMPLER_UNIFORM, false,
+		 PRECISION_DOUBLE, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"single-thread", IMAGE_WIDTH, IMAGE_HEIGHT, fullMin, fullMax, defaultIters, 1000000, 1, SAMPLER_UNIFORM, false,
+		 PRECISION_DOUBLE, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"deep-caps", IMAGE_WIDTH, IMAGE_HEIGHT, fullMin, fullMax, {2000, 2000, 10000}, 500000, 0, SAMPLER_UNIFORM,
+		 false, PRECISION_DOUBLE, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"float", IMAGE_WIDTH, IMAGE_HEIGHT, fullMin, fullMax, {2000, 2000, 10000}, 500000, 0, SAMPLER_UNIFORM, false,
+		 PRECISION_FLOAT, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"hires", 1600, 1600, fullMin, fullMax, defaultIters, 2000000, 0, SAMPLER_UNIFORM, false, PRECISION_DOUBLE,
+		 nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"hires-direct", 1600, 1600, fullMin, fullMax, defaultIters, 2000000, 0, SAMPLER_UNIFORM, false,
+		 PRECISION_DOUBLE, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, true},
+		{"zoom", 400, 400, zoomMin, zoomMax, {1000, 1000, 5000}, 1000000, 0, SAMPLER_UNIFORM, true, PRECISION_DOUBLE,
+		 nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"zoom-culled", 400, 400, zoomMin, zoomMax, {1000, 1000, 5000}, 1000000, 0, SAMPLER_UNIFORM, true,
+		 PRECISION_DOUBLE, nullptr, 64, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"zoom-metropolis", 400, 400, zoomMin, zoomMax, {1000, 1000, 5000}, 1000000, 0, SAMPLER_METROPOLIS, true,
+		 PRECISION_DOUBLE, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		{"perturbation", 400, 400, deepMin, deepMax, {1000, 1000, 5000}, 50000, 0, SAMPLER_UNIFORM, false,
+		 PRECISION_PERTURBATION, deepCenter, 0, FRACTAL_MANDELBROT, ORBITS_ESCAPING, false},
+		// The Burning Ship's small ship on the real axis, and the Anti-Buddhabrot of the default view
+		{"burning-ship", 400, 400, Complex(-1.9, -0.1), Complex(-1.7, 0.1), {1000, 1000, 5000}, 1000000, 0,
+		 SAMPLER_UNIFORM, true, PRECISION_DOUBLE, nullptr, 0, FRACTAL_BURNING_SHIP, ORBITS_ESCAPING, false},
+		{"anti", IMAGE_WIDTH, IMAGE_HEIGHT, fullMin, fullMax, defaultIters, 200000, 0, SAMPLER_UNIFORM, false,
+		 PRECISION_DOUBLE, nullptr, 0, FRACTAL_MANDELBROT, ORBITS_BOUNDED, false},
+	};
+}
+
+struct BenchmarkResult
+{
+	vector<double> seconds; // One per repeat
+	SamplerStats stats;		// Of the last repeat; identical across repeats
+	double checksum;		// Sum of the last repeat's heatmap
+};
+
+BenchmarkResult runBenchmarkCase(const BenchmarkCase &bench, int repeats, unsigned long long seed)
 {
-	o_heatmap = new HeatmapType *[height];
-	for (int i = 0; i < height; ++i)
+	SamplingOptions options;
+	options.nThreads = bench.nThreads;
+	options.sampler = bench.sampler;
+	options.seed = seed;
+	options.precision = bench.precision;
+	options.contributionCells = bench.contributionCells;
+	options.fractal = bench.fractal;
+	options.orbits = bench.orbits;
+	if (bench.directSplat)
+	{
+		options.splatBinningBytes = SIZE_MAX;
+	}
+	if (bench.center)
+	{
+		string center = bench.center;
+		size_t comma = center.find(',');
+		parseDoubleDouble(center.substr(0, comma), options.centerR);
+		parseDoubleDouble(center.substr(comma + 1), options.centerI);
+	}
+	if (bench.zoomed)
 	{
-		o_heatmap[i] = new HeatmapType[width];
-		for (int j = 0; j < width; ++j)
+		options.domainMinimum = Complex(-2.0, -2.0);
+		options.domainMaximum = Complex(2.0, 2.0);
+	}
+
+	BenchmarkResult result;
+	for (int r = 0; r < repeats; ++r)
+	{
+		Heatmap heatmap(bench.width, bench.height, (int)bench.channelIters.size());
+		auto start = chrono::steady_clock::now();
+		GenerateHeatmaps(heatmap, bench.channelIters, bench.minimum, bench.maximum, 0, bench.nSamples,
+						 bench.name + ": ", options, &result.stats);
+		result.seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		result.checksum = 0;
+		for (size_t i = 0; i < heatmap.size(); ++i)
 		{
-			o_heatmap[i][j] = 0;
+			result.checksum += heatmap.data()[i];
 		}
 	}
+	return result;
 }
 
-void FreeHeatmap(HeatmapType **&o_heatmap, int height)
+void writeBenchmarkJson(ostream &out, const vector<BenchmarkCase> &cases, const vector<BenchmarkResult> &results,
+						unsigned long long seed, int repeats)
 {
-	for (int i = 0; i < height; ++i)
+	out.precision(17);
+	out << "{\n"
+		<< "  \"kernel\": \"" << escapeKernel().name << "\",\n"
+		<< "  \"hardware_threads\": " << resolveThreadCount(0) << ",\n"
+		<< "  \"seed\": " << seed << ",\n"
+		<< "  \"repeats\": " << repeats << ",\n"
+		<< "  \"cases\": [";
+	for (size_t c = 0; c < cases.size(); ++c)
 	{
-		delete[] o_heatmap[i];
-		o_heatmap[i] = nullptr;
+		const BenchmarkCase &bench = cases[c];
+		const BenchmarkResult &result = results[c];
+		const SamplerStats &stats = result.stats;
+		vector<double> sorted = result.seconds;
+		sort(sorted.begin(), sorted.end());
+		double best = sorted.front(), median = sorted[sorted.size() / 2];
+		double samples = (double)max(1LL, stats.samples);
+
+		out << (c ? "," : "") << "\n    {\n"
+			<< "      \"name\": \"" << bench.name << "\",\n"
+			<< "      \"width\": " << bench.width << ", \"height\": " << bench.height << ",\n"
+			<< "      \"viewport\": [" << bench.minimum.r() << ", " << bench.minimum.i() << ", " << bench.maximum.r()
+			<< ", " << bench.maximum.i() << "],\n"
+			<< "      \"iters\": [";
+		for (size_t ch = 0; ch < bench.channelIters.size(); ++ch)
+		{
+			out << (ch ? ", " : "") << bench.channelIters[ch];
+		}
+		out << "],\n"
+			<< "      \"sampler\": \"" << (bench.sampler == SAMPLER_METROPOLIS ? "metropolis" : "uniform") << "\",\n"
+			<< "      \"precision\": \""
+			<< (bench.precision == PRECISION_FLOAT			? "float"
+				: bench.precision == PRECISION_PERTURBATION ? "perturbation"
+															: "double")
+			<< "\",\n"
+			<< "      \"contribution_cells\": " << bench.contributionCells << ",\n"
+			<< "      \"fractal\": \"" << (bench.fractal == FRACTAL_BURNING_SHIP ? "burning-ship" : "mandelbrot") << "\",\n"
+			<< "      \"orbits\": \"" << (bench.orbits == ORBITS_BOUNDED ? "bounded" : "escaping") << "\",\n"
+			<< "      \"threads\": " << resolveThreadCount(bench.nThreads) << ",\n"
+			<< "      \"samples\": " << bench.nSamples << ",\n"
+			<< "      \"seconds_best\": " << best << ", \"seconds_median\": " << median << ",\n"
+			<< "      \"samples_per_sec\": " << bench.nSamples / best << ",\n"
+			<< "      \"iterations_per_sec\": " << stats.iterations / best << ",\n"
+			<< "      \"hits_per_sec\": " << stats.hits / best << ",\n"
+			<< "      \"interior_fraction\": " << stats.interior / samples << ",\n"
+			<< "      \"escape_fraction\": " << stats.escaped / samples << ",\n"
+			<< "      \"escape_histogram\": [";
+		for (int b = 0; b < ESCAPE_HISTOGRAM_BINS; ++b)
+		{
+			out << (b ? ", " : "") << stats.escapeHistogram[b];
+		}
+		out << "],\n"
+			<< "      \"checksum\": " << result.checksum << "\n"
+			<< "    }";
 	}
-	delete o_heatmap;
-	o_heatmap = nullptr;
+	out << "\n  ]\n}\n";
 }
 
-vector<Complex> buddhabrotPoints(const Complex &c, int nIterations)
+int RunBenchmark(int argc, char **argv)
 {
-	int n = 0;
-	Complex z;
+	string outputPath, onlyCase;
+	int repeats = 3;
+	bool quick = false;
+	unsigned long long seed = 1;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--benchmark")
+		{
+			continue;
+		}
+		else if (arg == "--quick")
+		{
+			quick = true;
+		}
+		else if (arg == "--output" && hasValue)
+		{
+			outputPath = argv[++i];
+		}
+		else if (arg == "--case" && hasValue)
+		{
+			onlyCase = argv[++i];
+		}
+		else if (arg == "--repeats" && hasValue)
+		{
+			repeats = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--seed" && hasValue)
+		{
+			seed = strtoull(argv[++i], nullptr, 10);
+		}
+		else
+		{
+			cout << "usage: buddhabrot --benchmark [--output FILE.json] [--case NAME] [--repeats N] [--seed N] [--quick]"
+				 << endl;
+			return 1;
+		}
+	}
 
-	vector<Complex> toReturn;
-	toReturn.reserve(nIterations);
+	// Checksums are only comparable across machines if the sample stream is the same
+	if (!philoxKnownAnswers())
+	{
+		cerr << "Philox4x32-10 does not match the Random123 known-answer vectors; this build draws other samples"
+			 << endl;
+		return 1;
+	}
 
-	while (n < nIterations && z.sqmagnitude() <= 2.0)
+	vector<BenchmarkCase> cases;
+	for (BenchmarkCase &bench : benchmarkCases())
 	{
-		z = z * z + c;
-		++n;
+		if (onlyCase.empty() || bench.name == onlyCase)
+		{
+			// --quick is for smoke tests; throughput numbers from it are noisy
+			bench.nSamples = quick ? max(1LL, bench.nSamples / 20) : bench.nSamples;
+			cases.push_back(bench);
+		}
+	}
+	if (cases.empty())
+	{
+		cout << "No benchmark case named " << onlyCase << endl;
+		return 1;
+	}
 
-		toReturn.push_back(z);
+	vector<BenchmarkResult> results;
+	for (const BenchmarkCase &bench : cases)
+	{
+		// Progress goes to stderr so stdout stays valid JSON
+		cerr << bench.name << "..." << endl;
+		results.push_back(runBenchmarkCase(bench, repeats, seed));
 	}
 
-	// If point remains bounded through nIterations iterations, the point
-	//  is bounded, therefore in the Mandelbrot set, therefore of no interest to us
-	if (n == nIterations)
+	if (outputPath.empty())
 	{
-		return vector<Complex>();
+		writeBenchmarkJson(cout, cases, results, seed, repeats);
+		return 0;
 	}
-	else
+	ofstream out(outputPath);
+	writeBenchmarkJson(out, cases, results, seed, repeats);
+	if (!out)
 	{
-		return toReturn;
+		cout << "Failed writing " << outputPath << endl;
+		return 1;
 	}
+	return 0;
 }
 
-int rowFromReal(double real, double minR, double maxR, int imageHeight)
+//
+// Display
+//
+// The heatmap is shown as one RGB32F texture drawn with a fullscreen triangle.
+//  Uploads go through a pixel buffer object, so the CPU copy returns as soon as the
+//  data is in driver memory. Normalization levels and exposure are uniforms, so
+//  tonemapping costs nothing on the CPU, and changing either needs no re-upload.
+//  --compact-display halves texture memory and upload size with an RGB16F texture
+//  instead. Raw counts would overflow half floats, so those uploads are divided by the
+//  levels first, which then have to be re-uploaded when the levels change.
+//
+
+// Covers the viewport with one oversized triangle built from gl_VertexID; no vertex buffer
+const char *fullscreenVertexShaderSource = "#version 330 core\n"
+										   "void main()\n"
+										   "{\n"
+										   "   vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+										   "   gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+										   "}\0";
+const char *heatmapFragmentShaderSource = "#version 330 core\n"
+										  "out vec4 FragColor;\n"
+										  "uniform sampler2D heatmap;\n"
+										  "uniform vec3 levels;\n"
+										  "uniform float exposure;\n"
+										  "uniform vec2 viewportSize;\n"
+										  "void main()\n"
+										  "{\n"
+										  "   ivec2 size = textureSize(heatmap, 0);\n"
+										  "   ivec2 texel = clamp(ivec2((1.0 - gl_FragCoord.xy / viewportSize) * vec2(size)), ivec2(0), size - 1);\n"
+										  "   vec3 value = texelFetch(heatmap, texel, 0).rgb;\n"
+										  "   vec3 color = mix(vec3(0.0), min(vec3(1.0), value * exposure / levels), greaterThan(levels, vec3(0.0)));\n"
+										  "   FragColor = vec4(color, 1.0);\n"
+										  "}\n\0";
+
+static_assert(sizeof(HeatmapType) == sizeof(float), "The display texture is uploaded as GL_FLOAT");
+
+// GL objects for showing a CPU heatmap
+struct HeatmapDisplay
 {
-	// [minR, maxR]
-	// [0, maxR - minR] // subtract minR from n
-	// [0, imageHeight] // multiply by (imageHeight / (maxR - minR))
-	return (int)((real - minR) * (imageHeight / (maxR - minR)));
-}
+	int width = 0, height = 0;
+	bool compact = false;	  // RGB16F of heatmap / levels rather than RGB32F of the heatmap
+	unsigned int texture = 0; // texel (x, y) = heatmap (col, row)
+	unsigned int pbo = 0;
+	unsigned int program = 0;
+	unsigned int vao = 0; // Empty; the fullscreen triangle comes from gl_VertexID
+};
 
-int colFromImaginary(double imag, double minI, double maxI, int imageWidth)
+bool CreateHeatmapDisplay(HeatmapDisplay &o_display, int width, int height, bool compact = false)
 {
-	return (int)((imag - minI) * (imageWidth / (maxI - minI)));
+	o_display.program = buildShaderProgram({{GL_VERTEX_SHADER, {fullscreenVertexShaderSource}},
+											{GL_FRAGMENT_SHADER, {heatmapFragmentShaderSource}}});
+	if (!o_display.program)
+	{
+		return false;
+	}
+	o_display.width = width;
+	o_display.height = height;
+	o_display.compact = compact;
+
+	glGenTextures(1, &o_display.texture);
+	glBindTexture(GL_TEXTURE_2D, o_display.texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, compact ? GL_RGB16F : GL_RGB32F, width, height, 0, GL_RGB,
+				 compact ? GL_HALF_FLOAT : GL_FLOAT, NULL);
+	// Float textures are not filterable everywhere, and texelFetch ignores filtering anyway
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glGenBuffers(1, &o_display.pbo);
+	glGenVertexArrays(1, &o_display.vao);
+	return true;
 }
 
-void GenerateHeatmap(HeatmapType **o_heatmap, int imageWidth, int imageHeight,
-					 const Complex &minimum, const Complex &maximum, int nIterations, long long nSamples,
-					 HeatmapType &o_maxHeatmapValue, string consoleMessagePrefix)
+void DestroyHeatmapDisplay(HeatmapDisplay &o_display)
 {
-	mt19937 rng;
-	uniform_real_distribution<double> realDistribution(minimum.r(), maximum.r());
-	uniform_real_distribution<double> imagDistribution(minimum.i(), maximum.i());
+	glDeleteTextures(1, &o_display.texture);
+	glDeleteBuffers(1, &o_display.pbo);
+	glDeleteProgram(o_display.program);
+	glDeleteVertexArrays(1, &o_display.vao);
+	o_display = HeatmapDisplay();
+}
 
-	rng.seed(chrono::high_resolution_clock::now().time_since_epoch().count());
-	// Collect nSamples samples... (sample is just a random number c)
-	for (long long sampleIdx = 0; sampleIdx < nSamples; ++sampleIdx)
+// IEEE half float nearest to value, for value >= 0. Too large saturates to the
+//  largest finite half, since the display clamps to 1 anyway; small values keep their
+//  subnormals so that faint pixels do not drop to black.
+uint16_t halfFromFloat(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bits &= 0x7FFFFFFFu;
+	if (bits >= 0x477FF000u) // 65520 and up round past the largest half, 65504
 	{
-		//  Each sample, get the list of points as the function
-		//    escapes to infinity (if it does at all)
-
-		Complex sample(realDistribution(rng), imagDistribution(rng));
-		vector<Complex> pointsList = buddhabrotPoints(sample, nIterations);
+		return bits > 0x7F800000u ? 0x7E00 : 0x7BFF;
+	}
+	if (bits < 0x38800000u) // Below 2^-14: subnormal, in units of 2^-24
+	{
+		float scaled;
+		memcpy(&scaled, &bits, sizeof(scaled));
+		return (uint16_t)lrintf(scaled * 16777216.0f);
+	}
+	// Rebias the exponent from 127 to 15, rounding the dropped 13 mantissa bits to even
+	uint32_t rounded = bits + 0xFFFu + ((bits >> 13) & 1);
+	return (uint16_t)((rounded - 0x38000000u) >> 13);
+}
 
-		for (Complex &point : pointsList)
+// Streams the first three channels of heatmap into the display texture. heatmap must
+//  match the display's size; any layout works, linear interleaved is a straight copy.
+//  A compact display stores heatmap / levels and needs a new upload whenever the levels
+//  change; a full one ignores levels.
+void UploadHeatmap(HeatmapDisplay &display, const Heatmap &heatmap, const vector<HeatmapType> &levels)
+{
+	size_t texelCount = (size_t)display.width * display.height;
+	size_t bytes = texelCount * 3 * (display.compact ? sizeof(uint16_t) : sizeof(float));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, display.pbo);
+	// Orphan the previous storage so mapping never waits on a transfer still reading it
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+	void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	float *texels = (float *)mapped;
+	if (mapped && display.compact)
+	{
+		float scale[3];
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			scale[ch] = ch < heatmap.channels() && levels[ch] > 0 ? 1.0f / levels[ch] : 0.0f;
+		}
+		uint16_t *halves = (uint16_t *)mapped;
+		for (int row = 0; row < display.height; ++row)
 		{
-			if (point.r() <= maximum.r() && point.r() >= minimum.r() && point.i() <= maximum.i() && point.i() >= minimum.i())
+			for (int col = 0; col < display.width; ++col)
 			{
-				int row = rowFromReal(point.r(), minimum.r(), maximum.r(), imageHeight);
-				int col = colFromImaginary(point.i(), minimum.i(), maximum.i(), imageWidth);
-				++o_heatmap[row][col];
-
-				if (o_heatmap[row][col] > o_maxHeatmapValue)
+				for (int ch = 0; ch < 3; ++ch)
+				{
+					*halves++ = scale[ch] > 0 ? halfFromFloat(heatmap.at(row, col, ch) * scale[ch]) : 0;
+				}
+			}
+		}
+	}
+	else if (mapped)
+	{
+		if (heatmap.layout() == HEATMAP_LINEAR && heatmap.interleaved() && heatmap.channels() == 3)
+		{
+			copy(heatmap.data(), heatmap.data() + texelCount * 3, texels);
+		}
+		else
+		{
+			for (int row = 0; row < display.height; ++row)
+			{
+				for (int col = 0; col < display.width; ++col)
 				{
-					o_maxHeatmapValue = o_heatmap[row][col];
+					for (int ch = 0; ch < 3; ++ch)
+					{
+						*texels++ = ch < heatmap.channels() ? heatmap.at(row, col, ch) : 0;
+					}
 				}
 			}
 		}
 	}
+	if (mapped)
+	{
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		glBindTexture(GL_TEXTURE_2D, display.texture);
+		// Half-float rows are 6 bytes a texel, so an odd width breaks the default 4-byte alignment
+		glPixelStorei(GL_UNPACK_ALIGNMENT, display.compact ? 2 : 4);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, display.width, display.height, GL_RGB,
+						display.compact ? GL_HALF_FLOAT : GL_FLOAT, (void *)0);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
-float colorFromHeatmap(HeatmapType inputValue, HeatmapType maxHeatmapValue, float maxColor)
+// Draws the uploaded heatmap over the whole framebuffer, channel ch scaled so that
+//  levels[ch] reaches full brightness at exposure 1
+void DrawHeatmapDisplay(const HeatmapDisplay &display, const vector<HeatmapType> &levels, float exposure,
+						int framebufferWidth, int framebufferHeight)
 {
-	double scale = (1.0f * (maxColor)) / (1.0f * maxHeatmapValue);
-	return inputValue * scale;
+	glUseProgram(display.program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, display.texture);
+	glUniform1i(glGetUniformLocation(display.program, "heatmap"), 0);
+	vector<HeatmapType> shown = levels;
+	if (display.compact)
+	{
+		// Already divided out on upload; only whether a channel is shown at all remains
+		for (HeatmapType &level : shown)
+		{
+			level = level > 0 ? 1 : 0;
+		}
+	}
+	glUniform3f(glGetUniformLocation(display.program, "levels"), shown[0], shown[1], shown[2]);
+	glUniform1f(glGetUniformLocation(display.program, "exposure"), exposure);
+	glUniform2f(glGetUniformLocation(display.program, "viewportSize"), (float)framebufferWidth,
+				(float)framebufferHeight);
+	glBindVertexArray(display.vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
 }
 
-void framebuffer_size_callback(GLFWwindow *window, int width, int height);
-void mouse_button_callback(GLFWwindow *window, int button, int action, int mods);
-void processInput(GLFWwindow *window);
+//
+// GPU backend
+//
+// Runs sampling and orbit accumulation in a compute shader on the GL context the
+//  window already has. Every invocation draws one sample from a hashed counter,
+//  iterates it in single precision and atomically adds its orbit into one R32UI
+//  layer per channel. A second compute pass finds each channel's maximum, and the
+//  display pass tonemaps straight from those textures, so nothing is read back.
+// Needs GL 4.3 or the ARB_compute_shader and ARB_shader_image_load_store extensions.
+//
+
+const int GPU_CHANNELS = 3;
+const long long GPU_SAMPLES_PER_DISPATCH = 1 << 20; // Keeps each dispatch well under driver watchdog limits
+const int GPU_SAMPLE_GROUP = 64;
+const int GPU_LEVELS_GROUP = 16;
+
+const char *gpuAccumulateShaderSource = "layout (local_size_x = 64) in;\n"
+										"layout (r32ui) uniform uimage2DArray heatmap;\n"
+										"uniform ivec3 channelIters;\n"
+										"uniform int maxIters;\n"
+										"uniform vec2 minimum;\n"
+										"uniform vec2 maximum;\n"
+										"uniform uint seed;\n"
+										"uniform uint sampleBase;\n"
+										"uniform uint sampleCount;\n"
+										"uint hash(uint v)\n"
+										"{\n"
+										"   uint state = v * 747796405u + 2891336453u;\n"
+										"   uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;\n"
+										"   return (word >> 22u) ^ word;\n"
+										"}\n"
+										"float unitFloat(uint v) { return float(v >> 8u) * (1.0 / 16777216.0); }\n"
+										"bool inViewport(vec2 p) { return all(greaterThanEqual(p, minimum)) && all(lessThanEqual(p, maximum)); }\n"
+										"void main()\n"
+										"{\n"
+										"   if (gl_GlobalInvocationID.x >= sampleCount) return;\n"
+										"   uint h = hash((sampleBase + gl_GlobalInvocationID.x) ^ hash(seed));\n"
+										"   vec2 c = minimum + (maximum - minimum) * vec2(unitFloat(h), unitFloat(hash(h)));\n"
+										"   float x = c.x - 0.25;\n"
+										"   float q = x * x + c.y * c.y;\n"
+										"   if (q * (q + x) <= 0.25 * c.y * c.y || dot(c + vec2(1.0, 0.0), c + vec2(1.0, 0.0)) <= 1.0 / 16.0) return;\n"
+										"   vec2 z = vec2(0.0);\n"
+										"   int n = 0;\n"
+										"   while (n < maxIters && dot(z, z) <= 2.0)\n"
+										"   {\n"
+										"      z = vec2(z.x * z.x - z.y * z.y, 2.0 * z.x * z.y) + c;\n"
+										"      ++n;\n"
+										"   }\n"
+										"   bvec3 lit = lessThan(ivec3(n), channelIters);\n"
+										"   if (!any(lit)) return;\n"
+										"   ivec2 size = imageSize(heatmap).xy;\n"
+										"   vec2 scale = vec2(size) / (maximum.yx - minimum.yx);\n"
+										"   z = vec2(0.0);\n"
+										"   for (int k = 0; k < n; ++k)\n"
+										"   {\n"
+										"      z = vec2(z.x * z.x - z.y * z.y, 2.0 * z.x * z.y) + c;\n"
+										"      if (!inViewport(z)) continue;\n"
+										"      ivec2 texel = min(ivec2((z.yx - minimum.yx) * scale), size - 1);\n"
+										"      if (lit.x) imageAtomicAdd(heatmap, ivec3(texel, 0), 1u);\n"
+										"      if (lit.y) imageAtomicAdd(heatmap, ivec3(texel, 1), 1u);\n"
+										"      if (lit.z) imageAtomicAdd(heatmap, ivec3(texel, 2), 1u);\n"
+										"   }\n"
+										"}\n";
+
+// Plain image atomics rather than a shared-memory pre-reduction, since shared atomics are
+//  not guaranteed on the extension path
+const char *gpuLevelsShaderSource = "layout (local_size_x = 16, local_size_y = 16) in;\n"
+									"layout (r32ui) uniform readonly uimage2DArray heatmap;\n"
+									"layout (r32ui) uniform uimage2D levels;\n"
+									"void main()\n"
+									"{\n"
+									"   ivec2 texel = ivec2(gl_GlobalInvocationID.xy);\n"
+									"   if (any(greaterThanEqual(texel, imageSize(heatmap).xy))) return;\n"
+									"   for (int ch = 0; ch < 3; ++ch)\n"
+									"   {\n"
+									"      uint value = imageLoad(heatmap, ivec3(texel, ch)).r;\n"
+									"      if (value > 0u) imageAtomicMax(levels, ivec2(ch, 0), value);\n"
+									"   }\n"
+									"}\n";
 
-const char *vertexShaderSource = "#version 330 core\n"
-								 "layout (location = 0) in vec3 aPos;\n"
-								 "layout (location = 1) in vec3 aColor;\n"
-								 "out vec3 vertexColor;\n"
-								 "void main()\n"
-								 "{\n"
-								 "   gl_Position = vec4(aPos,1.0);\n"
-								 "vertexColor = aColor;\n"
-								 "}\0";
-const char *fragmentShaderSource = "#version 330 core\n"
-								   "out vec4 FragColor;\n"
-								   "in vec3 vertexColor;\n"
-								   "void main()\n"
-								   "{\n"
-								   "   FragColor =  vec4(vertexColor, 1.0);\n"
-								   "}\n\0";
+const char *gpuDisplayFragmentShaderSource = "#version 330 core\n"
+											 "out vec4 FragColor;\n"
+											 "uniform usampler2DArray heatmap;\n"
+											 "uniform usampler2D levels;\n"
+											 "uniform float exposure;\n"
+											 "uniform vec2 viewportSize;\n"
+											 "void main()\n"
+											 "{\n"
+											 "   ivec2 size = textureSize(heatmap, 0).xy;\n"
+											 "   ivec2 texel = clamp(ivec2((1.0 - gl_FragCoord.xy / viewportSize) * vec2(size)), ivec2(0), size - 1);\n"
+											 "   vec3 color;\n"
+											 "   for (int ch = 0; ch < 3; ++ch)\n"
+											 "   {\n"
+											 "      float level = float(texelFetch(levels, ivec2(ch, 0), 0).r);\n"
+											 "      float value = float(texelFetch(heatmap, ivec3(texel, ch), 0).r);\n"
+											 "      color[ch] = level > 0.0 ? min(1.0, value * exposure / level) : 0.0;\n"
+											 "   }\n"
+											 "   FragColor = vec4(color, 1.0);\n"
+											 "}\n\0";
 
-int points;
+// Everything the GPU path keeps on the device
+struct GpuBuddhabrot
+{
+	int width = 0, height = 0;
+	unsigned int heatmapTexture = 0; // GL_TEXTURE_2D_ARRAY, one R32UI layer per channel
+	unsigned int levelsTexture = 0;	 // GPU_CHANNELS x 1 R32UI, per-channel maximum
+	unsigned int accumulateProgram = 0;
+	unsigned int levelsProgram = 0;
+	unsigned int displayProgram = 0;
+	unsigned int vao = 0; // Empty; the fullscreen triangle comes from gl_VertexID
+};
 
-float mapX(float x)
+bool gpuBackendSupported()
 {
-	return x * 2.0 / IMAGE_WIDTH - 1.0;
+	return GLAD_GL_ARB_compute_shader && GLAD_GL_ARB_shader_image_load_store;
 }
 
-float mapY(float y)
+void clearGpuLevels(const GpuBuddhabrot &gpu)
 {
-	return y * 2.0 / IMAGE_HEIGHT - 1.0;
+	unsigned int zeros[GPU_CHANNELS] = {0};
+	glBindTexture(GL_TEXTURE_2D, gpu.levelsTexture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GPU_CHANNELS, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, zeros);
 }
 
-int main()
+// Builds the programs and zeroed textures for a width x height render. Returns false,
+//  leaving nothing allocated, when the context cannot run compute shaders.
+bool CreateGpuBuddhabrot(GpuBuddhabrot &o_gpu, int width, int height)
 {
-	const Complex MINIMUM(-2.0, -2.0);
-	const Complex MAXIMUM(2.0, 2.0);
-	vector<float> vertices;
-	vertices.reserve(IMAGE_HEIGHT * IMAGE_WIDTH);
+	if (!gpuBackendSupported())
+	{
+		return false;
+	}
+
+	// Compute shaders are core in 4.3; older contexts get them through the extensions
+	int major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	const char *computeHeader = (major > 4 || (major == 4 && minor >= 3))
+									? "#version 430 core\n"
+									: "#version 330 core\n"
+									  "#extension GL_ARB_compute_shader : require\n"
+									  "#extension GL_ARB_shader_image_load_store : require\n";
+
+	o_gpu.accumulateProgram = buildShaderProgram({{GL_COMPUTE_SHADER, {computeHeader, gpuAccumulateShaderSource}}});
+	o_gpu.levelsProgram = buildShaderProgram({{GL_COMPUTE_SHADER, {computeHeader, gpuLevelsShaderSource}}});
+	o_gpu.displayProgram = buildShaderProgram({{GL_VERTEX_SHADER, {fullscreenVertexShaderSource}},
+											{GL_FRAGMENT_SHADER, {gpuDisplayFragmentShaderSource}}});
+	if (!o_gpu.accumulateProgram || !o_gpu.levelsProgram || !o_gpu.displayProgram)
+	{
+		glDeleteProgram(o_gpu.accumulateProgram);
+		glDeleteProgram(o_gpu.levelsProgram);
+		glDeleteProgram(o_gpu.displayProgram);
+		o_gpu = GpuBuddhabrot();
+		return false;
+	}
 
-	// Allocate a heatmap of the size of our image
-	HeatmapType maxHeatmapValue = 0;
-	HeatmapType **red;
-	HeatmapType **green;
-	HeatmapType **blue;
-	AllocHeatmap(red, IMAGE_WIDTH, IMAGE_HEIGHT);
-	AllocHeatmap(green, IMAGE_WIDTH, IMAGE_HEIGHT);
-	AllocHeatmap(blue, IMAGE_WIDTH, IMAGE_HEIGHT);
+	o_gpu.width = width;
+	o_gpu.height = height;
 
-	GenerateHeatmap(red, IMAGE_WIDTH, IMAGE_HEIGHT, MINIMUM, MAXIMUM, RED_ITERS,
-					SAMPLE_COUNT, maxHeatmapValue, "Red Channel: ");
-	GenerateHeatmap(blue, IMAGE_WIDTH, IMAGE_HEIGHT, MINIMUM, MAXIMUM, BLUE_ITERS,
-					SAMPLE_COUNT, maxHeatmapValue, "Blue Channel: ");
+	vector<unsigned int> zeros((size_t)width * height * GPU_CHANNELS, 0);
+	glGenTextures(1, &o_gpu.heatmapTexture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, o_gpu.heatmapTexture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32UI, width, height, GPU_CHANNELS, 0, GL_RED_INTEGER, GL_UNSIGNED_INT,
+				 zeros.data());
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-	GenerateHeatmap(green, IMAGE_WIDTH, IMAGE_HEIGHT, MINIMUM, MAXIMUM, GREEN_ITERS,
-					SAMPLE_COUNT, maxHeatmapValue, "green Channel: ");
+	glGenTextures(1, &o_gpu.levelsTexture);
+	glBindTexture(GL_TEXTURE_2D, o_gpu.levelsTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, GPU_CHANNELS, 1, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, zeros.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-	// Scale the heatmap down
-	for (int row = 0; row < IMAGE_HEIGHT; ++row)
+	glGenVertexArrays(1, &o_gpu.vao);
+	return true;
+}
+
+void DestroyGpuBuddhabrot(GpuBuddhabrot &o_gpu)
+{
+	glDeleteTextures(1, &o_gpu.heatmapTexture);
+	glDeleteTextures(1, &o_gpu.levelsTexture);
+	glDeleteProgram(o_gpu.accumulateProgram);
+	glDeleteProgram(o_gpu.levelsProgram);
+	glDeleteProgram(o_gpu.displayProgram);
+	glDeleteVertexArrays(1, &o_gpu.vao);
+	o_gpu = GpuBuddhabrot();
+}
+
+// GPU counterpart of GenerateHeatmaps for the three display channels: adds samples
+//  [firstSample, firstSample + nSamples) of the seed's stream to the device heatmap,
+//  then refreshes the per-channel maxima
+void GpuGenerateHeatmaps(GpuBuddhabrot &gpu, const int channelIters[GPU_CHANNELS], const Complex &minimum,
+						 const Complex &maximum, long long nSamples, unsigned int seed, long long firstSample)
+{
+	int maxIters = *max_element(channelIters, channelIters + GPU_CHANNELS);
+
+	glUseProgram(gpu.accumulateProgram);
+	glBindImageTexture(0, gpu.heatmapTexture, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32UI);
+	glUniform1i(glGetUniformLocation(gpu.accumulateProgram, "heatmap"), 0);
+	glUniform3i(glGetUniformLocation(gpu.accumulateProgram, "channelIters"), channelIters[0], channelIters[1],
+				channelIters[2]);
+	glUniform1i(glGetUniformLocation(gpu.accumulateProgram, "maxIters"), maxIters);
+	glUniform2f(glGetUniformLocation(gpu.accumulateProgram, "minimum"), (float)minimum.r(), (float)minimum.i());
+	glUniform2f(glGetUniformLocation(gpu.accumulateProgram, "maximum"), (float)maximum.r(), (float)maximum.i());
+	glUniform1ui(glGetUniformLocation(gpu.accumulateProgram, "seed"), seed);
+	int sampleBaseLocation = glGetUniformLocation(gpu.accumulateProgram, "sampleBase");
+	int sampleCountLocation = glGetUniformLocation(gpu.accumulateProgram, "sampleCount");
+	for (long long base = 0; base < nSamples; base += GPU_SAMPLES_PER_DISPATCH)
 	{
-		for (int col = 0; col < IMAGE_WIDTH; ++col)
-		{
+		long long count = min(GPU_SAMPLES_PER_DISPATCH, nSamples - base);
+		glUniform1ui(sampleBaseLocation, (unsigned int)(firstSample + base));
+		glUniform1ui(sampleCountLocation, (unsigned int)count);
+		glDispatchCompute((unsigned int)((count + GPU_SAMPLE_GROUP - 1) / GPU_SAMPLE_GROUP), 1, 1);
+	}
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+	clearGpuLevels(gpu);
+	glUseProgram(gpu.levelsProgram);
+	glBindImageTexture(0, gpu.heatmapTexture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32UI);
+	glBindImageTexture(1, gpu.levelsTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+	glUniform1i(glGetUniformLocation(gpu.levelsProgram, "heatmap"), 0);
+	glUniform1i(glGetUniformLocation(gpu.levelsProgram, "levels"), 1);
+	glDispatchCompute((gpu.width + GPU_LEVELS_GROUP - 1) / GPU_LEVELS_GROUP,
+					  (gpu.height + GPU_LEVELS_GROUP - 1) / GPU_LEVELS_GROUP, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+// Tonemaps the device heatmap over the whole framebuffer, brightened by exposure
+void DrawGpuBuddhabrot(const GpuBuddhabrot &gpu, float exposure, int framebufferWidth, int framebufferHeight)
+{
+	glUseProgram(gpu.displayProgram);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, gpu.heatmapTexture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, gpu.levelsTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(glGetUniformLocation(gpu.displayProgram, "heatmap"), 0);
+	glUniform1i(glGetUniformLocation(gpu.displayProgram, "levels"), 1);
+	glUniform1f(glGetUniformLocation(gpu.displayProgram, "exposure"), exposure);
+	glUniform2f(glGetUniformLocation(gpu.displayProgram, "viewportSize"), (float)framebufferWidth,
+				(float)framebufferHeight);
+	glBindVertexArray(gpu.vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
 
-			red[row][col] = colorFromHeatmap(red[row][col], maxHeatmapValue, 1);
-			blue[row][col] = colorFromHeatmap(blue[row][col], maxHeatmapValue, 1);
-			green[row][col] = colorFromHeatmap(green[row][col], maxHeatmapValue, 1);
+void mouse_button_callback(GLFWwindow *window, int button, int action, int mods);
+bool processInput(GLFWwindow *window);
 
-			//cout<<red[row][col]<<endl;
-			vertices.push_back(-mapX(col));
-			vertices.push_back(-mapY(row));
-			vertices.push_back(0.0f);
-			vertices.push_back(red[row][col]);
-			vertices.push_back(green[row][col]);
-			vertices.push_back(blue[row][col]);
+// Brightness multiplier applied on top of normalization; Up/Down change it while running
+float displayExposure = 1.0f;
+const float EXPOSURE_STEP = 1.02f; // Per frame while a key is held
 
-			//	cout<<red[row][col]<<endl;
-			//vertices.push_back(0.0f);
-			//vertices.push_back(0.0f);
+int main(int argc, char **argv)
+{
+	// --headless renders to a file without ever touching GLFW, and --merge sums the
+	//  checkpoints such renders leave (see printRenderUsage). --sequence renders the
+	//  frames of a zoom the same way. --benchmark times the sampling core alone.
+	for (int i = 1; i < argc; ++i)
+	{
+		if (string(argv[i]) == "--headless")
+		{
+			return RunHeadless(argc, argv);
+		}
+		if (string(argv[i]) == "--merge")
+		{
+			return RunMerge(argc, argv);
+		}
+		if (string(argv[i]) == "--sequence")
+		{
+			return RunSequence(argc, argv);
+		}
+		if (string(argv[i]) == "--benchmark")
+		{
+			return RunBenchmark(argc, argv);
 		}
 	}
 
-	// glfw: initialize and configure
-	// ------------------------------
-	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	RenderConfig config;
+	config.options.progressSeconds = 1;
+	if (!ParseRenderArgs(argc, argv, config))
+	{
+		printRenderUsage();
+		return 1;
+	}
+	if (!config.outputPath.empty() || !config.checkpointPath.empty() || config.shardCount > 1 || config.hasEndView)
+	{
+		cout << "--output, --checkpoint and --shard need --headless, --end-view needs --sequence" << endl;
+		return 1;
+	}
+	int channelIters[GPU_CHANNELS];
+	copy(config.channelIters.begin(), config.channelIters.end(), channelIters);
 
-#ifdef __APPLE__
-	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // uncomment this statement to fix compilation on OS X
-#endif
+	// --gpu moves sampling and accumulation into a compute shader
+	// --progressive opens the window right away and keeps refining the image while sampling runs
+	// --compact-display shows the CPU heatmap from a half-float texture
+	bool useGpu = false, progressiveMode = false, compactDisplay = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		useGpu = useGpu || string(argv[i]) == "--gpu";
+		progressiveMode = progressiveMode || string(argv[i]) == "--progressive";
+		compactDisplay = compactDisplay || string(argv[i]) == "--compact-display";
+		config.display.continuous = config.display.continuous || string(argv[i]) == "--continuous";
+	}
+
+	// Allocate a heatmap of the size of our image, one channel per color
+	Heatmap heatmap(config.width, config.height, 3);
+	vector<HeatmapType> levels(GPU_CHANNELS, 0);
+	unique_ptr<ProgressiveRender> progressive;
+	auto renderOnCpu = [&]() {
+		if (progressiveMode)
+		{
+			// Workers start now so sampling overlaps window and context creation; the
+			//  first frames show an empty image until a batch lands
+			progressive.reset(new ProgressiveRender(config.width, config.height, config.channelIters, config.minimum,
+													config.maximum, config.nSamples, config.options));
+			progressive->start();
+			return;
+		}
+
+		// One pass over the samples feeds all three channels; each orbit only gets
+		//  iterated up to the largest of the channel caps
+		GenerateHeatmaps(heatmap, config.channelIters, config.minimum, config.maximum, 0, config.nSamples,
+						 "RGB Channels: ", config.options);
+
+		// Each channel is scaled by its own maximum, so the low-iteration channels are not
+		//  drowned out by the brighter high-iteration one
+		levels = NormalizationLevels(heatmap, NORMALIZE_CHANNEL_MAX);
+	};
+	if (!useGpu)
+	{
+		renderOnCpu();
+	}
 
-	// glfw window creation
-	// --------------------
-	GLFWwindow *window = glfwCreateWindow(IMAGE_WIDTH, IMAGE_HEIGHT, "Algorithmic Modeling Fractal Buddhabrot Set", NULL, NULL);
+	GLFWwindow *window = CreateRenderWindow(config.width, config.height, "Algorithmic Modeling Fractal Buddhabrot Set");
 	if (window == NULL)
 	{
-		std::cout << "Failed to create GLFW window" << std::endl;
-		glfwTerminate();
 		return -1;
 	}
-	glfwMakeContextCurrent(window);
-	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	//    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
-	// glad: load all OpenGL function pointers
-	// ---------------------------------------
-	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+	GpuBuddhabrot gpu;
+	unsigned int gpuSeed = config.options.seed != 0
+							   ? (unsigned int)config.options.seed
+							   : (unsigned int)chrono::high_resolution_clock::now().time_since_epoch().count();
+	long long gpuSamples = 0;
+	if (useGpu && (config.options.power != 2 || config.options.fractal != FRACTAL_MANDELBROT ||
+				   config.options.orbits != ORBITS_ESCAPING || config.options.precision == PRECISION_PERTURBATION ||
+				   hasSamplingDomain(config.options)))
 	{
-		std::cout << "Failed to initialize GLAD" << std::endl;
-		return -1;
+		cout << "The GPU backend only traces escaping orbits of z^2 + c in float, drawn over the view; falling back "
+			 << "to the CPU" << endl;
+		useGpu = false;
+		renderOnCpu();
+	}
+	if (useGpu)
+	{
+		if (CreateGpuBuddhabrot(gpu, config.width, config.height))
+		{
+			cout << "RGB Channels: sampling on the GPU" << endl;
+			if (!progressiveMode)
+			{
+				GpuGenerateHeatmaps(gpu, channelIters, config.minimum, config.maximum, config.nSamples, gpuSeed, 0);
+				gpuSamples = config.nSamples;
+			}
+		}
+		else
+		{
+			cout << "GPU backend needs compute shaders and image load/store; falling back to the CPU" << endl;
+			useGpu = false;
+			renderOnCpu();
+		}
 	}
 
-	// build and compile our shader program
-	// ------------------------------------
-	// vertex shader
-	int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-	glCompileShader(vertexShader);
-	// check for shader compile errors
-	int success;
-	char infoLog[512];
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-		std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n"
-				  << infoLog << std::endl;
-	}
-	// fragment shader
-	int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-	glCompileShader(fragmentShader);
-	// check for shader compile errors
-	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-		std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n"
-				  << infoLog << std::endl;
-	}
-	// link shaders
-	int shaderProgram = glCreateProgram();
-	glAttachShader(shaderProgram, vertexShader);
-	glAttachShader(shaderProgram, fragmentShader);
-	glLinkProgram(shaderProgram);
-	// check for linking errors
-	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-	if (!success)
-	{
-		glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-		std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
-				  << infoLog << std::endl;
-	}
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
-
-	// set up vertex data (and buffer(s)) and configure vertex attributes
-	// ------------------------------------------------------------------
-
-	points = vertices.size();
+	HeatmapDisplay display;
+	if (!useGpu)
+	{
+		if (!CreateHeatmapDisplay(display, config.width, config.height, compactDisplay))
+		{
+			glfwTerminate();
+			return -1;
+		}
+		UploadHeatmap(display, heatmap, levels);
+	}
 
 	// uncomment this call to draw in wireframe polygons.
 	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
 	// render loop
-	cout << "done" << endl;
-	unsigned int VBO, VAO;
-
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
-	// bind the Vertex Array Object first, then bind and set vertex buffer(s), and then configure vertex attributes(s).
-	glBindVertexArray(VAO);
-
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
-
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
-	// note that this is allowed, the call to glVertexAttribPointer registered VBO as the vertex attribute's bound vertex buffer object so afterwards we can safely unbind
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-	// You can unbind the VAO afterwards so other VAO calls won't accidentally modify this VAO, but this rarely happens. Modifying other
-	// VAOs requires a call to glBindVertexArray anyways so we generally don't unbind VAOs (nor VBOs) when it's not directly necessary.
-	glBindVertexArray(0);
-	// -----------
-	while (!glfwWindowShouldClose(window))
+	if (!progressive && (!useGpu || gpuSamples == config.nSamples))
 	{
+		cout << "done" << endl;
+	}
+	// -----------
+	double lastRefresh = glfwGetTime();
+	RunRenderLoop(window, config.display, [&](int framebufferWidth, int framebufferHeight) {
+		bool adjusting = processInput(window);
 
-		processInput(window);
+		// Progressive mode: fold in whatever the workers have finished since the last refresh
+		if (progressive && glfwGetTime() - lastRefresh >= PROGRESSIVE_REFRESH_SECONDS)
+		{
+			lastRefresh = glfwGetTime();
+			// Read before taking the snapshot so the last batch is never missed
+			bool finished = progressive->finished();
+			long long samples;
+			if (progressive->snapshot(heatmap, samples))
+			{
+				levels = NormalizationLevels(heatmap, NORMALIZE_CHANNEL_MAX);
+				UploadHeatmap(display, heatmap, levels);
+			}
+			if (finished)
+			{
+				cout << "done" << endl;
+				progressive.reset();
+			}
+		}
+		if (useGpu && gpuSamples < config.nSamples)
+		{
+			// One dispatch per frame keeps the window responsive while the GPU accumulates
+			long long count = min(GPU_SAMPLES_PER_DISPATCH, config.nSamples - gpuSamples);
+			GpuGenerateHeatmaps(gpu, channelIters, config.minimum, config.maximum, count, gpuSeed, gpuSamples);
+			gpuSamples += count;
+			if (gpuSamples == config.nSamples)
+			{
+				cout << "done" << endl;
+			}
+		}
 
 		//glClearColor(1,1, 1, 1.0f);
 		//glClear(GL_COLOR_BUFFER_BIT);
 
-		// draw our first triangle
-		glUseProgram(shaderProgram);
-		glBindVertexArray(VAO); // seeing as we only have a single VAO there's no need to bind it every time, but we'll do so to keep things a bit more organized
-		glDrawArrays(GL_POINTS, 0, points);
-		glfwSwapBuffers(window);
-		glfwPollEvents();
-		// ------------------------------------------------------------------
-	}
+		if (useGpu)
+		{
+			DrawGpuBuddhabrot(gpu, displayExposure, framebufferWidth, framebufferHeight);
+		}
+		else
+		{
+			DrawHeatmapDisplay(display, levels, displayExposure, framebufferWidth, framebufferHeight);
+		}
+
+		// Once sampling is done and no key is held, nothing changes until the next event
+		if (adjusting || (useGpu && gpuSamples < config.nSamples))
+		{
+			return REDRAW_NOW;
+		}
+		if (progressive)
+		{
+			return max(0.0, lastRefresh + PROGRESSIVE_REFRESH_SECONDS - glfwGetTime());
+		}
+		return REDRAW_ON_EVENT;
+	});
 
-	//glDeleteVertexArrays(1, &VAO);
-	//glDeleteBuffers(1, &VBO);
 	// optional: de-allocate all resources once they've outlived their purpose:
 	// ------------------------------------------------------------------------
 
+	// Closing the window early stops any sampling still in flight
+	progressive.reset();
+	if (useGpu)
+	{
+		DestroyGpuBuddhabrot(gpu);
+	}
+	else
+	{
+		DestroyHeatmapDisplay(display);
+	}
+
 	// glfw: terminate, clearing all previously allocated GLFW resources.
 
 	glfwTerminate();
@@ -380,18 +6004,19 @@ int main()
 
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 // ---------------------------------------------------------------------------------------------------------
-void processInput(GLFWwindow *window)
+// returns whether a key that changes the image over time is held
+bool processInput(GLFWwindow *window)
 {
-	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, true);
-}
-
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-// ---------------------------------------------------------------------------------------------
-
-void framebuffer_size_callback(GLFWwindow *window, int width, int height)
-{
-	// make sure the viewport matches the new window dimensions; note that width and
-	// height will be significantly larger than specified on retina displays.
-	glViewport(0, 0, width, height);
+	bool held = false;
+	if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
+	{
+		displayExposure *= EXPOSURE_STEP;
+		held = true;
+	}
+	if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
+	{
+		displayExposure /= EXPOSURE_STEP;
+		held = true;
+	}
+	return held;
 }
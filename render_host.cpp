@@ -0,0 +1,395 @@
+#include "render_host.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+//
+// GL entry points
+//
+// gladLoadGLLoader resolves the whole 3.3 API and every extension glad.cpp was
+//  generated with, hundreds of lookups on each launch. These are the functions the two
+//  programs actually call; a new call needs a line here, or its pointer stays null.
+//
+
+struct EntryPoint
+{
+	void **pointer;
+	const char *name;
+	bool required; // false: only there on some drivers, callers check before use
+};
+
+#define GL_ENTRY(name, required) {(void **)&glad_##name, #name, required}
+
+const EntryPoint ENTRY_POINTS[] = {
+	GL_ENTRY(glActiveTexture, true),
+	GL_ENTRY(glAttachShader, true),
+	GL_ENTRY(glBindBuffer, true),
+	GL_ENTRY(glBindTexture, true),
+	GL_ENTRY(glBindVertexArray, true),
+	GL_ENTRY(glBufferData, true),
+	GL_ENTRY(glBufferSubData, true),
+	GL_ENTRY(glClear, true),
+	GL_ENTRY(glClearColor, true),
+	GL_ENTRY(glCompileShader, true),
+	GL_ENTRY(glCreateProgram, true),
+	GL_ENTRY(glCreateShader, true),
+	GL_ENTRY(glDeleteBuffers, true),
+	GL_ENTRY(glDeleteProgram, true),
+	GL_ENTRY(glDeleteShader, true),
+	GL_ENTRY(glDeleteTextures, true),
+	GL_ENTRY(glDeleteVertexArrays, true),
+	GL_ENTRY(glDrawArrays, true),
+	GL_ENTRY(glEnableVertexAttribArray, true),
+	GL_ENTRY(glGenBuffers, true),
+	GL_ENTRY(glGenTextures, true),
+	GL_ENTRY(glGenVertexArrays, true),
+	GL_ENTRY(glGetIntegerv, true),
+	GL_ENTRY(glGetProgramInfoLog, true),
+	GL_ENTRY(glGetProgramiv, true),
+	GL_ENTRY(glGetShaderInfoLog, true),
+	GL_ENTRY(glGetShaderiv, true),
+	GL_ENTRY(glGetString, true),
+	GL_ENTRY(glGetStringi, true),
+	GL_ENTRY(glGetUniformLocation, true),
+	GL_ENTRY(glLinkProgram, true),
+	GL_ENTRY(glMapBufferRange, true),
+	GL_ENTRY(glPixelStorei, true),
+	GL_ENTRY(glPolygonMode, true),
+	GL_ENTRY(glShaderSource, true),
+	GL_ENTRY(glTexImage2D, true),
+	GL_ENTRY(glTexImage3D, true),
+	GL_ENTRY(glTexParameteri, true),
+	GL_ENTRY(glTexSubImage2D, true),
+	GL_ENTRY(glUniform1f, true),
+	GL_ENTRY(glUniform1i, true),
+	GL_ENTRY(glUniform1ui, true),
+	GL_ENTRY(glUniform2f, true),
+	GL_ENTRY(glUniform3f, true),
+	GL_ENTRY(glUniform3i, true),
+	GL_ENTRY(glUniform4f, true),
+	GL_ENTRY(glUnmapBuffer, true),
+	GL_ENTRY(glUseProgram, true),
+	GL_ENTRY(glVertexAttribPointer, true),
+	GL_ENTRY(glViewport, true),
+	// Compute backend (GL 4.3 or ARB_compute_shader + ARB_shader_image_load_store)
+	GL_ENTRY(glBindImageTexture, false),
+	GL_ENTRY(glDispatchCompute, false),
+	GL_ENTRY(glMemoryBarrier, false),
+	// Program cache (GL 4.1 or ARB_get_program_binary)
+	GL_ENTRY(glGetProgramBinary, false),
+	GL_ENTRY(glProgramBinary, false),
+	GL_ENTRY(glProgramParameteri, false),
+};
+
+#undef GL_ENTRY
+
+// Sets the GLAD_GL_ARB_* flags the programs test, which gladLoadGLLoader would have set
+void detectExtensions()
+{
+	int major = 0, minor = 0, count = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	int version = major * 10 + minor;
+	GLAD_GL_ARB_get_program_binary = version >= 41;
+	GLAD_GL_ARB_shader_image_load_store = version >= 42;
+	GLAD_GL_ARB_compute_shader = version >= 43;
+
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (int i = 0; i < count; ++i)
+	{
+		const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+		GLAD_GL_ARB_get_program_binary |= strcmp(extension, "GL_ARB_get_program_binary") == 0;
+		GLAD_GL_ARB_shader_image_load_store |= strcmp(extension, "GL_ARB_shader_image_load_store") == 0;
+		GLAD_GL_ARB_compute_shader |= strcmp(extension, "GL_ARB_compute_shader") == 0;
+	}
+	// A driver that names an extension without exporting its functions gets no use of it
+	GLAD_GL_ARB_get_program_binary &= glad_glGetProgramBinary && glad_glProgramBinary && glad_glProgramParameteri;
+	GLAD_GL_ARB_shader_image_load_store &= glad_glBindImageTexture && glad_glMemoryBarrier;
+	GLAD_GL_ARB_compute_shader &= glad_glDispatchCompute != NULL;
+}
+
+bool loadEntryPoints()
+{
+	for (const EntryPoint &entry : ENTRY_POINTS)
+	{
+		*entry.pointer = (void *)glfwGetProcAddress(entry.name);
+		if (!*entry.pointer && entry.required)
+		{
+			cout << "Missing OpenGL function " << entry.name << endl;
+			return false;
+		}
+	}
+	detectExtensions();
+	return true;
+}
+
+//
+// Window and render loop
+//
+
+void framebufferSizeCallback(GLFWwindow *window, int width, int height)
+{
+	// make sure the viewport matches the new window dimensions; note that width and
+	// height will be significantly larger than specified on retina displays.
+	glViewport(0, 0, width, height);
+}
+
+GLFWwindow *CreateRenderWindow(int width, int height, const char *title)
+{
+	// glfw: initialize and configure
+	// ------------------------------
+	glfwInit();
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // uncomment this statement to fix compilation on OS X
+#endif
+
+	// glfw window creation
+	// --------------------
+	GLFWwindow *window = glfwCreateWindow(width, height, title, NULL, NULL);
+	if (window == NULL)
+	{
+		std::cout << "Failed to create GLFW window" << std::endl;
+		glfwTerminate();
+		return NULL;
+	}
+	glfwMakeContextCurrent(window);
+	glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
+
+	if (!loadEntryPoints())
+	{
+		std::cout << "Failed to load OpenGL" << std::endl;
+		glfwTerminate();
+		return NULL;
+	}
+	return window;
+}
+
+void RunRenderLoop(GLFWwindow *window, const RenderLoopOptions &options, const function<double(int, int)> &frame)
+{
+	glfwSwapInterval(options.swapInterval);
+	while (!glfwWindowShouldClose(window))
+	{
+		if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+			glfwSetWindowShouldClose(window, true);
+
+		int framebufferWidth, framebufferHeight;
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		double wait = frame(framebufferWidth, framebufferHeight);
+
+		glfwSwapBuffers(window);
+		if (options.continuous || wait <= 0)
+			glfwPollEvents();
+		else if (std::isinf(wait))
+			glfwWaitEvents();
+		else
+			glfwWaitEventsTimeout(wait);
+	}
+}
+
+//
+// Shader programs
+//
+// A cached program is one file per (driver, sources) pair, named by a hash of both:
+//  a header, the driver's binary format, then the binary. The driver may still reject
+//  a binary (after an update that kept its version string, say); the program is then
+//  compiled as usual and the file rewritten.
+//
+
+const uint32_t PROGRAM_CACHE_MAGIC = 0x43505246; // "FRPC"
+
+// Where linked programs are kept: $FRACTAL_PROGRAM_CACHE if set (empty turns caching
+//  off), else $XDG_CACHE_HOME/fractals, else ~/.cache/fractals
+string programCacheDirectory()
+{
+	if (const char *dir = getenv("FRACTAL_PROGRAM_CACHE"))
+	{
+		return dir;
+	}
+	if (const char *dir = getenv("XDG_CACHE_HOME"))
+	{
+		return string(dir) + "/fractals";
+	}
+	if (const char *home = getenv("HOME"))
+	{
+		return string(home) + "/.cache/fractals";
+	}
+	return "";
+}
+
+// FNV-1a, 64 bits
+void hashBytes(uint64_t &io_hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		io_hash = (io_hash ^ bytes[i]) * 0x100000001B3ull;
+	}
+}
+
+// Cache file for stages on this driver, or "" when programs are not cached
+string programCachePath(const vector<pair<unsigned int, vector<const char *>>> &stages)
+{
+	int formats = 0;
+	if (GLAD_GL_ARB_get_program_binary)
+	{
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	}
+	string dir = programCacheDirectory();
+	if (formats == 0 || dir.empty())
+	{
+		return "";
+	}
+
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (unsigned int name : {GL_VENDOR, GL_RENDERER, GL_VERSION})
+	{
+		const char *text = (const char *)glGetString(name);
+		hashBytes(hash, text, strlen(text) + 1);
+	}
+	for (const pair<unsigned int, vector<const char *>> &stage : stages)
+	{
+		hashBytes(hash, &stage.first, sizeof(stage.first));
+		for (const char *piece : stage.second)
+		{
+			hashBytes(hash, piece, strlen(piece) + 1);
+		}
+	}
+
+	// mkdir -p; failures show up when the file is written
+	for (size_t slash = dir.find('/', 1); slash != string::npos; slash = dir.find('/', slash + 1))
+	{
+		mkdir(dir.substr(0, slash).c_str(), 0755);
+	}
+	mkdir(dir.c_str(), 0755);
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+	return dir + name;
+}
+
+// Links program from the binary cached at path; false if there is none, it is damaged
+//  or the driver refuses it
+bool loadCachedProgram(unsigned int program, const string &path)
+{
+	ifstream in(path, ios::binary | ios::ate);
+	streamoff fileBytes = in.tellg();
+	in.seekg(0);
+	uint32_t header[3]; // magic, binary format, size
+	if (!in.read((char *)header, sizeof(header)) || header[0] != PROGRAM_CACHE_MAGIC)
+	{
+		return false;
+	}
+	// The size is only trusted if it is what follows the header, so a damaged file
+	//  cannot ask for an arbitrary allocation
+	if (header[2] == 0 || fileBytes != (streamoff)sizeof(header) + (streamoff)header[2])
+	{
+		return false;
+	}
+	vector<char> binary(header[2]);
+	if (!in.read(binary.data(), binary.size()))
+	{
+		return false;
+	}
+	glProgramBinary(program, header[1], binary.data(), (int)binary.size());
+	int success;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	return success;
+}
+
+// Stores linked program at path, written aside and renamed so that a program launched
+//  meanwhile never reads half of it
+void saveCachedProgram(unsigned int program, const string &path)
+{
+	int length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+	{
+		return;
+	}
+	vector<char> binary(length);
+	unsigned int format = 0;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+	uint32_t header[3] = {PROGRAM_CACHE_MAGIC, format, (uint32_t)length};
+
+	string partial = path + ".partial";
+	{
+		ofstream out(partial, ios::binary | ios::trunc);
+		out.write((const char *)header, sizeof(header));
+		out.write(binary.data(), length);
+		if (!out)
+		{
+			remove(partial.c_str());
+			return;
+		}
+	}
+	rename(partial.c_str(), path.c_str());
+}
+
+unsigned int buildShaderProgram(const vector<pair<unsigned int, vector<const char *>>> &stages)
+{
+	unsigned int program = glCreateProgram();
+	string cachePath = programCachePath(stages);
+	if (!cachePath.empty() && loadCachedProgram(program, cachePath))
+	{
+		return program;
+	}
+
+	int success;
+	char infoLog[512];
+	vector<unsigned int> shaders;
+	bool ok = true;
+	for (const pair<unsigned int, vector<const char *>> &stage : stages)
+	{
+		unsigned int shader = glCreateShader(stage.first);
+		glShaderSource(shader, (int)stage.second.size(), stage.second.data(), NULL);
+		glCompileShader(shader);
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+		if (!success)
+		{
+			glGetShaderInfoLog(shader, 512, NULL, infoLog);
+			std::cout << "ERROR::SHADER::PROGRAM::COMPILATION_FAILED\n"
+					  << infoLog << std::endl;
+			ok = false;
+		}
+		glAttachShader(program, shader);
+		shaders.push_back(shader);
+	}
+	if (!cachePath.empty())
+	{
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	glLinkProgram(program);
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success)
+	{
+		glGetProgramInfoLog(program, 512, NULL, infoLog);
+		std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
+				  << infoLog << std::endl;
+		ok = false;
+	}
+	for (unsigned int shader : shaders)
+	{
+		glDeleteShader(shader);
+	}
+	if (!ok)
+	{
+		glDeleteProgram(program);
+		return 0;
+	}
+	if (!cachePath.empty())
+	{
+		saveCachedProgram(program, cachePath);
+	}
+	return program;
+}
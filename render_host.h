@@ -0,0 +1,48 @@
+#pragma once
+
+//
+// Render host
+//
+// Window, GL and shader setup shared by buddhabrot.cpp and tree.cpp. Build it into
+//  both programs next to glad.cpp. Only the GL entry points the programs call are
+//  loaded, and linked programs are cached on disk, so a relaunch skips both the full
+//  extension scan and shader compilation.
+//
+
+#include <glad/glad.h>
+#include <glfw3.h>
+#include <cmath>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Opens a width x height window with a 3.3 core context made current and the GL entry
+//  points loaded. The viewport follows the framebuffer size. Returns NULL, with GLFW
+//  terminated again, on failure; otherwise call glfwTerminate() when done.
+GLFWwindow *CreateRenderWindow(int width, int height, const char *title);
+
+// Compiles and links a program from (shader type, source pieces) pairs, printing any
+//  errors. The pieces of a stage are concatenated, so a version header can be chosen at
+//  runtime. Where the driver supports program binaries, a linked program is stored
+//  under programCacheDirectory() and later builds of the same sources on the same
+//  driver load it instead of compiling. Returns 0 on failure.
+unsigned int buildShaderProgram(const std::vector<std::pair<unsigned int, std::vector<const char *>>> &stages);
+
+// How RunRenderLoop paces frames
+struct RenderLoopOptions
+{
+	int swapInterval = 1;	 // Vertical blanks per buffer swap; 0 turns vsync off
+	bool continuous = false; // Redraw on every pass, as the loop did before it could idle
+};
+
+// What a frame returns: the seconds until it needs drawing again with no new events.
+//  Input, a resize or anything else that wakes GLFW draws it sooner.
+const double REDRAW_NOW = 0.0;
+const double REDRAW_ON_EVENT = INFINITY;
+
+// Calls frame(framebufferWidth, framebufferHeight) and presents the result until the
+//  window is closed; Escape closes it. Between frames the loop sleeps in
+//  glfwWaitEvents for as long as the frame allows, so a finished image costs no CPU or
+//  GPU time until something changes. Work finishing on another thread can cut the
+//  wait short with glfwPostEmptyEvent().
+void RunRenderLoop(GLFWwindow *window, const RenderLoopOptions &options, const std::function<double(int, int)> &frame);
@@ -1,31 +1,58 @@
-#include <glad/glad.h>
-#include <glfw3.h>
+#include "render_host.h"
 #include <math.h>
 #include <vector>
 #include <iostream>
 #include <stack>
+#include <thread>
+#include <algorithm>
 
 #define PI 3.145
 float angle = 50 * PI / 180.0;
 int it = 10;
 float ratioT = .75;
+// view: the window center looks at window coordinate (SCR_WIDTH / 2 + panX,
+// SCR_HEIGHT / 2 + panY), magnified zoom times
+float panX = 0, panY = 0, zoom = 1;
 using namespace std;
 vector<float> vertices;
+// --compact: vertices are uploaded as normalized int16 relative to the tree's bounds
+bool compact = false;
+vector<short> packed;
 
-void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 void mouse_button_callback(GLFWwindow *window, int button, int action, int mods);
-void processInput(GLFWwindow *window);
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods);
+void scroll_callback(GLFWwindow *window, double xoffset, double yoffset);
+bool processInput(GLFWwindow *window);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+// levels with fewer segments than this are generated on the calling thread
+const size_t PARALLEL_SEGMENTS = 1 << 15;
+// trunk x1, y1, x2, y2 in window coordinates
+const float TRUNK[4] = {400.0, 100.0, 400.0, 300.0};
+// editing: radians and ratioT per second a held key changes them by, and their limits
+const float ANGLE_SPEED = 0.5;
+const float RATIO_SPEED = 0.2;
+const float RATIO_MIN = 0.1;
+const float RATIO_MAX = 0.9;
+const int MAX_DEPTH = 24;
+const float PAN_SPEED = 300.0; // window pixels per second at zoom 1
+const float ZOOM_STEP = 1.1;   // per scroll notch
+// --lod: segments whose branches would be shorter than this many pixels stop branching
+const float LOD_PIXELS = 1.0;
 
 const char *vertexShaderSource = "#version 330 core\n"
                                  "layout (location = 0) in vec2 aPos;\n"
+                                 "uniform vec3 packing;\n" // aPos is packing.xy + aPos * packing.z in window coordinates
+                                 "uniform vec2 screen;\n"
+                                 "uniform vec3 view;\n" // panX, panY, zoom
                                  "out vec4 vertexColor;\n"
                                  "void main()\n"
                                  "{\n"
-                                 "   gl_Position = vec4(aPos.x, aPos.y, 0, 2.0);\n"
+                                 "   vec2 pos = packing.xy + aPos * packing.z;\n"
+                                 "   pos = (pos - screen / 2.0 - view.xy) * view.z + screen / 2.0;\n"
+                                 "   gl_Position = vec4(pos * 2.0 / screen - 1.0, 0, 2.0);\n"
                                  "vertexColor = vec4(0.5, 0.0, 0.0, 1.0);\n"
                                  "}\0";
 const char *fragmentShaderSource = "#version 330 core\n"
@@ -35,145 +62,346 @@ const char *fragmentShaderSource = "#version 330 core\n"
                                    "{\n"
                                    "   FragColor = vertexColor;\n"
                                    "}\n\0";
+// --gpu: draws treeSegments(it) segments from no vertex data at all. vertex i is an
+// end of segment i / 2, whose heap index spells out its path from the trunk: after
+// the leading 1, bit 0 takes the left branch and bit 1 the right. the shader walks
+// that path applying the same step as tree(), so only the trunk, the rotation and
+// ratioT are uploaded.
+const char *gpuVertexShaderSource = "#version 330 core\n"
+                                    "uniform vec4 trunk;\n" // x1, y1, x2, y2 in window coordinates
+                                    "uniform vec2 turn;\n"  // cos, sin of half the branch angle
+                                    "uniform float ratio;\n"
+                                    "uniform vec2 screen;\n"
+                                    "uniform vec3 view;\n"
+                                    "out vec4 vertexColor;\n"
+                                    "void main()\n"
+                                    "{\n"
+                                    "   int path = gl_VertexID / 2 + 1;\n"
+                                    "   int level = 0;\n"
+                                    "   while ((path >> (level + 1)) != 0)\n"
+                                    "      level++;\n"
+                                    "   vec2 start = trunk.xy;\n"
+                                    "   vec2 branch = trunk.zw - trunk.xy;\n"
+                                    "   for (int bit = level - 1; bit >= 0; bit--)\n"
+                                    "   {\n"
+                                    "      start += branch;\n"
+                                    "      branch *= ratio;\n"
+                                    "      float s = ((path >> bit) & 1) == 0 ? turn.y : -turn.y;\n"
+                                    "      branch = vec2(branch.x * turn.x - branch.y * s, branch.x * s + branch.y * turn.x);\n"
+                                    "   }\n"
+                                    "   vec2 end = (gl_VertexID & 1) == 0 ? start : start + branch;\n"
+                                    "   end = (end - screen / 2.0 - view.xy) * view.z + screen / 2.0;\n"
+                                    "   gl_Position = vec4(end * 2.0 / screen - 1.0, 0, 2.0);\n"
+                                    "vertexColor = vec4(0.5, 0.0, 0.0, 1.0);\n"
+                                    "}\0";
 
 int points;
 
-float mapX(float x)
+// number of segments in a tree n levels deep: the trunk, then two branches for
+// every segment of the level above
+size_t treeSegments(int n)
 {
-    return x * 2.0 / SCR_WIDTH - 1.0;
+    return ((size_t)2 << n) - 1;
 }
 
-float mapY(float y)
+// runs fn(begin, end) over slices of [begin, end), on one thread per core when the
+// range is large enough to be worth it: at least grain items per thread
+template <typename Fn>
+void parallelFor(size_t begin, size_t end, Fn fn, size_t grain = PARALLEL_SEGMENTS)
 {
-    return y * 2.0 / SCR_HEIGHT - 1.0;
+    size_t nThreads = max(1u, thread::hardware_concurrency());
+    nThreads = min(nThreads, (end - begin) / grain);
+    if (nThreads <= 1)
+    {
+        fn(begin, end);
+        return;
+    }
+    vector<thread> workers;
+    for (size_t t = 0; t < nThreads; t++)
+    {
+        workers.emplace_back(fn, begin + (end - begin) * t / nThreads, begin + (end - begin) * (t + 1) / nThreads);
+    }
+    for (thread &worker : workers)
+        worker.join();
 }
-void tree(float x1, float y1, float x2, float y2, float angle, int n)
+
+// the two branches of segment s (x1, y1, x2, y2), written to o_branches
+inline void branch(const float *s, float t, double c, double sn, float *o_branches)
 {
-    vertices.push_back(mapX(x1));
-    vertices.push_back(mapY(y1));
-    vertices.push_back(mapX(x2));
-    vertices.push_back(mapY(y2));
+    float x3 = (1 - t) * s[0] + t * s[2];
+    float y3 = (1 - t) * s[1] + t * s[3];
+    x3 -= s[2];
+    y3 -= s[3];
+    o_branches[0] = s[2];
+    o_branches[1] = s[3];
+    o_branches[2] = x3 * c - y3 * sn + s[2];
+    o_branches[3] = x3 * sn + y3 * c + s[3];
+    o_branches[4] = s[2];
+    o_branches[5] = s[3];
+    o_branches[6] = x3 * c + y3 * sn + s[2];
+    o_branches[7] = -x3 * sn + y3 * c + s[3];
+}
 
-    if (n <= 0)
-        return;
+// index of the first segment of a level
+size_t levelStart(int level)
+{
+    return ((size_t)1 << level) - 1;
+}
+
+// builds the tree from the trunk (x1, y1) -> (x2, y2) n levels deep into vertices,
+// 4 floats (x1, y1, x2, y2) per segment in window coordinates. segments are laid out
+// level by level, the two branches of segment k at 2k + 1 and 2k + 2, so each level
+// only reads the one before it and its segments can be generated in parallel. levels
+// before from are taken to be in vertices already, so growing a tree only computes
+// the new levels, and shrinking it computes nothing.
+void tree(float x1, float y1, float x2, float y2, float angle, int n, int from = 0)
+{
+    vertices.resize(treeSegments(n) * 4);
+    float *v = vertices.data();
+    if (from == 0)
+    {
+        v[0] = x1;
+        v[1] = y1;
+        v[2] = x2;
+        v[3] = y2;
+    }
 
-    int newn = n - 1;
+    // every branch turns by the same angle, so the rotation is computed once
+    double c = cos(angle / 2.0);
+    double s = sin(angle / 2.0);
     float t = 1.0 + ratioT; //decrement
-    float x3 = (1 - t) * x1 + t * x2;
-    float y3 = (1 - t) * y1 + t * y2;
-    x3 -= x2;
-    y3 -= y2;
-
-    tree(x2, y2,
-         x3 * cos(angle / 2.0) - y3 * sin(angle / 2.0) + x2,
-         x3 * sin(angle / 2.0) + y3 * cos(angle / 2.0) + y2,
-         angle, newn);
-    tree(x2, y2,
-         x3 * cos(angle / 2.0) + y3 * sin(angle / 2.0) + x2,
-         -x3 * sin(angle / 2.0) + y3 * cos(angle / 2.0) + y2,
-         angle, newn);
-}
-int main()
-{
-    // glfw: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // uncomment this statement to fix compilation on OS X
-#endif
-
-    // glfw window creation
-    // --------------------
-    GLFWwindow *window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
-    if (window == NULL)
+    for (int level = max(from, 1) - 1; level < n; level++)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
+        parallelFor(levelStart(level), levelStart(level + 1), [=](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++)
+                branch(v + k * 4, t, c, s, v + (2 * k + 1) * 4);
+        });
     }
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
-    //    glfwSetMouseButtonCallback(window, mouse_button_callback);
+}
 
-    // glad: load all OpenGL function pointers
-    // ---------------------------------------
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+// --lod: builds the tree like tree(), but only the segments the current view can
+// show. a segment branches only while its branches would be at least LOD_PIXELS long
+// on screen and the disc holding everything below it reaches into the view: each
+// level is ratioT times shorter, so nothing below a segment of length l lies further
+// than l * ratioT / (1 - ratioT) from its end. segments are kept level by level with
+// the culled ones left out, so the cost follows the visible detail, not 2^n. each
+// level is counted in chunks first, so that threads can then write their kept
+// branches straight to their final place.
+void treeLod(float x1, float y1, float x2, float y2, float angle, int n)
+{
+    // gl_Position's w of 2 halves everything, so one window unit is zoom / 2 pixels
+    float pixels = zoom / 2;
+    float reach = ratioT / (1 - ratioT);
+    float minX = SCR_WIDTH / 2.0 + panX - SCR_WIDTH / zoom, maxX = SCR_WIDTH / 2.0 + panX + SCR_WIDTH / zoom;
+    float minY = SCR_HEIGHT / 2.0 + panY - SCR_HEIGHT / zoom, maxY = SCR_HEIGHT / 2.0 + panY + SCR_HEIGHT / zoom;
+    auto branches = [=](const float *s) {
+        float length = hypot(s[2] - s[0], s[3] - s[1]);
+        float dx = s[2] - min(max(s[2], minX), maxX);
+        float dy = s[3] - min(max(s[3], minY), maxY);
+        float radius = length * reach;
+        return length * ratioT * pixels >= LOD_PIXELS && dx * dx + dy * dy <= radius * radius;
+    };
+
+    double c = cos(angle / 2.0);
+    double sn = sin(angle / 2.0);
+    float t = 1.0 + ratioT; //decrement
+    vertices.assign({x1, y1, x2, y2});
+    size_t levelBegin = 0, levelEnd = 1;
+    for (int level = 0; level < n && levelEnd > levelBegin; level++)
     {
-        std::cout << "Failed to initialize GLAD" << std::endl;
-        return -1;
+        size_t chunks = (levelEnd - levelBegin + PARALLEL_SEGMENTS - 1) / PARALLEL_SEGMENTS;
+        vector<size_t> offsets(chunks + 1, 0);
+        const float *counted = vertices.data();
+        parallelFor(0, chunks, [&, counted](size_t begin, size_t end) {
+            for (size_t chunk = begin; chunk < end; chunk++)
+            {
+                size_t last = min(levelEnd, levelBegin + (chunk + 1) * PARALLEL_SEGMENTS);
+                for (size_t k = levelBegin + chunk * PARALLEL_SEGMENTS; k < last; k++)
+                    offsets[chunk + 1] += branches(counted + k * 4) ? 2 : 0;
+            }
+        }, 1);
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+            offsets[chunk + 1] += offsets[chunk];
+
+        vertices.resize((levelEnd + offsets[chunks]) * 4);
+        float *v = vertices.data();
+        parallelFor(0, chunks, [&, v](size_t begin, size_t end) {
+            for (size_t chunk = begin; chunk < end; chunk++)
+            {
+                float *out = v + (levelEnd + offsets[chunk]) * 4;
+                size_t last = min(levelEnd, levelBegin + (chunk + 1) * PARALLEL_SEGMENTS);
+                for (size_t k = levelBegin + chunk * PARALLEL_SEGMENTS; k < last; k++)
+                {
+                    if (branches(v + k * 4))
+                    {
+                        branch(v + k * 4, t, c, sn, out);
+                        out += 8;
+                    }
+                }
+            }
+        }, 1);
+        levelBegin = levelEnd;
+        levelEnd += offsets[chunks];
     }
+}
 
-    // build and compile our shader program
-    // ------------------------------------
-    // vertex shader
-    int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    glCompileShader(vertexShader);
-    // check for shader compile errors
-    int success;
-    char infoLog[512];
-    glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if (!success)
+// the square every branch lies in, as center x, y and half its side: each level is
+// ratioT times shorter than the one before, so nothing is further from the trunk's end
+// than the trunk is long times ratioT / (1 - ratioT)
+void treeBounds(float o_bounds[3])
+{
+    float length = hypot(TRUNK[2] - TRUNK[0], TRUNK[3] - TRUNK[1]);
+    o_bounds[0] = TRUNK[2];
+    o_bounds[1] = TRUNK[3];
+    o_bounds[2] = length * max(1.0f, ratioT / (1 - ratioT));
+}
+
+// --compact: converts vertices from segment first on into packed, as normalized int16
+// offsets within treeBounds. that halves the upload, at a resolution of 1 / 32767 of
+// the bounds: at the default ratio 600 / 32767, about 0.018 window units or 0.009
+// pixels at zoom 1, so a small fraction of a pixel until zoomed in far.
+void packTree(size_t first)
+{
+    float bounds[3];
+    treeBounds(bounds);
+    float scale = 32767 / bounds[2];
+    packed.resize(vertices.size());
+    parallelFor(first * 2, vertices.size() / 2, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++)
+        {
+            for (int axis = 0; axis < 2; axis++)
+            {
+                float offset = (vertices[2 * k + axis] - bounds[axis]) * scale;
+                packed[2 * k + axis] = lrint(min(32767.0f, max(-32767.0f, offset)));
+            }
+        }
+    });
+}
+
+// copies segments from first on out of vertices into the bound VBO, whose storage is
+// io_capacity bytes. storage that is too small is reallocated; a full update orphans
+// the old storage, so the driver hands over fresh memory instead of waiting for the
+// frame still drawing from it.
+void uploadTree(size_t first, size_t &io_capacity)
+{
+    const char *data = (const char *)vertices.data();
+    size_t vertexBytes = 2 * sizeof(float);
+    if (compact)
     {
-        glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n"
-                  << infoLog << std::endl;
+        packTree(first);
+        data = (const char *)packed.data();
+        vertexBytes = 2 * sizeof(short);
     }
-    // fragment shader
-    int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    glCompileShader(fragmentShader);
-    // check for shader compile errors
-    glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if (!success)
+    size_t bytes = vertices.size() / 2 * vertexBytes;
+    size_t offset = first * 2 * vertexBytes;
+    if (bytes > io_capacity)
     {
-        glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n"
-                  << infoLog << std::endl;
+        glBufferData(GL_ARRAY_BUFFER, bytes, data, GL_DYNAMIC_DRAW);
+        io_capacity = bytes;
+        return;
     }
-    // link shaders
-    int shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    // check for linking errors
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success)
+    if (offset >= bytes)
+        return;
+    if (first == 0)
+        glBufferData(GL_ARRAY_BUFFER, io_capacity, NULL, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, bytes - offset, data + offset);
+}
+
+// sets the tree's parameters and the view on program; the cpu program only uses
+// screen, view and packing
+void setTreeUniforms(int program)
+{
+    glUseProgram(program);
+    glUniform4f(glGetUniformLocation(program, "trunk"), TRUNK[0], TRUNK[1], TRUNK[2], TRUNK[3]);
+    glUniform2f(glGetUniformLocation(program, "turn"), cos(angle / 2.0), sin(angle / 2.0));
+    glUniform1f(glGetUniformLocation(program, "ratio"), ratioT);
+    glUniform2f(glGetUniformLocation(program, "screen"), SCR_WIDTH, SCR_HEIGHT);
+    glUniform3f(glGetUniformLocation(program, "view"), panX, panY, zoom);
+    float bounds[3] = {0, 0, 1};
+    if (compact)
+        treeBounds(bounds);
+    glUniform3f(glGetUniformLocation(program, "packing"), bounds[0], bounds[1], bounds[2]);
+}
+
+// everything the drawn tree depends on, to tell what changed since the last frame
+struct TreeParams
+{
+    float angle, ratioT;
+    int it;
+    float panX, panY, zoom;
+};
+
+TreeParams treeParams()
+{
+    return {angle, ratioT, it, panX, panY, zoom};
+}
+int main(int argc, char **argv)
+{
+    GLFWwindow *window = CreateRenderWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL");
+    if (window == NULL)
+        return -1;
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetScrollCallback(window, scroll_callback);
+    //    glfwSetMouseButtonCallback(window, mouse_button_callback);
+
+    // build and compile our shader program
+    // ------------------------------------
+    bool gpu = false, lod = false;
+    RenderLoopOptions loop;
+    for (int i = 1; i < argc; i++)
     {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
-                  << infoLog << std::endl;
+        if (string(argv[i]) == "--vsync" && i + 1 < argc)
+            loop.swapInterval = max(0, atoi(argv[++i]));
+        loop.continuous = loop.continuous || string(argv[i]) == "--continuous";
+        gpu = gpu || string(argv[i]) == "--gpu";
+        lod = lod || string(argv[i]) == "--lod";
+        compact = compact || string(argv[i]) == "--compact";
     }
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+    // the gpu path derives every vertex from its index, so there is nothing to cull
+    lod = lod && !gpu;
+    int shaderProgram = buildShaderProgram({{GL_VERTEX_SHADER, {gpu ? gpuVertexShaderSource : vertexShaderSource}},
+                                            {GL_FRAGMENT_SHADER, {fragmentShaderSource}}});
 
     // set up vertex data (and buffer(s)) and configure vertex attributes
     // ------------------------------------------------------------------
 
-    tree(400.0, 100.0, 400.0, 300.0, angle, it);
-    //  for(int i=0;i<vertices.size();i++)
-    // cout<<vertices[i]<<" ";
-    points = vertices.size() ;
+    setTreeUniforms(shaderProgram);
+    points = treeSegments(it) * 2;
+    if (lod)
+    {
+        treeLod(TRUNK[0], TRUNK[1], TRUNK[2], TRUNK[3], angle, it);
+        points = vertices.size() / 2;
+    }
+    else if (!gpu)
+    {
+        tree(TRUNK[0], TRUNK[1], TRUNK[2], TRUNK[3], angle, it);
+        //  for(int i=0;i<vertices.size();i++)
+        // cout<<vertices[i]<<" ";
+    }
 
     // uncomment this call to draw in wireframe polygons.
     //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     // render loop
     unsigned int VBO, VAO;
+    size_t capacity = 0; // bytes of storage behind VBO
 
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
     // bind the Vertex Array Object first, then bind and set vertex buffer(s), and then configure vertex attributes(s).
     glBindVertexArray(VAO);
 
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
-
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void *)0);
-    glEnableVertexAttribArray(0);
+    // the gpu shader reads no attributes, but core profile still wants a VAO bound to draw
+    if (!gpu)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        uploadTree(0, capacity);
+
+        if (compact)
+            glVertexAttribPointer(0, 2, GL_SHORT, GL_TRUE, 2 * sizeof(short), (void *)0);
+        else
+            glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void *)0);
+        glEnableVertexAttribArray(0);
+    }
 
     // note that this is allowed, the call to glVertexAttribPointer registered VBO as the vertex attribute's bound vertex buffer object so afterwards we can safely unbind
     glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -182,10 +410,42 @@ int main()
     // VAOs requires a call to glBindVertexArray anyways so we generally don't unbind VAOs (nor VBOs) when it's not directly necessary.
     glBindVertexArray(0);
     // -----------
-    while (!glfwWindowShouldClose(window))
-    {
-
-        processInput(window);
+    TreeParams shown = treeParams();
+    RunRenderLoop(window, loop, [&](int framebufferWidth, int framebufferHeight) {
+        bool moving = processInput(window);
+        TreeParams now = treeParams();
+        bool reshaped = now.angle != shown.angle || now.ratioT != shown.ratioT;
+        bool deepened = now.it != shown.it;
+        bool viewed = now.panX != shown.panX || now.panY != shown.panY || now.zoom != shown.zoom;
+        if (reshaped || deepened || viewed)
+        {
+            // on the gpu a change is just new uniforms. on the cpu a new angle or ratio
+            // moves every branch, a new depth only adds or drops levels, and a new view
+            // needs nothing, unless --lod has to pick the visible segments again.
+            setTreeUniforms(shaderProgram);
+            if (lod)
+            {
+                treeLod(TRUNK[0], TRUNK[1], TRUNK[2], TRUNK[3], angle, it);
+                glBindBuffer(GL_ARRAY_BUFFER, VBO);
+                uploadTree(0, capacity);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                points = vertices.size() / 2;
+            }
+            else if (!gpu && (reshaped || deepened))
+            {
+                int from = reshaped ? 0 : shown.it + 1;
+                tree(TRUNK[0], TRUNK[1], TRUNK[2], TRUNK[3], angle, it, from);
+                glBindBuffer(GL_ARRAY_BUFFER, VBO);
+                uploadTree(from == 0 ? 0 : levelStart(from), capacity);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                points = treeSegments(it) * 2;
+            }
+            else
+            {
+                points = treeSegments(it) * 2;
+            }
+            shown = now;
+        }
 
         // glClearColor(R, G, B, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
@@ -195,10 +455,9 @@ int main()
         glBindVertexArray(VAO); // seeing as we only have a single VAO there's no need to bind it every time, but we'll do so to keep things a bit more organized
         glDrawArrays(GL_LINES, 0, points);
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
-        // ------------------------------------------------------------------
-    }
+        // a held key animates the tree; otherwise wait for the next scroll, key or resize
+        return moving ? REDRAW_NOW : REDRAW_ON_EVENT;
+    });
 
     //glDeleteVertexArrays(1, &VAO);
     //glDeleteBuffers(1, &VBO);
@@ -213,18 +472,59 @@ int main()
 
 // process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
 // ---------------------------------------------------------------------------------------------------------
-void processInput(GLFWwindow *window)
+// returns whether any of the keys is held, so the caller keeps drawing
+bool processInput(GLFWwindow *window)
 {
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    // left/right open and close the branches, up/down lengthen and shorten them, at
+    // the same speed whatever the frame rate. the loop may have idled since the last
+    // call, so a key pressed after a pause starts from no elapsed time.
+    static double last = glfwGetTime();
+    static bool wasHeld = false;
+    double now = glfwGetTime();
+    float dt = wasHeld ? now - last : 0;
+    last = now;
+    const int keys[] = {GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP, GLFW_KEY_DOWN,
+                        GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_S, GLFW_KEY_W};
+    bool held = false;
+    for (int key : keys)
+        held = held || glfwGetKey(window, key) == GLFW_PRESS;
+    wasHeld = held;
+    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS)
+        angle -= ANGLE_SPEED * dt;
+    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS)
+        angle += ANGLE_SPEED * dt;
+    if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS)
+        ratioT = max(RATIO_MIN, ratioT - RATIO_SPEED * dt);
+    if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS)
+        ratioT = min(RATIO_MAX, ratioT + RATIO_SPEED * dt);
+
+    // w/a/s/d pan the view
+    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+        panX -= PAN_SPEED * dt / zoom;
+    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+        panX += PAN_SPEED * dt / zoom;
+    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+        panY -= PAN_SPEED * dt / zoom;
+    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+        panY += PAN_SPEED * dt / zoom;
+    return held;
 }
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-// ---------------------------------------------------------------------------------------------
+// glfw: the scroll wheel zooms around the window center
+// ------------------------------------------------------
+void scroll_callback(GLFWwindow *window, double xoffset, double yoffset)
+{
+    zoom *= pow(ZOOM_STEP, yoffset);
+}
 
-void framebuffer_size_callback(GLFWwindow *window, int width, int height)
+// glfw: depth changes one level per key press, so they go through the key callback
+// ---------------------------------------------------------------------------------
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
 {
-    // make sure the viewport matches the new window dimensions; note that width and
-    // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    if (action != GLFW_PRESS)
+        return;
+    if (key == GLFW_KEY_EQUAL || key == GLFW_KEY_KP_ADD)
+        it = min(MAX_DEPTH, it + 1);
+    if (key == GLFW_KEY_MINUS || key == GLFW_KEY_KP_SUBTRACT)
+        it = max(0, it - 1);
 }